@@ -84,12 +84,14 @@ class CleaningActivity(StatefulActivity):
     def make_filter(self):
         self.state.aligner = fa_model = self.wdir('aligner')
         fastalign_build(self.args.src_lang, self.args.tgt_lang, self.state.preprocessed_corpora, fa_model,
-                        iterations=4, case_sensitive=False, favor_diagonal=False, log=self.log_fobj)
+                        iterations=4, case_sensitive=False, favor_diagonal=False,
+                        encoded_corpus=os.path.join(fa_model, 'corpus.enc'), log=self.log_fobj)
 
     @activitystep('Scoring corpora')
     def score(self):
         good_avg, good_std_dev, bad_avg, bad_std_dev = fastalign_score(
-            self.args.src_lang, self.args.tgt_lang, self.state.aligner, self.state.preprocessed_corpora)
+            self.args.src_lang, self.args.tgt_lang, self.state.aligner, self.state.preprocessed_corpora,
+            encoded_corpus=os.path.join(self.state.aligner, 'corpus.enc'))
         self.state.filter_stats = (good_avg, good_std_dev, bad_avg, bad_std_dev)
 
     @activitystep('Apply aligner-based filter')
@@ -128,7 +128,7 @@ def mmt_dedup(src_lang, tgt_lang, in_path, out_path, length_threshold=None):
 
 
 def fastalign_build(src_lang, tgt_lang, in_path, out_model, iterations=None,
-                    case_sensitive=True, favor_diagonal=True, log=None):
+                    case_sensitive=True, favor_diagonal=True, encoded_corpus=None, log=None):
     os.makedirs(out_model, exist_ok=True)
     out_model = os.path.join(out_model, '%s__%s.fam' % (src_lang, tgt_lang))
 
@@ -143,15 +143,18 @@ def fastalign_build(src_lang, tgt_lang, in_path, out_model, iterations=None,
         command.append('--case-insensitive')
     if not favor_diagonal:
         command.append('--no-favor-diagonal')
+    if encoded_corpus is not None:
+        command.extend(['-e', encoded_corpus])
 
     osutils.shell_exec(command, stdout=log, stderr=log, env=__mmt_env())
 
 
-def fastalign_score(src_lang, tgt_lang, model_path, in_path, out_path=None):
+def fastalign_score(src_lang, tgt_lang, model_path, in_path, out_path=None, encoded_corpus=None):
     model_path = os.path.join(model_path, '%s__%s.fam' % (src_lang, tgt_lang))
 
     command = [os.path.join(MMT_BIN_DIR, 'fa_score'), '-s', src_lang, '-t', tgt_lang,
-               '-m', model_path, '-i', in_path, '-o', out_path or in_path]
+               '-m', model_path, '-o', out_path or in_path]
+    command.extend(['-e', encoded_corpus] if encoded_corpus is not None else ['-i', in_path])
     stdout, _ = osutils.shell_exec(command, env=__mmt_env())
 
     result = dict()
@@ -196,6 +196,39 @@ public class FastAlign implements Aligner {
 
     private native float[] align(long nativeHandle, boolean reversed, String[][] sources, String[][] targets, int strategy, int[][] outputAlignment);
 
+    @Override
+    public void update(LanguageDirection language, List<? extends Sentence> sources, List<? extends Sentence> targets) throws AlignerException {
+        boolean reversed = false;
+
+        LanguageKey key = LanguageKey.parse(language);
+        Long nativeHandle = models.get(key);
+
+        if (nativeHandle == null) {
+            reversed = true;
+            nativeHandle = models.get(key.reversed());
+        }
+
+        if (nativeHandle == null)
+            throw new AlignerException("Unsupported language direction: " + language);
+
+        String[][] sourceArray = new String[sources.size()][];
+        String[][] targetArray = new String[targets.size()][];
+
+        Iterator<? extends Sentence> sourceIterator = sources.iterator();
+        Iterator<? extends Sentence> targetIterator = targets.iterator();
+
+        int i = 0;
+        while (sourceIterator.hasNext() && targetIterator.hasNext()) {
+            sourceArray[i] = XUtils.toTokensArray(sourceIterator.next());
+            targetArray[i] = XUtils.toTokensArray(targetIterator.next());
+            i++;
+        }
+
+        update(nativeHandle, reversed, sourceArray, targetArray);
+    }
+
+    private native void update(long nativeHandle, boolean reversed, String[][] sources, String[][] targets);
+
     @Override
     protected void finalize() throws Throwable {
         super.finalize();
@@ -5,16 +5,13 @@
 #include <iostream>
 #include <fstream>
 #include <fastalign/Corpus.h>
+#include <fastalign/EncodedCorpus.h>
 #include <fastalign/FastAligner.h>
+#include <fastalign/PrefetchReader.h>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include <thread>
 
-#ifdef _OPENMP
-#include <thread>
-#include <omp.h>
-#endif
-
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
@@ -29,13 +26,16 @@ namespace {
         string output_path;
         string model_path;
         string input_path;
+        string encoded_corpus_path;
         string source_lang;
         string target_lang;
         bool print_alignments = true;
         bool print_scores = true;
+        bool print_stats = false;
 
         Symmetrization strategy = GrowDiagonalFinalAnd;
         size_t buffer_size = 100000;
+        double band_tolerance = 0;
     };
 } // namespace
 
@@ -52,13 +52,18 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
             ("output,o", po::value<string>()->required(), "output folder for \"*.score\" and \"*.align\" files")
             ("source,s", po::value<string>()->required(), "source language")
             ("target,t", po::value<string>()->required(), "target language")
-            ("input,i", po::value<string>()->required(), "input folder containing the parallel files collection")
+            ("input,i", po::value<string>(), "input folder containing the parallel files collection")
+            ("encoded-corpus,e", po::value<string>(), "read the corpora from an encoded corpus file created by "
+                                                      "fa_build with the same model, instead of the input folder")
             ("strategy,a", po::value<size_t>(),
              "symmetrization strategy, valid values are (1) GrowDiagonalFinalAnd, (2) GrowDiagonal, (3) Intersection "
              "(4) Union. Default strategy is \"GrowDiagonalFinalAnd\"")
             ("batch-size,b", po::value<size_t>(), "input batch size, expressed in number of lines")
+            ("band", po::value<double>(), "align every target word only with the source words close to the "
+                    "diagonal, leaving out at most this fraction of the alignment prior (e.g. 0.01)")
             ("skip-alignments", "skip the creation of \"*.align\" files")
-            ("skip-scores", "skip the creation of \"*.score\" files");
+            ("skip-scores", "skip the creation of \"*.score\" files")
+            ("stats", "print to stderr the fraction of time the alignment threads were busy");
 
     po::variables_map vm;
     try {
@@ -72,19 +77,32 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
         po::notify(vm);
 
         args->model_path = vm["model"].as<string>();
-        args->input_path = vm["input"].as<string>();
+        if (vm.count("input"))
+            args->input_path = vm["input"].as<string>();
+        if (vm.count("encoded-corpus"))
+            args->encoded_corpus_path = vm["encoded-corpus"].as<string>();
+
+        if (args->input_path.empty() == args->encoded_corpus_path.empty())
+            throw po::error("exactly one of the options '--input' and '--encoded-corpus' is required");
         args->output_path = vm["output"].as<string>();
         args->source_lang = vm["source"].as<string>();
         args->target_lang = vm["target"].as<string>();
 
         args->print_alignments = !vm.count("skip-alignments");
         args->print_scores = !vm.count("skip-scores");
+        args->print_stats = vm.count("stats") > 0;
 
         if (vm.count("strategy"))
             args->strategy = (Symmetrization) vm["strategy"].as<size_t>();
 
         if (vm.count("batch-size"))
             args->buffer_size = vm["batch-size"].as<size_t>();
+
+        if (vm.count("band")) {
+            args->band_tolerance = vm["band"].as<double>();
+            if (args->band_tolerance < 0. || args->band_tolerance >= 1.)
+                throw po::error("the option '--band' must be in [0, 1)");
+        }
     } catch (po::error &e) {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         std::cerr << desc << std::endl;
@@ -113,15 +131,22 @@ void PrintScore(vector<alignment_t> &alignments, ofstream &out) {
     }
 }
 
-void AlignCorpus(const Corpus &corpus, size_t buffer_size, Symmetrization strategy, FastAligner &aligner,
-                 const string &outputPath, bool printAlignments, bool printScores) {
-    CorpusReader reader(corpus, &aligner.GetVocabulary());
+void PrintStats(const FastAligner &aligner) {
+    cerr << "threads busy: " << (aligner.GetBusyFraction() * 100.) << "%" << endl;
+}
+
+template<class Reader>
+void AlignCorpus(Reader &reader, const string &name, size_t buffer_size, Symmetrization strategy,
+                 FastAligner &aligner, const string &outputPath, bool printAlignments, bool printScores) {
+    PrefetchReader prefetch([&reader, buffer_size](PrefetchReader::batch_t &outBatch) {
+        return reader.Read(outBatch, buffer_size);
+    });
 
-    vector<pair<wordvec_t, wordvec_t>> batch;
+    PrefetchReader::batch_t batch;
     vector<alignment_t> alignments;
 
-    string alignPath = (fs::path(outputPath) / (corpus.GetName() + ".align")).string();
-    string scorePath = (fs::path(outputPath) / (corpus.GetName() + ".score")).string();
+    string alignPath = (fs::path(outputPath) / (name + ".align")).string();
+    string scorePath = (fs::path(outputPath) / (name + ".score")).string();
 
     ofstream alignStream;
     if (printAlignments)
@@ -131,7 +156,7 @@ void AlignCorpus(const Corpus &corpus, size_t buffer_size, Symmetrization strate
     if (printScores)
         scoreStream.open(scorePath.c_str(), ios_base::out);
 
-    while (reader.Read(batch, buffer_size)) {
+    while (prefetch.Read(batch)) {
         aligner.GetAlignments(batch, alignments, strategy);
 
         if (printAlignments)
@@ -140,26 +165,18 @@ void AlignCorpus(const Corpus &corpus, size_t buffer_size, Symmetrization strate
             PrintScore(alignments, scoreStream);
 
         alignments.clear();
-        batch.clear();
     }
 }
 
 int main(int argc, const char *argv[]) {
-    int threads = 1;
-
-#ifdef _OPENMP
-    threads = thread::hardware_concurrency();
-
-    omp_set_dynamic(0);
-    omp_set_num_threads(threads);
-#endif
+    int threads = (int) thread::hardware_concurrency();
 
     args_t args;
 
     if (!ParseArgs(argc, argv, &args))
         return ERROR_IN_COMMAND_LINE;
 
-    if (!fs::exists(args.input_path) || !fs::is_directory(args.input_path)) {
+    if (!args.input_path.empty() && (!fs::exists(args.input_path) || !fs::is_directory(args.input_path))) {
         cerr << "ERROR: input path is not a valid directory" << endl;
         return GENERIC_ERROR;
     }
@@ -172,20 +189,47 @@ int main(int argc, const char *argv[]) {
     if (!fs::is_directory(args.output_path))
         fs::create_directories(args.output_path);
 
+    if (!args.encoded_corpus_path.empty()) {
+        EncodedCorpus corpus(args.encoded_corpus_path);
+        FastAligner aligner(args.model_path, threads, kDefaultDenseRank);
+        aligner.SetBandTolerance(args.band_tolerance);
+
+        if (corpus.GetVocabularyFingerprint() != aligner.GetVocabulary().GetFingerprint()) {
+            cerr << "ERROR: encoded corpus was created with a different vocabulary" << endl;
+            return GENERIC_ERROR;
+        }
+
+        for (size_t part = 0; part < corpus.Size(); ++part) {
+            EncodedCorpusReader reader(corpus, part);
+            AlignCorpus(reader, corpus.GetName(part), args.buffer_size, args.strategy, aligner, args.output_path,
+                        args.print_alignments, args.print_scores);
+        }
+
+        if (args.print_stats)
+            PrintStats(aligner);
+
+        return SUCCESS;
+    }
+
     vector<Corpus> corpora;
     Corpus::List(args.input_path, args.source_lang, args.target_lang, corpora);
 
     if (corpora.empty())
         exit(0);
 
-    FastAligner aligner(args.model_path, threads);
+    FastAligner aligner(args.model_path, threads, kDefaultDenseRank);
+    aligner.SetBandTolerance(args.band_tolerance);
 
     // perform alignment of all corpora sequentially; multi-threading is used for each corpus
     for (size_t i = 0; i < corpora.size(); ++i) {
         Corpus &corpus = corpora[i];
-        AlignCorpus(corpus, args.buffer_size, args.strategy, aligner, args.output_path,
+        CorpusReader reader(corpus, &aligner.GetVocabulary());
+        AlignCorpus(reader, corpus.GetName(), args.buffer_size, args.strategy, aligner, args.output_path,
                     args.print_alignments, args.print_scores);
     }
 
+    if (args.print_stats)
+        PrintStats(aligner);
+
     return SUCCESS;
 }
\ No newline at end of file
@@ -17,6 +17,14 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <thread>
+#include <map>
+#include <cerrno>
+#include <cstring>
 #include <fastalign/Builder.h>
 #include <fastalign/FastAligner.h>
 #include <boost/program_options.hpp>
@@ -38,9 +46,14 @@ namespace {
         string model_path;
 
         Options options = Options();
+        bool threads_set = false;
+        bool external_workers = false;
+        long worker = -1;
     };
 } // namespace
 
+extern char **environ;
+
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 
@@ -54,12 +67,39 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
             ("input,i", po::value<string>()->required(), "input folder containing the parallel files collection")
             ("model,m", po::value<string>()->required(), "the output path")
             ("threads,T", po::value<unsigned int>(), "number of threads (default is number of CPU)")
-            ("iterations,I", po::value<unsigned int>(), "number of iterations in EM training (default is 5)")
+            ("iterations,I", po::value<unsigned int>(), "number of iterations in EM training, the maximum one with "
+                                                        "--convergence (default is 5)")
+            ("convergence", po::value<double>(), "stop training a direction when the relative improvement of its "
+                                                 "log-likelihood falls below this threshold, e.g. 0.01 "
+                                                 "(default is 0, run all the iterations)")
+            ("min-iterations", po::value<unsigned int>(), "minimum number of iterations with --convergence "
+                                                          "(default is 2)")
             ("prune,p", po::value<double>(), "final model pruning threshold (default is 1.e-20)")
             ("vocabulary-thr,v", po::value<double>(), "keeps only the most relevant terms in vocabulary "
                                                       "(default is 0.9999 - only the terms that cover "
                                                       "the 99.99% of the input corpora)")
             ("max-length,l", po::value<size_t>(), "max sentence length (default is 80)")
+            ("quantize,q", po::value<unsigned int>(), "store translation probabilities as 8 or 16-bit codes "
+                                                      "(default is 32-bit floats)")
+            ("encoded-corpus,e", po::value<string>(), "also store the encoded corpus in this file, so that fa_align "
+                                                       "and fa_score can read it without parsing the text again")
+            ("cooccurrences-memory", po::value<size_t>(), "memory used to collect co-occurrences in the initial pass, "
+                                                          "in MB: larger sets are sorted on disk (default is 1024)")
+            ("training-memory", po::value<size_t>(), "memory for the translation tables under training, in MB: "
+                                                     "larger tables are split in partitions stored on disk "
+                                                     "(default is unlimited)")
+            ("warm-start", po::value<string>(), "start training from the tables and diagonal tensions of this model, "
+                                                "e.g. the previous model of the same language pair: new words and "
+                                                "new pairs are initialized as usual, and fewer iterations are needed")
+            ("workers", po::value<size_t>(), "distribute the training to this number of worker processes, each one "
+                                             "training on a shard of the corpora (default is no workers)")
+            ("work-dir", po::value<string>(), "directory shared by the processes of a distributed training "
+                                              "(default is the output path + \".work\")")
+            ("worker", po::value<size_t>(), "run as the worker with this id, from 0 to workers - 1, of a distributed "
+                                            "training")
+            ("external-workers", "do not start the workers of a distributed training: they are started separately "
+                                 "with the same arguments plus --worker, even on other hosts sharing the work "
+                                 "directory")
             ("case-insensitive", "create a case insensitive model (default is case sensitive)")
             ("no-favor-diagonal", "don't enforce diagonal form of alignment (default is use diagonal)");
 
@@ -78,16 +118,44 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
         args->input_path = vm["input"].as<string>();
         args->model_path = vm["model"].as<string>();
 
-        if (vm.count("threads"))
+        if (vm.count("threads")) {
             args->options.threads = vm["threads"].as<unsigned int>();
+            args->threads_set = true;
+        }
         if (vm.count("iterations"))
             args->options.iterations = vm["iterations"].as<unsigned int>();
+        if (vm.count("convergence"))
+            args->options.convergence_threshold = vm["convergence"].as<double>();
+        if (vm.count("min-iterations"))
+            args->options.min_iterations = vm["min-iterations"].as<unsigned int>();
         if (vm.count("prune"))
             args->options.pruning_threshold = vm["prune"].as<double>();
         if (vm.count("vocabulary-thr"))
             args->options.vocabulary_threshold = vm["vocabulary-thr"].as<double>();
         if (vm.count("max-length"))
             args->options.max_line_length = vm["max-length"].as<size_t>();
+        if (vm.count("quantize"))
+            args->options.quantization_bits = vm["quantize"].as<unsigned int>();
+        if (vm.count("encoded-corpus"))
+            args->options.encoded_corpus_path = vm["encoded-corpus"].as<string>();
+        if (vm.count("cooccurrences-memory"))
+            args->options.cooccurrences_memory = vm["cooccurrences-memory"].as<size_t>() << 20;
+        if (vm.count("training-memory"))
+            args->options.training_memory = vm["training-memory"].as<size_t>() << 20;
+        if (vm.count("warm-start"))
+            args->options.initial_model = vm["warm-start"].as<string>();
+        if (vm.count("workers"))
+            args->options.workers = vm["workers"].as<size_t>();
+        if (vm.count("worker"))
+            args->worker = (long) vm["worker"].as<size_t>();
+        if (vm.count("external-workers"))
+            args->external_workers = true;
+
+        if (args->worker >= 0 && args->options.workers == 0)
+            throw po::error("option '--worker' requires option '--workers'");
+        if (args->options.workers > 0)
+            args->options.work_dir = vm.count("work-dir") ? vm["work-dir"].as<string>()
+                                                          : args->model_path + ".work";
 
         if (vm.count("case-insensitive"))
             args->options.case_sensitive = false;
@@ -119,7 +187,7 @@ public:
 
     void Begin(bool forward) override {
         processBegin = GetTime();
-        cerr << "== " << (forward ? "Forward" : "Backward") << " model training ==" << endl;
+        cerr << "== Forward and backward model training ==" << endl;
     }
 
     void IterationBegin(bool forward, int iteration) override {
@@ -152,6 +220,9 @@ public:
                 break;
         }
 
+        if (step != kBuilderStepSetup && step != kBuilderStepAligning)
+            str_step += forward ? " (forward)" : " (backward)";
+
         cerr << str_step << "... ";
         stepBegin = GetTime();
     }
@@ -160,6 +231,15 @@ public:
         cerr << "DONE in " << (GetTime() - stepBegin) << "s" << endl;
     }
 
+    void LogLikelihood(bool forward, int iteration, double logLikelihood, double perplexity) override {
+        cerr << "\tLog-likelihood (" << (forward ? "forward" : "backward") << "): " << logLikelihood
+             << ", perplexity: " << perplexity << endl;
+    }
+
+    void Converged(bool forward, int iteration) override {
+        cerr << "\t" << (forward ? "Forward" : "Backward") << " model converged" << endl;
+    }
+
     void IterationEnd(bool forward, int iteration) override {
         // Nothing to do
     }
@@ -193,6 +273,75 @@ private:
     }
 };
 
+/*
+ * Starts the local workers of a distributed training: every worker runs this executable with the same arguments
+ * plus --worker; unless --threads is given, the available threads are split among the workers.
+ */
+map<pid_t, size_t> SpawnWorkers(int argc, const char *argv[], const args_t &args) {
+    size_t workers = args.options.workers;
+    size_t threads = max((size_t) 1, (size_t) thread::hardware_concurrency() / workers);
+
+    map<pid_t, size_t> children;
+
+    for (size_t worker = 0; worker < workers; ++worker) {
+        vector<string> arguments(argv, argv + argc);
+        arguments.push_back("--worker");
+        arguments.push_back(to_string(worker));
+
+        if (!args.threads_set) {
+            arguments.push_back("--threads");
+            arguments.push_back(to_string(threads));
+        }
+
+        vector<char *> child_argv;
+        for (auto argument = arguments.begin(); argument != arguments.end(); ++argument)
+            child_argv.push_back(&(*argument)[0]);
+        child_argv.push_back(nullptr);
+
+        pid_t pid;
+        int error = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, child_argv.data(), environ);
+        if (error != 0) {
+            for (auto child = children.begin(); child != children.end(); ++child)
+                kill(child->first, SIGTERM);
+
+            throw runtime_error("Unable to start worker " + to_string(worker) + ": " + strerror(error));
+        }
+
+        children[pid] = worker;
+    }
+
+    return children;
+}
+
+/*
+ * Waits for the local workers: the error of a worker that failed without reporting it (e.g. it crashed) is
+ * reported on its behalf, so that the coordinator and the other workers stop.
+ */
+void WaitWorkers(map<pid_t, size_t> children, const string &workDir) {
+    while (!children.empty()) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        auto child = children.find(pid);
+        if (child == children.end())
+            continue;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            string message = WIFSIGNALED(status) ? "process killed by signal " + to_string(WTERMSIG(status))
+                                                 : "process exited with status " + to_string(WEXITSTATUS(status));
+            Builder::ReportError(workDir, "worker" + to_string(child->second), message);
+        }
+
+        children.erase(child);
+    }
+}
+
 int main(int argc, const char *argv[]) {
     args_t args;
 
@@ -204,9 +353,35 @@ int main(int argc, const char *argv[]) {
     Corpus::List(args.input_path, args.source_lang, args.target_lang, corpora);
 
     Builder builder(args.options);
+
+    if (args.worker >= 0) {
+        builder.Work(corpora, (size_t) args.worker);
+        return SUCCESS;
+    }
+
     builder.setListener(&listener);
 
-    builder.Build(corpora, args.model_path);
+    map<pid_t, size_t> children;
+    if (args.options.workers > 0 && !args.external_workers)
+        children = SpawnWorkers(argc, argv, args);
+
+    thread monitor;
+    if (!children.empty())
+        monitor = thread(WaitWorkers, children, args.options.work_dir);
+
+    try {
+        builder.Build(corpora, args.model_path);
+    } catch (...) {
+        for (auto child = children.begin(); child != children.end(); ++child)
+            kill(child->first, SIGTERM);
+        if (monitor.joinable())
+            monitor.join();
+
+        throw;
+    }
+
+    if (monitor.joinable())
+        monitor.join();
 
     return SUCCESS;
 }
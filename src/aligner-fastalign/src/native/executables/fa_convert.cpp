@@ -0,0 +1,85 @@
+#include <iostream>
+#include <fastalign/BidirectionalModel.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+namespace {
+    const size_t ERROR_IN_COMMAND_LINE = 1;
+    const size_t GENERIC_ERROR = 2;
+    const size_t SUCCESS = 0;
+
+    struct args_t {
+        string input_path;
+        string output_path;
+        int quantization_bits = 0;
+    };
+} // namespace
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+bool ParseArgs(int argc, const char *argv[], args_t *args) {
+    po::options_description desc("Converts a FastAlign model (legacy or CSR) to the memory-mappable CSR model format, "
+                                 "optionally quantizing its translation probabilities");
+    desc.add_options()
+            ("help,h", "print this help message")
+            ("input,i", po::value<string>()->required(), "the input FastAlign model path")
+            ("output,o", po::value<string>()->required(), "the output model path")
+            ("quantize,q", po::value<unsigned int>(), "store translation probabilities as 8 or 16-bit codes "
+                                                      "(default is 32-bit floats)");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return false;
+        }
+
+        po::notify(vm);
+
+        args->input_path = vm["input"].as<string>();
+        args->output_path = vm["output"].as<string>();
+
+        if (vm.count("quantize"))
+            args->quantization_bits = vm["quantize"].as<unsigned int>();
+    } catch (po::error &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        std::cerr << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, const char *argv[]) {
+    args_t args;
+
+    if (!ParseArgs(argc, argv, &args))
+        return ERROR_IN_COMMAND_LINE;
+
+    if (!fs::is_regular(args.input_path)) {
+        cerr << "ERROR: input path is not a valid file" << endl;
+        return GENERIC_ERROR;
+    }
+
+    if (fs::equivalent(args.input_path, args.output_path)) {
+        cerr << "ERROR: input and output path must be different" << endl;
+        return GENERIC_ERROR;
+    }
+
+    try {
+        BidirectionalModel::Convert(args.input_path, args.output_path,
+                                    TranslationTable::GetEncodingForBits(args.quantization_bits));
+    } catch (exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return GENERIC_ERROR;
+    }
+
+    return SUCCESS;
+}
@@ -6,17 +6,14 @@
 #include <random>
 #include <fstream>
 #include <fastalign/Corpus.h>
+#include <fastalign/EncodedCorpus.h>
 #include <fastalign/FastAligner.h>
+#include <fastalign/PrefetchReader.h>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include <thread>
 #include <cmath>
 
-#ifdef _OPENMP
-#include <thread>
-#include <omp.h>
-#endif
-
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
@@ -31,8 +28,10 @@ namespace {
         string output_path;
         string model_path;
         string input_path;
+        string encoded_corpus_path;
         string source_lang;
         string target_lang;
+        string reference_model_path;
         size_t buffer_size = 100000;
     };
 } // namespace
@@ -66,6 +65,64 @@ private:
     double count;
 };
 
+/*
+ * Measures how much the alignments of a model drift away from the ones of a reference model
+ * (i.e. the same model before quantization)
+ */
+class Drift {
+public:
+    Drift() : max(0), common_points(0), total_points(0) {}
+
+    void Add(const alignment_t &alignment, const alignment_t &reference) {
+        if (!isnan(alignment.score) && !isnan(reference.score)) {
+            double delta = fabs(alignment.score - reference.score);
+            scores.Add((score_t) delta);
+            max = std::max(max, delta);
+        }
+
+        // points are sorted by source and target position
+        size_t common = 0;
+        auto a = alignment.points.begin();
+        auto r = reference.points.begin();
+        while (a != alignment.points.end() && r != reference.points.end()) {
+            if (*a < *r) {
+                ++a;
+            } else if (*r < *a) {
+                ++r;
+            } else {
+                ++common;
+                ++a;
+                ++r;
+            }
+        }
+
+        common_points += common;
+        total_points += alignment.points.size() + reference.points.size() - common;
+    }
+
+    double GetAverage() {
+        return scores.GetAverage();
+    }
+
+    double GetStandardDeviation() {
+        return scores.GetStandardDeviation();
+    }
+
+    double GetMax() {
+        return max;
+    }
+
+    double GetAlignmentAgreement() {
+        return total_points > 0 ? common_points / total_points : 1.;
+    }
+
+private:
+    Sequence scores;
+    double max;
+    double common_points;
+    double total_points;
+};
+
 
 bool ParseArgs(int argc, const char *argv[], args_t *args) {
     po::options_description desc("Runs FastAlign model on a collection of parallel files and outputs scores in the "
@@ -78,8 +135,15 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
             ("output,o", po::value<string>()->required(), "output folder for \"*.score\" files")
             ("source,s", po::value<string>()->required(), "source language")
             ("target,t", po::value<string>()->required(), "target language")
-            ("input,i", po::value<string>()->required(), "input folder containing the parallel files collection")
-            ("batch-size,b", po::value<size_t>(), "input batch size, expressed in number of lines");
+            ("input,i", po::value<string>(), "input folder containing the parallel files collection")
+            ("encoded-corpus,e", po::value<string>(), "read the corpora from an encoded corpus file created by "
+                                                      "fa_build with the same model, instead of the input folder")
+            ("batch-size,b", po::value<size_t>(), "input batch size, expressed in number of lines")
+            ("reference-model,r", po::value<string>(), "a reference FastAlign model with the same vocabulary (i.e. the "
+                                                       "non-quantized version of the model): if specified, the script "
+                                                       "also prints the drift of the alignment scores against the "
+                                                       "reference model and the ratio of alignment points they have "
+                                                       "in common");
 
     po::variables_map vm;
     try {
@@ -93,13 +157,21 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
         po::notify(vm);
 
         args->model_path = vm["model"].as<string>();
-        args->input_path = vm["input"].as<string>();
+        if (vm.count("input"))
+            args->input_path = vm["input"].as<string>();
+        if (vm.count("encoded-corpus"))
+            args->encoded_corpus_path = vm["encoded-corpus"].as<string>();
+
+        if (args->input_path.empty() == args->encoded_corpus_path.empty())
+            throw po::error("exactly one of the options '--input' and '--encoded-corpus' is required");
         args->output_path = vm["output"].as<string>();
         args->source_lang = vm["source"].as<string>();
         args->target_lang = vm["target"].as<string>();
 
         if (vm.count("batch-size"))
             args->buffer_size = vm["batch-size"].as<size_t>();
+        if (vm.count("reference-model"))
+            args->reference_model_path = vm["reference-model"].as<string>();
     } catch (po::error &e) {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         std::cerr << desc << std::endl;
@@ -126,22 +198,38 @@ void ShiftBatch(vector<pair<wordvec_t, wordvec_t>> &batch) {
     batch[batch.size() - 1].second = first;
 }
 
-void ScoreCorpus(FastAligner &aligner, Sequence &goodScores, Sequence &badScores,
-                 const Corpus &corpus, size_t buffer_size, const string &outputPath) {
-    CorpusReader reader(corpus, &aligner.GetVocabulary());
+void CollectDrift(vector<alignment_t> &alignments, vector<alignment_t> &references, Drift &drift) {
+    for (size_t i = 0; i < alignments.size(); ++i)
+        drift.Add(alignments[i], references[i]);
+}
+
+template<class Reader>
+void ScoreCorpus(FastAligner &aligner, FastAligner *reference, Sequence &goodScores, Sequence &badScores,
+                 Drift &drift, Reader &reader, const string &name, size_t buffer_size, const string &outputPath) {
+    PrefetchReader prefetch([&reader, buffer_size](PrefetchReader::batch_t &outBatch) {
+        return reader.Read(outBatch, buffer_size);
+    });
 
-    vector<pair<wordvec_t, wordvec_t>> batch;
+    PrefetchReader::batch_t batch;
     vector<alignment_t> alignments;
+    vector<alignment_t> references;
 
-    string scorePath = (fs::path(outputPath) / (corpus.GetName() + ".score")).string();
+    string scorePath = (fs::path(outputPath) / (name + ".score")).string();
     ofstream scoreStream;
     scoreStream.open(scorePath.c_str(), ios_base::out);
 
-    while (reader.Read(batch, buffer_size)) {
+    while (prefetch.Read(batch)) {
         aligner.GetAlignments(batch, alignments, GrowDiagonalFinalAnd);
 
         PrintScores(alignments, scoreStream);
         CollectScores(alignments, goodScores);
+
+        if (reference) {
+            reference->GetAlignments(batch, references, GrowDiagonalFinalAnd);
+            CollectDrift(alignments, references, drift);
+            references.clear();
+        }
+
         alignments.clear();
 
         if (batch.size() > 1) {
@@ -151,27 +239,18 @@ void ScoreCorpus(FastAligner &aligner, Sequence &goodScores, Sequence &badScores
             CollectScores(alignments, badScores);
             alignments.clear();
         }
-
-        batch.clear();
     }
 }
 
 int main(int argc, const char *argv[]) {
-    int threads = 1;
-
-#ifdef _OPENMP
-    threads = thread::hardware_concurrency();
-
-    omp_set_dynamic(0);
-    omp_set_num_threads(threads);
-#endif
+    int threads = (int) thread::hardware_concurrency();
 
     args_t args;
 
     if (!ParseArgs(argc, argv, &args))
         return ERROR_IN_COMMAND_LINE;
 
-    if (!fs::exists(args.input_path) || !fs::is_directory(args.input_path)) {
+    if (!args.input_path.empty() && (!fs::exists(args.input_path) || !fs::is_directory(args.input_path))) {
         cerr << "ERROR: input path is not a valid directory" << endl;
         return GENERIC_ERROR;
     }
@@ -185,18 +264,52 @@ int main(int argc, const char *argv[]) {
         fs::create_directories(args.output_path);
 
     vector<Corpus> corpora;
-    Corpus::List(args.input_path, args.source_lang, args.target_lang, corpora);
+    EncodedCorpus *encoded = nullptr;
+
+    if (args.encoded_corpus_path.empty()) {
+        Corpus::List(args.input_path, args.source_lang, args.target_lang, corpora);
+
+        if (corpora.empty())
+            exit(0);
+    } else {
+        encoded = new EncodedCorpus(args.encoded_corpus_path);
+    }
+
+    FastAligner aligner(args.model_path, threads, kDefaultDenseRank);
 
-    if (corpora.empty())
-        exit(0);
+    if (encoded && encoded->GetVocabularyFingerprint() != aligner.GetVocabulary().GetFingerprint()) {
+        cerr << "ERROR: encoded corpus was created with a different vocabulary" << endl;
+        return GENERIC_ERROR;
+    }
+    FastAligner *reference = nullptr;
+    if (!args.reference_model_path.empty()) {
+        reference = new FastAligner(args.reference_model_path, threads, kDefaultDenseRank);
+
+        if (reference->GetVocabulary().GetFingerprint() != aligner.GetVocabulary().GetFingerprint()) {
+            cerr << "ERROR: reference model must have the same vocabulary of the model" << endl;
+            return GENERIC_ERROR;
+        }
+    }
 
-    FastAligner aligner(args.model_path, threads);
     Sequence goodScores;
     Sequence badScores;
+    Drift drift;
 
     // perform scoring of all corpora sequentially; multi-threading is used for each corpus
     for (auto corpus = corpora.begin(); corpus < corpora.end(); ++corpus) {
-        ScoreCorpus(aligner, goodScores, badScores, *corpus, args.buffer_size, args.output_path);
+        CorpusReader reader(*corpus, &aligner.GetVocabulary());
+        ScoreCorpus(aligner, reference, goodScores, badScores, drift, reader, corpus->GetName(), args.buffer_size,
+                    args.output_path);
+    }
+
+    if (encoded) {
+        for (size_t part = 0; part < encoded->Size(); ++part) {
+            EncodedCorpusReader reader(*encoded, part);
+            ScoreCorpus(aligner, reference, goodScores, badScores, drift, reader, encoded->GetName(part),
+                        args.buffer_size, args.output_path);
+        }
+
+        delete encoded;
     }
 
     cout << "good_avg=" << goodScores.GetAverage() << "\n";
@@ -204,5 +317,14 @@ int main(int argc, const char *argv[]) {
     cout << "bad_avg=" << badScores.GetAverage() << "\n";
     cout << "bad_std_dev=" << badScores.GetStandardDeviation() << "\n";
 
+    if (reference) {
+        cout << "drift_avg=" << drift.GetAverage() << "\n";
+        cout << "drift_std_dev=" << drift.GetStandardDeviation() << "\n";
+        cout << "drift_max=" << drift.GetMax() << "\n";
+        cout << "alignment_agreement=" << drift.GetAlignmentAgreement() << "\n";
+
+        delete reference;
+    }
+
     return SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,323 @@
+#ifndef MMT_FASTALIGN_ALIGNMENTKERNEL_H
+#define MMT_FASTALIGN_ALIGNMENTKERNEL_H
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <math.h>       /* isnormal */
+#include "Model.h"
+#include "Vocabulary.h"
+#include "PosteriorOps.h"
+#include "DiagonalAlignment.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * E-step of the model, specialized at compile time on the concrete model type and on the model flags.
+         *
+         * The model type M must provide:
+         *  - template<bool kReverse> double Probability(word_t source, word_t target)
+         *  - void Increment(word_t source, word_t target, double amount)
+         *
+         * For M = Model both fall back to the virtual GetProbability() and IncrementProbability(); concrete
+         * models declare non-virtual versions that are fully inlined in the kernel. The flags are resolved
+         * once per batch by ComputeAlignments(), so the inner loops have neither indirect calls nor branches
+         * on the model configuration.
+         *
+         * The arithmetic on the source row of every target word (prior, sum, posteriors, argmax) runs
+         * on the SIMD primitives of PosteriorOps.
+         *
+         * If "outLogLikelihood" is not null, the log-likelihood of the batch (the sum of the log of the
+         * normalization sum of every target word) is added to it.
+         *
+         * If the model has a band tolerance and no expected counts are collected, only the cells within a band
+         * around the diagonal are evaluated (see GetBandWidth()).
+         *
+         * Batches are aligned by the thread pool of the model if it has one, by an OpenMP team otherwise.
+         * With more than one worker, the sentences are handed out in cost order (see GetCostOrder()).
+         */
+        struct AlignmentKernel {
+
+            template<class M, class O>
+            static double ComputeAlignments(M &model, const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                            O *outModel, std::vector<alignment_t> *outAlignments,
+                                            const Vocabulary *vocab, double *outLogLikelihood = nullptr) {
+                kernel_t<M, O> kernel = GetKernel<M, O>(model, outModel != nullptr, outAlignments != nullptr);
+
+                double emp_feat = 0.0;
+                double log_likelihood = 0.0;
+
+                if (outAlignments)
+                    outAlignments->resize(batch.size());
+
+                auto align = [&](size_t i, double &outEmpFeat, double &outLineLogLikelihood) {
+                    const std::pair<wordvec_t, wordvec_t> &p = batch[i];
+
+                    outEmpFeat += kernel(model, p.first, p.second, outModel,
+                                         outAlignments ? &outAlignments->at(i) : nullptr, vocab,
+                                         outLogLikelihood ? &outLineLogLikelihood : nullptr);
+                };
+
+                size_t workers = 1;
+                if (model.pool) {
+                    workers = std::max(std::min(model.concurrency, model.pool->GetMaxConcurrency()), (size_t) 1);
+                } else {
+#ifdef _OPENMP
+                    workers = (size_t) omp_get_max_threads();
+#endif
+                }
+
+                std::vector<size_t> order;
+                if (workers > 1)
+                    GetCostOrder(batch, order);
+
+                if (model.pool) {
+                    std::vector<double> partials(2 * workers, 0.);
+
+                    model.pool->ParallelFor(batch.size(), workers, [&](size_t k, size_t worker) {
+                        align(order.empty() ? k : order[k], partials[2 * worker], partials[2 * worker + 1]);
+                    }, model.utilization);
+
+                    for (size_t worker = 0; worker < workers; ++worker) {
+                        emp_feat += partials[2 * worker];
+                        log_likelihood += partials[2 * worker + 1];
+                    }
+                } else {
+#pragma omp parallel for schedule(dynamic) reduction(+:emp_feat, log_likelihood)
+                    for (size_t k = 0; k < batch.size(); ++k) {
+                        double line_log_likelihood = 0.0;
+                        align(order.empty() ? k : order[k], emp_feat, line_log_likelihood);
+                        log_likelihood += line_log_likelihood;
+                    }
+                }
+
+                if (outLogLikelihood)
+                    *outLogLikelihood += log_likelihood;
+
+                assert(isnormal(emp_feat));
+                return emp_feat;
+            }
+
+            /**
+             * Returns the indices of the sentences of the batch sorted by decreasing alignment cost (the product
+             * of their lengths), and by index for the same cost: scheduling the longest sentences first, the last
+             * tasks of a batch are the shortest ones and no worker stays idle waiting for a long sentence.
+             */
+            static void GetCostOrder(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                     std::vector<size_t> &outOrder) {
+                std::vector<size_t> costs(batch.size());
+                for (size_t i = 0; i < batch.size(); ++i)
+                    costs[i] = batch[i].first.size() * batch[i].second.size();
+
+                outOrder.resize(batch.size());
+                for (size_t i = 0; i < batch.size(); ++i)
+                    outOrder[i] = i;
+
+                std::stable_sort(outOrder.begin(), outOrder.end(), [&costs](size_t a, size_t b) {
+                    return costs[a] > costs[b];
+                });
+            }
+
+            /**
+             * Returns the half-width w of the band of source words evaluated for every target word, or "n" for the
+             * whole row. The prior of target word j (0-based) peaks at the 1-based source position (j + 1) * n / m
+             * and it decays geometrically with ratio r = exp(-tension / n) on both sides of it: with
+             * s = floor((j + 1) * n / m), the band keeps the 0-based source words in [s - w, s + w], that is at
+             * least w words on each side of the peak, and every side leaves out at most r^w of the prior mass of
+             * the row. The band leaves out at most 2 r^w = tolerance: w = ceil(n * log(2 / tolerance) / tension).
+             */
+            static inline length_t GetBandWidth(length_t n, double tension, double tolerance) {
+                if (tolerance <= 0. || tolerance >= 1. || tension <= 0.)
+                    return n;
+
+                double width = ceil(n * log(2. / tolerance) / tension);
+                return width < n ? (length_t) width : n;
+            }
+
+            template<class M, class O>
+            static double ComputeAlignment(M &model, const wordvec_t &source, const wordvec_t &target,
+                                           O *outModel, alignment_t *outAlignment, const Vocabulary *vocab) {
+                kernel_t<M, O> kernel = GetKernel<M, O>(model, outModel != nullptr, outAlignment != nullptr);
+                return kernel(model, source, target, outModel, outAlignment, vocab, nullptr);
+            }
+
+        private:
+
+            template<class M, class O>
+            using kernel_t = double (*)(M &, const wordvec_t &, const wordvec_t &, O *, alignment_t *,
+                                        const Vocabulary *, double *);
+
+            template<class M, class O, bool kUseNull, bool kFavorDiagonal, bool kReverse, bool kUpdate, bool kAlign>
+            static double Kernel(M &model, const wordvec_t &source, const wordvec_t &target, O *outModel,
+                                 alignment_t *outAlignment, const Vocabulary *vocab, double *outLogLikelihood) {
+                double emp_feat = 0.0;
+
+                const wordvec_t &src = kReverse ? target : source;
+                const wordvec_t &trg = kReverse ? source : target;
+
+                std::vector<double> probs(src.size() + 1);
+                double *row = probs.data() + 1;
+
+                length_t src_size = (length_t) src.size();
+                length_t trg_size = (length_t) trg.size();
+
+                const double prob_align_null = model.prob_align_null;
+                const PosteriorOps &ops = PosteriorOps::Get();
+
+                // Band of source words of every target word (the whole row unless banded)
+                const length_t band = kFavorDiagonal && !kUpdate ?
+                                      GetBandWidth(src_size, model.diagonal_tension, model.band_tolerance) : src_size;
+
+                // Banded rows of sentences too long for the cache compute only the prior of their band
+                std::vector<double> prior_buffer;
+                const double *prior = nullptr;
+                if (kFavorDiagonal) {
+                    if (band < src_size && !model.prior_cache->IsCacheable(trg_size, src_size))
+                        prior_buffer.resize(src_size);
+                    else
+                        prior = model.prior_cache->GetPrior(trg_size, src_size, prior_buffer);
+                }
+
+                // Geometric mean of grouped data: antilog(sum(f * log x) / N)
+                double alg_prob = 0.0;
+                double alg_prob_d = 0.0;
+
+                for (length_t j = 0; j < trg_size; ++j) {
+                    const word_t &f_j = trg[j];
+                    double prob_a_i = 1.0 / (src_size +
+                                             // uniform (model 1), Diagonal Alignment (distortion model)
+                                             // ****** DIFFERENT FROM LEXICAL TRANSLATION PROBABILITY *****
+                                             (kUseNull ? 1 : 0));
+                    if (kUseNull) {
+                        if (kFavorDiagonal)
+                            prob_a_i = prob_align_null;
+                        probs[0] = model.template Probability<kReverse>(kNullWord, f_j) * prob_a_i;
+                    }
+
+                    length_t lo = 0;
+                    length_t hi = src_size;
+                    if (band < src_size) {
+                        length_t split = (length_t) ((double) (j + 1) * src_size / trg_size);
+                        lo = split > band ? split - band : 0;
+                        hi = (length_t) std::min((size_t) src_size, (size_t) split + band + 1);
+                    }
+
+                    double *cells = row + lo;
+                    const length_t size = hi - lo;
+
+                    // Gather the translation probabilities, then apply the alignment prior to the band
+                    for (length_t i = lo; i < hi; ++i)
+                        row[i] = model.template Probability<kReverse>(src[i], f_j);
+
+                    if (kFavorDiagonal) {
+                        if (prior) {
+                            ops.Multiply(cells, prior + (size_t) j * src_size + lo, size);
+                        } else {
+                            model.prior_cache->GetPriorRow(trg_size, src_size, j, lo, hi, prior_buffer.data());
+                            ops.Multiply(cells, prior_buffer.data(), size);
+                        }
+                    } else {
+                        for (length_t i = 0; i < src_size; ++i)
+                            row[i] *= prob_a_i;
+                    }
+
+                    double sum = ops.Sum(cells, size, kUseNull ? probs[0] : 0.);
+                    assert(isnormal(sum));
+
+                    if (outLogLikelihood)
+                        *outLogLikelihood += log(sum);
+
+                    if (kAlign) {
+                        double max_p = -1;
+                        int max_index = -1;
+
+                        if (kUseNull) {
+                            max_index = 0;
+                            max_p = probs[0];
+                        }
+
+                        size_t best = ops.ArgMax(cells, size);
+                        if (best < size && cells[best] > max_p) {
+                            max_index = (int) (lo + best) + 1;
+                            max_p = cells[best];
+                        }
+
+                        score_t word_score = 1;
+                        if (vocab)
+                            word_score = vocab->GetProbability(trg[j], kReverse);
+
+                        alg_prob += word_score * log(max_p);
+                        alg_prob_d += word_score;
+
+                        if (max_index > 0) {
+                            if (kReverse)
+                                outAlignment->points.emplace_back(j, max_index - 1);
+                            else
+                                outAlignment->points.emplace_back(max_index - 1, j);
+                        }
+                    }
+
+                    if (kUseNull && kUpdate) {
+                        double count = probs[0] / sum;
+
+                        assert(isnormal(count));
+                        outModel->Increment(kNullWord, f_j, count);
+                    }
+
+                    // Posteriors (in place) and expected diagonal feature
+                    if (size < src_size) {
+                        for (length_t i = lo; i < hi; ++i) {
+                            row[i] /= sum;
+                            emp_feat += DiagonalAlignment::Feature(j, i + 1, trg_size, src_size) * row[i];
+                        }
+                    } else {
+                        emp_feat = ops.Normalize(row, src_size, sum, j, trg_size, src_size, emp_feat);
+                    }
+                    assert(isnormal(emp_feat));
+
+                    if (kUpdate) {
+                        for (length_t i = 0; i < src_size; ++i) {
+                            assert(isnormal(row[i]));
+                            outModel->Increment(src[i], f_j, row[i]);
+                        }
+                    }
+                }
+
+                if (kAlign)
+                    outAlignment->score = (score_t) (alg_prob / alg_prob_d);
+
+                return emp_feat;
+            }
+
+            // Resolves one runtime flag at a time, until all of them are template arguments
+            template<class M, class O, bool... kFlags>
+            struct Selector {
+                static kernel_t<M, O> Select(const bool *flags) {
+                    return flags[0] ? Selector<M, O, kFlags..., true>::Select(flags + 1)
+                                    : Selector<M, O, kFlags..., false>::Select(flags + 1);
+                }
+            };
+
+            template<class M, class O, bool kUseNull, bool kFavorDiagonal, bool kReverse, bool kUpdate, bool kAlign>
+            struct Selector<M, O, kUseNull, kFavorDiagonal, kReverse, kUpdate, kAlign> {
+                static kernel_t<M, O> Select(const bool *) {
+                    return &Kernel<M, O, kUseNull, kFavorDiagonal, kReverse, kUpdate, kAlign>;
+                }
+            };
+
+            template<class M, class O>
+            static kernel_t<M, O> GetKernel(const M &model, bool update, bool align) {
+                const bool flags[] = {model.use_null, model.favor_diagonal, model.is_reverse, update, align};
+                return Selector<M, O>::Select(flags);
+            }
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_ALIGNMENTKERNEL_H
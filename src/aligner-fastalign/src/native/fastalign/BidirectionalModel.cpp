@@ -3,35 +3,54 @@
 //
 
 #include "BidirectionalModel.h"
+#include "ioutils.h"
+#include "AlignmentKernel.h"
 
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
 
-BidirectionalModel::BidirectionalModel(shared_ptr<bitable_t> table, bool forward, bool use_null,
-                                       bool favor_diagonal, double prob_align_null, double diagonal_tension)
-        : Model(!forward, use_null, favor_diagonal, prob_align_null, diagonal_tension), table(table) {
-}
-
-void BidirectionalModel::Open(istream &in, Model **outForward, Model **outBackward) {
+struct model_header_t {
     bool use_null;
     bool favor_diagonal;
     double prob_align_null;
-    double fwd_diagonal_tension, bwd_diagonal_tension;
-
-    in.read((char *) &use_null, sizeof(bool));
-    in.read((char *) &favor_diagonal, sizeof(bool));
-
-    in.read((char *) &prob_align_null, sizeof(double));
-    in.read((char *) &fwd_diagonal_tension, sizeof(double));
-    in.read((char *) &bwd_diagonal_tension, sizeof(double));
+    double fwd_diagonal_tension;
+    double bwd_diagonal_tension;
+};
+
+// Returns false for legacy models, that do not start with the magic number
+static bool ReadMagic(istream &in) {
+    auto magic = io_read<uint64_t>(in);
+
+    if (in && magic == kModelFileMagic) {
+        auto version = io_read<uint32_t>(in);
+        if (version != kModelFileVersion)
+            throw runtime_error("unsupported model file version: " + to_string(version));
+
+        return true;
+    } else {
+        in.clear();
+        in.seekg(0);
+        return false;
+    }
+}
 
-    shared_ptr<bitable_t> table(new bitable_t);
+static void ReadHeader(istream &in, model_header_t &header) {
+    header.use_null = io_read<bool>(in);
+    header.favor_diagonal = io_read<bool>(in);
+    header.prob_align_null = io_read<double>(in);
+    header.fwd_diagonal_tension = io_read<double>(in);
+    header.bwd_diagonal_tension = io_read<double>(in);
+}
 
+static TranslationTable *LoadLegacyTable(istream &in) {
     size_t ttable_size;
     in.read((char *) &ttable_size, sizeof(size_t));
 
-    table->resize(ttable_size);
+    // rows are read in file order, then placed in the final arrays sorted by source and target word
+    vector<pair<size_t, size_t>> rows(ttable_size, pair<size_t, size_t>(0, 0));
+    vector<word_t> columns;
+    vector<float> scores;
 
     while (true) {
         word_t sourceWord;
@@ -43,22 +62,146 @@ void BidirectionalModel::Open(istream &in, Model **outForward, Model **outBackwa
         size_t row_size;
         in.read((char *) &row_size, sizeof(size_t));
 
-        unordered_map<word_t, pair<float, float>> &row = table->at(sourceWord);
-        row.reserve(row_size);
+        if (sourceWord >= ttable_size)
+            throw runtime_error("corrupted model file: invalid source word " + to_string(sourceWord));
 
-        for (size_t i = 0; i < row_size; ++i) {
-            word_t targetWord;
-            float first, second;
+        rows[sourceWord] = pair<size_t, size_t>(columns.size(), row_size);
 
-            in.read((char *) &targetWord, sizeof(word_t));
-            in.read((char *) &first, sizeof(float));
-            in.read((char *) &second, sizeof(float));
+        for (size_t i = 0; i < row_size; ++i) {
+            columns.push_back(io_read<word_t>(in));
+            scores.push_back(io_read<float>(in));
+            scores.push_back(io_read<float>(in));
+        }
+    }
 
-            row[targetWord] = pair<float, float>(first, second);
+    vector<TranslationTable::offset_t> outOffsets(ttable_size + 1);
+    vector<word_t> outColumns(columns.size());
+    vector<float> outScores(scores.size());
+    vector<size_t> permutation;
+
+    size_t nnz = 0;
+    for (size_t s = 0; s < ttable_size; ++s) {
+        outOffsets[s] = nnz;
+
+        size_t begin = rows[s].first;
+        size_t size = rows[s].second;
+
+        permutation.resize(size);
+        for (size_t i = 0; i < size; ++i)
+            permutation[i] = begin + i;
+        std::sort(permutation.begin(), permutation.end(), [&columns](size_t a, size_t b) {
+            return columns[a] < columns[b];
+        });
+
+        for (auto i = permutation.begin(); i != permutation.end(); ++i, ++nnz) {
+            outColumns[nnz] = columns[*i];
+            outScores[2 * nnz] = scores[2 * *i];
+            outScores[2 * nnz + 1] = scores[2 * *i + 1];
         }
     }
+    outOffsets[ttable_size] = nnz;
+
+    outColumns.resize(nnz);
+    outScores.resize(2 * nnz);
+
+    return new TranslationTable(std::move(outOffsets), std::move(outColumns), std::move(outScores));
+}
+
+BidirectionalModel::BidirectionalModel(shared_ptr<TranslationTable> table, bool forward, bool use_null,
+                                       bool favor_diagonal, double prob_align_null, double diagonal_tension)
+        : Model(!forward, use_null, favor_diagonal, prob_align_null, diagonal_tension,
+                DiagonalPriorCache::kServingMemoryBudget), table(table) {
+}
+
+double BidirectionalModel::ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
+                                            alignment_t *outAlignment, const Vocabulary *vocab) {
+    // counts can only be collected by other model types, only the generic kernel supports them
+    if (outModel)
+        return Model::ComputeAlignment(source, target, outModel, outAlignment, vocab);
+
+    return AlignmentKernel::ComputeAlignment<BidirectionalModel, BidirectionalModel>(
+            *this, source, target, nullptr, outAlignment, vocab);
+}
+
+double BidirectionalModel::ComputeAlignments(const vector<pair<wordvec_t, wordvec_t>> &batch, Model *outModel,
+                                             vector<alignment_t> *outAlignments, const Vocabulary *vocab,
+                                             double *outLogLikelihood) {
+    if (outModel)
+        return Model::ComputeAlignments(batch, outModel, outAlignments, vocab, outLogLikelihood);
+
+    return AlignmentKernel::ComputeAlignments<BidirectionalModel, BidirectionalModel>(
+            *this, batch, nullptr, outAlignments, vocab, outLogLikelihood);
+}
+
+void BidirectionalModel::Open(const string &path, Vocabulary *outVocabulary, Model **outForward, Model **outBackward,
+                              size_t denseRank) {
+    ifstream in(path, ios::binary | ios::in);
+    if (!in)
+        throw invalid_argument("unable to open model file: " + path);
+
+    bool csr = ReadMagic(in);
+
+    *outVocabulary = Vocabulary(in);
+
+    model_header_t header{};
+    ReadHeader(in, header);
+
+    shared_ptr<TranslationTable> table;
+
+    if (csr) {
+        table.reset(TranslationTable::Open(in, path));
+    } else {
+        table.reset(LoadLegacyTable(in));
+    }
+
+    if (denseRank > 0)
+        table->BuildDenseBlock(denseRank);
+
+    *outForward = new BidirectionalModel(table, true, header.use_null, header.favor_diagonal,
+                                         header.prob_align_null, header.fwd_diagonal_tension);
+    *outBackward = new BidirectionalModel(table, false, header.use_null, header.favor_diagonal,
+                                          header.prob_align_null, header.bwd_diagonal_tension);
+}
+
+void BidirectionalModel::Store(const string &path, const Vocabulary &vocabulary,
+                               bool use_null, bool favor_diagonal, double prob_align_null,
+                               double fwd_diagonal_tension, double bwd_diagonal_tension,
+                               TranslationTable::RowReader &rows, ScoreEncoding encoding) {
+    ofstream out(path, ios::binary | ios::out);
+    if (!out)
+        throw runtime_error("unable to write model file: " + path);
+
+    io_write(out, kModelFileMagic);
+    io_write(out, kModelFileVersion);
+
+    vocabulary.Store(out);
+
+    io_write(out, use_null);
+    io_write(out, favor_diagonal);
+    io_write(out, prob_align_null);
+    io_write(out, fwd_diagonal_tension);
+    io_write(out, bwd_diagonal_tension);
+
+    TranslationTable::Store(out, rows, encoding);
+
+    if (!out)
+        throw runtime_error("error while writing model file: " + path);
+}
+
+void BidirectionalModel::Convert(const string &inputPath, const string &path, ScoreEncoding encoding) {
+    Vocabulary vocabulary;
+    Model *forward, *backward;
+    Open(inputPath, &vocabulary, &forward, &backward, 0);
+
+    auto *model = (BidirectionalModel *) forward;
+
+    bitable_t table;
+    model->table->Export(table);
+
+    TranslationTable::BitableReader rows(table);
+    Store(path, vocabulary, model->use_null, model->favor_diagonal, model->prob_align_null,
+          model->diagonal_tension, ((BidirectionalModel *) backward)->diagonal_tension, rows, encoding);
 
-    *outForward = new BidirectionalModel(table, true, use_null, favor_diagonal, prob_align_null, fwd_diagonal_tension);
-    *outBackward = new BidirectionalModel(table, false, use_null, favor_diagonal, prob_align_null,
-                                          bwd_diagonal_tension);
+    delete forward;
+    delete backward;
 }
@@ -11,39 +11,83 @@
 
 #include "Model.h"
 #include "Vocabulary.h"
+#include "TranslationTable.h"
 
 namespace mmt {
     namespace fastalign {
 
-        typedef std::vector<std::unordered_map<word_t, std::pair<float, float>>> bitable_t;
+        /*
+         * Model file layout (all values in native byte order):
+         *
+         *  - magic number (kModelFileMagic, uint64) and version (uint32)
+         *  - vocabulary, see Vocabulary::Store()
+         *  - use_null (bool), favor_diagonal (bool), prob_align_null (double),
+         *    forward diagonal_tension (double), backward diagonal_tension (double)
+         *  - translation table in CSR layout, see TranslationTable::Store()
+         *
+         * Models created before the introduction of the CSR layout do not start with the magic number:
+         * they are still supported by Open() (loading them in memory), and they can be converted with "fa_convert".
+         * The same tool can also re-encode a model with 8 or 16-bit quantized scores.
+         */
+        static const uint64_t kModelFileMagic = 0x314C444D52534346ULL; // "FCSRMDL1"
+        static const uint32_t kModelFileVersion = 1;
+
+        class BidirectionalModel final : public Model {
+            friend struct AlignmentKernel;
 
-        class BidirectionalModel : public Model {
         public:
-            BidirectionalModel(std::shared_ptr<bitable_t> table, bool forward, bool use_null,
+            BidirectionalModel(std::shared_ptr<TranslationTable> table, bool forward, bool use_null,
                                bool favor_diagonal, double prob_align_null, double diagonal_tension);
 
-            inline double GetProbability(word_t source, word_t target) override {
-                if (is_reverse)
-                    std::swap(source, target);
-
-                if (table->empty())
-                    return kNullProbability;
-                if (source >= table->size())
-                    return kNullProbability;
+            using Model::ComputeAlignment;
+            using Model::ComputeAlignments;
 
-                std::unordered_map<word_t, std::pair<float, float>> &row = table->at(source);
-                auto ptr = row.find(target);
-                return ptr == row.end() ? kNullProbability : (is_reverse ? ptr->second.second : ptr->second.first);
+            inline double GetProbability(word_t source, word_t target) override {
+                return is_reverse ? Probability<true>(source, target) : Probability<false>(source, target);
             }
 
             inline void IncrementProbability(word_t source, word_t target, double amount) override {
                 // no-op
             }
 
-            static void Open(std::istream &in, Model **outForward, Model **outBackward);
+            /**
+             * Returns the table shared by the forward and the backward model.
+             */
+            inline const std::shared_ptr<TranslationTable> &GetTable() const {
+                return table;
+            }
+
+            static void Open(const std::string &path, Vocabulary *outVocabulary,
+                             Model **outForward, Model **outBackward, size_t denseRank = 0);
+
+            static void Store(const std::string &path, const Vocabulary &vocabulary,
+                              bool use_null, bool favor_diagonal, double prob_align_null,
+                              double fwd_diagonal_tension, double bwd_diagonal_tension,
+                              TranslationTable::RowReader &rows, ScoreEncoding encoding = kScoreEncodingFloat);
+
+            static void Convert(const std::string &inputPath, const std::string &path,
+                                ScoreEncoding encoding = kScoreEncodingFloat);
+
+        protected:
+            double ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
+                                    alignment_t *outAlignment, const Vocabulary *vocab) override;
+
+            double ComputeAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                     Model *outModel, std::vector<alignment_t> *outAlignments,
+                                     const Vocabulary *vocab, double *outLogLikelihood) override;
 
         private:
-            const std::shared_ptr<bitable_t> table;
+            const std::shared_ptr<TranslationTable> table;
+
+            template<bool kReverse>
+            inline double Probability(word_t source, word_t target) {
+                return kReverse ? table->Get(target, source, 1, kNullProbability)
+                                : table->Get(source, target, 0, kNullProbability);
+            }
+
+            inline void Increment(word_t source, word_t target, double amount) {
+                // no-op
+            }
         };
     }
 }
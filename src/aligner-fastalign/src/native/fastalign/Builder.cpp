@@ -3,13 +3,21 @@
 //
 
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <assert.h>
-#include <unordered_set>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <chrono>
 #include <boost/filesystem.hpp>
-#include "DiagonalAlignment.h"
+#include "AlignmentKernel.h"
 #include "Builder.h"
 #include "BidirectionalModel.h"
+#include "CooccurrenceSorter.h"
+#include "PrefetchReader.h"
+#include "TranslationTable.h"
 #include "ioutils.h"
 
 #include <math.h>       /* isnormal */
@@ -18,34 +26,45 @@
 #include <omp.h>
 #endif
 
-namespace fs = boost::filesystem;
-
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
 
+namespace fs = boost::filesystem;
+
 struct LengthPairHash {
     size_t operator()(const pair<length_t, length_t> &x) const {
         return (size_t) ((x.first << 16) | ((x.second) & 0xffff));
     }
 };
 
-inline double digamma(double x) {
-    double result = 0, xx, xx2, xx4;
-    for (; x < 7; ++x)
-        result -= 1 / x;
-    x -= 1.0 / 2.0;
-    xx = 1.0 / x;
-    xx2 = xx * xx;
-    xx4 = xx2 * xx2;
-    result += log(x) + (1. / 24.) * xx2 - (7.0 / 960.0) * xx4 + (31.0 / 8064.0) * xx4 * xx2 -
-              (127.0 / 30720.0) * xx4 * xx4;
-    return result;
-}
-
-class BuilderModel : public Model {
+/*
+ * Translation table under training, in CSR layout: the cells of row "s" are in range [offsets[s], offsets[s + 1])
+ * and columns are sorted within each row. The set of cells is built by the initial pass (see Builder::InitialPass())
+ * and it does not change until Prune() is called.
+ *
+ * Expected counts are not added to the shared "counts" array directly: every thread appends them to its own
+ * buffers, one for each range of cells (shard), and FlushCounts() applies the buffers shard by shard in parallel.
+ * No two threads ever write the same cell, so counts need neither atomics nor locks.
+ */
+class BuilderModel final : public Model {
 public:
-    vector<unordered_map<word_t, pair<double, double>>> data;
+    static const size_t kNoCell = SIZE_MAX;
+
+    // Rows in memory are [first_row, first_row + offsets.size() - 1): out-of-core training loads a range at a time
+    word_t first_row = 0;
+
+    vector<size_t> offsets;
+    vector<word_t> columns;
+    vector<double> probs;
+    vector<double> counts;
+
+    // Corpus statistics collected by the initial pass
+    double n_target_tokens = 0;
+    vector<pair<pair<length_t, length_t>, size_t>> size_counts;
+
+    // True if the table in memory has been pruned
+    bool pruned = false;
 
     BuilderModel(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension)
             : Model(is_reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension) {
@@ -54,97 +73,556 @@ public:
     ~BuilderModel() {};
 
     double GetProbability(word_t source, word_t target) override {
-        if (data.empty())
-            return kNullProbability;
-        if (source >= data.size())
-            return kNullProbability;
-
-        unordered_map<word_t, pair<double, double>> &row = data[source];
-        auto ptr = row.find(target);
-        return ptr == row.end() ? kNullProbability : ptr->second.first;
+        return Probability<false>(source, target);
     }
 
     void IncrementProbability(word_t source, word_t target, double amount) override {
-#pragma omp atomic
-        data[source][target].second += amount;
+        Increment(source, target, amount);
+    }
+
+    template<bool kReverse>
+    inline double Probability(word_t source, word_t target) {
+        size_t cell = Find(source, target);
+
+        // Remember the cell: the kernel increments the same cells right after reading them
+        LookupCache::Entry &entry = lookup_caches[ThreadId()].At(source, target);
+        entry.source = source;
+        entry.target = target;
+        entry.cell = cell;
+
+        return cell == kNoCell ? kNullProbability : probs[cell];
+    }
+
+    inline void Increment(word_t source, word_t target, double amount) {
+        const LookupCache::Entry &entry = lookup_caches[ThreadId()].At(source, target);
+        size_t cell = (entry.source == source && entry.target == target) ? entry.cell : Find(source, target);
+        assert(cell != kNoCell);
+
+        if (cell == kNoCell)
+            return;
+
+        if (pending.size() == 1)
+            counts[cell] += amount;  // single thread: nothing to synchronize
+        else
+            pending[ThreadId()][cell / shard_size].push_back(PendingCount(cell, amount));
+    }
+
+    using Model::ComputeAlignment;
+    using Model::ComputeAlignments;
+
+    double ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
+                            alignment_t *outAlignment, const Vocabulary *vocab = nullptr) override {
+        auto *out = dynamic_cast<BuilderModel *>(outModel);
+        if (outModel && !out)
+            return Model::ComputeAlignment(source, target, outModel, outAlignment, vocab);
+
+        double emp_feat = AlignmentKernel::ComputeAlignment<BuilderModel, BuilderModel>(
+                *this, source, target, out, outAlignment, vocab);
+        if (out)
+            out->FlushCounts();
+
+        return emp_feat;
+    }
+
+    double ComputeAlignments(const vector<pair<wordvec_t, wordvec_t>> &batch, Model *outModel,
+                             vector<alignment_t> *outAlignments, const Vocabulary *vocab = nullptr,
+                             double *outLogLikelihood = nullptr) override {
+        auto *out = dynamic_cast<BuilderModel *>(outModel);
+        if (outModel && !out)
+            return Model::ComputeAlignments(batch, outModel, outAlignments, vocab, outLogLikelihood);
+
+        double emp_feat = AlignmentKernel::ComputeAlignments<BuilderModel, BuilderModel>(
+                *this, batch, out, outAlignments, vocab, outLogLikelihood);
+        if (out)
+            out->FlushCounts();
+
+        return emp_feat;
+    }
+
+    inline bool Contains(word_t source) const {
+        return source >= first_row && (size_t) (source - first_row) + 1 < offsets.size();
     }
 
+    void Allocate() {
+        probs.assign(columns.size(), kNullProbability);
+        AllocateCounts();
+    }
+
+    void AllocateCounts() {
+        counts.assign(columns.size(), 0.);
+
+        size_t threads = GetThreads();
+        size_t shards = std::max((size_t) 1, std::min(threads * kShardsPerThread, columns.size()));
+        shard_size = std::max((size_t) 1, (columns.size() + shards - 1) / shards);
+        shards = (columns.size() + shard_size - 1) / shard_size;
+
+        pending.assign(threads, vector<vector<PendingCount>>(std::max(shards, (size_t) 1)));
+        lookup_caches.assign(threads, LookupCache());
+    }
+
+    void FlushCounts() {
+        size_t shards = pending.empty() ? 0 : pending[0].size();
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t shard = 0; shard < shards; ++shard) {
+            for (auto buffers = pending.begin(); buffers != pending.end(); ++buffers) {
+                vector<PendingCount> &buffer = (*buffers)[shard];
+
+                for (auto entry = buffer.begin(); entry != buffer.end(); ++entry)
+                    counts[entry->first] += entry->second;
+
+                buffer.clear();
+            }
+        }
+    }
+
+    /*
+     * Removes the cells with a probability not greater than "threshold"; counts are released.
+     */
     void Prune(double threshold = 1e-20) {
+        const vector<size_t> ranges = GetRowRanges();
+        vector<size_t> pruned_offsets(offsets.size(), 0);
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t range = 0; range < ranges.size() - 1; ++range) {
+            for (size_t i = ranges[range]; i < ranges[range + 1]; ++i)
+                pruned_offsets[i + 1] = CountCells(i, threshold);
+        }
+
+        Compact(ranges, pruned_offsets, threshold);
+    }
+
+    /*
+     * M-step: normalizes the expected counts into the probabilities of the next iteration and resets the counts,
+     * in a single parallel sweep over the table; if "prune" is true, the table is also pruned (see Prune()).
+     */
+    void Normalize(double alpha = 0, bool prune = false, double threshold = 1e-20) {
+        FlushCounts();
+
+        const PosteriorOps &ops = PosteriorOps::Get();
+        const vector<size_t> ranges = GetRowRanges();
+        vector<size_t> pruned_offsets(prune ? offsets.size() : 0, 0);
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t range = 0; range < ranges.size() - 1; ++range) {
+            for (size_t i = ranges[range]; i < ranges[range + 1]; ++i) {
+                const size_t begin = offsets[i];
+                const size_t end = offsets[i + 1];
+                double row_norm = 0;
+
+                for (size_t cell = begin; cell < end; ++cell)
+                    row_norm += counts[cell] + alpha;
+
+                if (row_norm == 0) row_norm = 1;
+
+                if (alpha > 0)
+                    row_norm = PosteriorOps::Digamma(row_norm);
+
+                assert(isnormal(row_norm));
+
+                if (alpha > 0) {
+                    ops.ExpDigamma(counts.data() + begin, probs.data() + begin, end - begin, alpha, row_norm);
+                } else {
+                    for (size_t cell = begin; cell < end; ++cell)
+                        probs[cell] = counts[cell] / row_norm;
+                }
+
+                std::fill(counts.begin() + begin, counts.begin() + end, 0.);
+
+                if (prune)
+                    pruned_offsets[i + 1] = CountCells(i, threshold);
+            }
+        }
+
+        if (prune)
+            Compact(ranges, pruned_offsets, threshold);
+    }
+
+    void OptimizeDiagonalTension(double emp_feat) {
+        for (int ii = 0; ii < 8; ++ii) {
+            double mod_feat = 0;
+#pragma omp parallel for reduction(+:mod_feat)
+            for (size_t i = 0; i < size_counts.size(); ++i) {
+                const pair<length_t, length_t> &p = size_counts[i].first;
+                mod_feat += size_counts[i].second * prior_cache->GetDLogZ(p.first, p.second);
+            }
+
+            mod_feat /= n_target_tokens;
+            double tension = diagonal_tension + (emp_feat - mod_feat) * 20.0;
+            if (tension <= 0.1) tension = 0.1;
+            if (tension > 14) tension = 14;
+            SetDiagonalTension(tension);
+        }
+    }
+
+    /*
+     * Out-of-core training, first pass over a range of rows: adds the contribution of the rows in memory to the
+     * normalization sum of every target word of the batch. The sums of line "k" start at sums[positions[k]].
+     */
+    void AddPartialSums(const PrefetchReader::batch_t &batch, const vector<size_t> &positions, double *sums) {
+        PartialPass<false>(batch, positions, sums, nullptr);
+    }
+
+    /*
+     * Out-of-core training, second pass over a range of rows: given the complete normalization sums, adds the
+     * posteriors of the rows in memory to the counts; returns their contribution to the expected diagonal feature.
+     * If "outLogLikelihood" is not null, the log-likelihood of the batch is added to it.
+     */
+    double AddPartialPosteriors(const PrefetchReader::batch_t &batch, const vector<size_t> &positions,
+                                double *sums, double *outLogLikelihood = nullptr) {
+        double emp_feat = PartialPass<true>(batch, positions, sums, outLogLikelihood);
+        FlushCounts();
+
+        return emp_feat;
+    }
+
+    /*
+     * Stores the rows in memory and their probabilities; if "storeCounts" is true, the expected counts are stored
+     * in place of the probabilities, that must have been flushed with FlushCounts().
+     */
+    void Store(const string &path, bool storeCounts = false) const {
+        ofstream out(path, ios::binary | ios::out);
+        if (!out.is_open())
+            throw runtime_error("Unable to create partition file: " + path);
+
+        io_write(out, first_row);
+        io_write(out, (uint64_t) offsets.size());
+        io_write(out, (uint64_t) columns.size());
+        out.write((const char *) offsets.data(), offsets.size() * sizeof(size_t));
+        out.write((const char *) columns.data(), columns.size() * sizeof(word_t));
+        const vector<double> &values = storeCounts ? counts : probs;
+        out.write((const char *) values.data(), values.size() * sizeof(double));
+
+        if (!out)
+            throw runtime_error("Error writing partition file: " + path);
+    }
+
+    /*
+     * Loads the rows stored with Store(). Counts are not allocated.
+     */
+    void Load(const string &path) {
+        ifstream in(path, ios::binary | ios::in);
+        if (!in.is_open())
+            throw runtime_error("Unable to open partition file: " + path);
+
+        first_row = io_read<word_t>(in);
+        auto offsets_size = (size_t) io_read<uint64_t>(in);
+        auto size = (size_t) io_read<uint64_t>(in);
+
+        offsets.resize(offsets_size);
+        columns.resize(size);
+        probs.resize(size);
+
+        in.read((char *) offsets.data(), offsets_size * sizeof(size_t));
+        in.read((char *) columns.data(), size * sizeof(word_t));
+        in.read((char *) probs.data(), size * sizeof(double));
+
+        if (!in)
+            throw runtime_error("Truncated partition file: " + path);
+
+        vector<double>().swap(counts);
+        pending.clear();
+        lookup_caches.assign(GetThreads(), LookupCache());
+    }
+
+    /*
+     * Frees the rows in memory, for example when the table is left on disk in partitions.
+     */
+    void Release() {
+        first_row = 0;
+        vector<size_t>(1, 0).swap(offsets);
+        vector<word_t>().swap(columns);
+        vector<double>().swap(probs);
+        vector<double>().swap(counts);
+        pending.clear();
+    }
+
+    /*
+     * Distributed training: adds the counts of a worker, loaded as the probabilities of "partial", to the counts
+     * of this table. Cells missing from this table are added, so that the table becomes the union of the tables
+     * of all the workers. Both tables must start from row 0.
+     */
+    void AddCounts(const BuilderModel &partial) {
+        FlushCounts();
+
+        size_t rows = std::max(offsets.size(), partial.offsets.size()) - 1;
+        vector<size_t> merged_offsets(rows + 1, 0);
+        vector<word_t> merged_columns;
+        vector<double> merged_probs;
+        vector<double> merged_counts;
+
+        merged_columns.reserve(std::max(columns.size(), partial.columns.size()));
+        merged_probs.reserve(merged_columns.capacity());
+        merged_counts.reserve(merged_columns.capacity());
+
+        for (size_t row = 0; row < rows; ++row) {
+            size_t a = row + 1 < offsets.size() ? offsets[row] : columns.size();
+            size_t a_end = row + 1 < offsets.size() ? offsets[row + 1] : columns.size();
+            size_t b = row + 1 < partial.offsets.size() ? partial.offsets[row] : partial.columns.size();
+            size_t b_end = row + 1 < partial.offsets.size() ? partial.offsets[row + 1] : partial.columns.size();
+
+            while (a < a_end || b < b_end) {
+                if (b == b_end || (a < a_end && columns[a] < partial.columns[b])) {
+                    merged_columns.push_back(columns[a]);
+                    merged_probs.push_back(probs[a]);
+                    merged_counts.push_back(counts[a]);
+                    ++a;
+                } else if (a == a_end || partial.columns[b] < columns[a]) {
+                    merged_columns.push_back(partial.columns[b]);
+                    merged_probs.push_back(kNullProbability);
+                    merged_counts.push_back(partial.probs[b]);
+                    ++b;
+                } else {
+                    merged_columns.push_back(columns[a]);
+                    merged_probs.push_back(probs[a]);
+                    merged_counts.push_back(counts[a] + partial.probs[b]);
+                    ++a;
+                    ++b;
+                }
+            }
+
+            merged_offsets[row + 1] = merged_columns.size();
+        }
+
+        offsets.swap(merged_offsets);
+        columns.swap(merged_columns);
+        probs.swap(merged_probs);
+        counts.swap(merged_counts);
+    }
+
+    /*
+     * Distributed training, M-step of a worker: copies the probabilities of the cells of this table from "table",
+     * a table covering all of them, and resets the counts in the same sweep. Both tables must start from row 0.
+     */
+    void CopyProbabilities(const BuilderModel &table) {
+        size_t rows = offsets.size() - 1;
+
 #pragma omp parallel for schedule(dynamic)
-        for (size_t i = 0; i < data.size(); ++i) {
-            unordered_map<word_t, pair<double, double>> &row = data[i];
-
-            for (auto cell = row.cbegin(); cell != row.cend(); /* no increment */) {
-                if (cell->second.first <= threshold)
-                    cell = row.erase(cell);
-                else
-                    ++cell;
+        for (size_t row = 0; row < rows; ++row) {
+            size_t b = row + 1 < table.offsets.size() ? table.offsets[row] : table.columns.size();
+            size_t b_end = row + 1 < table.offsets.size() ? table.offsets[row + 1] : table.columns.size();
+
+            for (size_t cell = offsets[row]; cell < offsets[row + 1]; ++cell) {
+                while (b < b_end && table.columns[b] < columns[cell])
+                    ++b;
+
+                probs[cell] = (b < b_end && table.columns[b] == columns[cell]) ? table.probs[b] : kNullProbability;
+                counts[cell] = 0;
             }
         }
     }
 
-    void Normalize(double alpha = 0) {
-        for (size_t i = 0; i < data.size(); ++i) {
-            unordered_map<word_t, pair<double, double>> &row = data[i];
-            double row_norm = 0;
+private:
+    static const size_t kShardsPerThread = 8;
+
+    typedef pair<size_t, double> PendingCount;
+
+    // pending[thread][shard]: counts not yet added to "counts"
+    vector<vector<vector<PendingCount>>> pending;
+    size_t shard_size = 1;
+
+    // Direct-mapped cache of the last cells found by every thread
+    struct LookupCache {
+        static const size_t kSize = 1024;
+
+        struct Entry {
+            word_t source = kNullWord;
+            word_t target = kNullWord;
+            size_t cell = kNoCell;
+        };
 
-            for (auto cell = row.begin(); cell != row.end(); ++cell)
-                row_norm += cell->second.first + alpha;
+        vector<Entry> entries;
+
+        LookupCache() : entries(kSize) {}
+
+        inline Entry &At(word_t source, word_t target) {
+            return entries[((size_t) source * 2654435761u + target) & (kSize - 1)];
+        }
+    };
+
+    vector<LookupCache> lookup_caches;
+
+    static inline size_t ThreadId() {
+#ifdef _OPENMP
+        return (size_t) omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
 
-            if (row_norm == 0) row_norm = 1;
+    /*
+     * Splits the rows in ranges with about the same number of cells, so that parallel passes over the table are
+     * balanced even if a few rows, like the null word one, are much longer than the others; returns the bounds.
+     */
+    vector<size_t> GetRowRanges() const {
+        const size_t rows = offsets.size() - 1;
+        const size_t ranges = GetThreads() * kShardsPerThread;
+        const size_t cells = offsets.back();
+
+        vector<size_t> bounds(1, 0);
+        for (size_t range = 1; range < ranges; ++range) {
+            size_t bound = (size_t) (std::lower_bound(offsets.begin(), offsets.end(), cells * range / ranges) -
+                                     offsets.begin());
+            if (bound > bounds.back() && bound < rows)
+                bounds.push_back(bound);
+        }
 
-            if (alpha > 0)
-                row_norm = digamma(row_norm);
+        if (rows > 0)
+            bounds.push_back(rows);
 
-            assert(isnormal(row_norm));
+        return bounds;
+    }
 
-            for (auto cell = row.begin(); cell != row.end(); ++cell)
-                cell->second.first =
-                        alpha > 0 ?
-                        exp(digamma(cell->second.first + alpha) - row_norm) :
-                        cell->second.first / row_norm;
+    inline size_t CountCells(size_t row, double threshold) const {
+        size_t size = 0;
+        for (size_t cell = offsets[row]; cell < offsets[row + 1]; ++cell) {
+            if (probs[cell] > threshold)
+                ++size;
         }
+
+        return size;
     }
 
-    void Swap() {
+    /*
+     * Keeps only the cells with a probability greater than "threshold", given the number of such cells of every
+     * row in prunedOffsets[row + 1].
+     */
+    void Compact(const vector<size_t> &ranges, vector<size_t> &prunedOffsets, double threshold) {
+        const size_t rows = offsets.size() - 1;
+        for (size_t i = 0; i < rows; ++i)
+            prunedOffsets[i + 1] += prunedOffsets[i];
+
+        vector<word_t> pruned_columns(prunedOffsets[rows]);
+        vector<double> pruned_probs(prunedOffsets[rows]);
+
 #pragma omp parallel for schedule(dynamic)
-        for (size_t i = 0; i < data.size(); ++i) {
-            for (auto cell = data[i].begin(); cell != data[i].end(); ++cell) {
-                cell->second.first = cell->second.second;
-                cell->second.second = 0;
+        for (size_t range = 0; range < ranges.size() - 1; ++range) {
+            for (size_t i = ranges[range]; i < ranges[range + 1]; ++i) {
+                size_t j = prunedOffsets[i];
+                for (size_t cell = offsets[i]; cell < offsets[i + 1]; ++cell) {
+                    if (probs[cell] > threshold) {
+                        pruned_columns[j] = columns[cell];
+                        pruned_probs[j] = probs[cell];
+                        ++j;
+                    }
+                }
             }
         }
+
+        offsets.swap(prunedOffsets);
+        columns.swap(pruned_columns);
+        probs.swap(pruned_probs);
+        pruned = true;
+
+        vector<double>().swap(counts);
+        pending.clear();
+        lookup_caches.assign(lookup_caches.size(), LookupCache());
     }
 
-    void Store(const string &filename) {
-        ofstream out(filename, ios::binary | ios::out);
+    static inline size_t GetThreads() {
+#ifdef _OPENMP
+        return (size_t) omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    template<bool kPosteriors>
+    double PartialPass(const PrefetchReader::batch_t &batch, const vector<size_t> &positions, double *sums,
+                       double *outLogLikelihood) {
+        const PosteriorOps &ops = PosteriorOps::Get();
+        const bool has_null = use_null && Contains(kNullWord);
+        double emp_feat = 0.0;
+        double log_likelihood = 0.0;
+
+        vector<size_t> order;
+        if (GetThreads() > 1)
+            AlignmentKernel::GetCostOrder(batch, order);
+
+#pragma omp parallel for schedule(dynamic) reduction(+:emp_feat, log_likelihood)
+        for (size_t n = 0; n < batch.size(); ++n) {
+            const size_t k = order.empty() ? n : order[n];
+            const wordvec_t &src = is_reverse ? batch[k].second : batch[k].first;
+            const wordvec_t &trg = is_reverse ? batch[k].first : batch[k].second;
+
+            length_t src_size = (length_t) src.size();
+            length_t trg_size = (length_t) trg.size();
+            double *line_sums = sums + positions[k];
 
-        io_write(out, use_null);
-        io_write(out, favor_diagonal);
-        io_write(out, prob_align_null);
-        io_write(out, diagonal_tension);
+            double line_feat = 0.0;
 
-        io_write(out, data.size());
+            vector<double> row(src_size);
+            vector<double> prior_buffer;
+            const double *prior = favor_diagonal ? prior_cache->GetPrior(trg_size, src_size, prior_buffer) : nullptr;
 
-        for (word_t sourceWord = 0; sourceWord < data.size(); ++sourceWord) {
-            unordered_map<word_t, pair<double, double>> &row = data[sourceWord];
+            // Same arithmetic of AlignmentKernel, with the words of the other rows contributing 0
+            for (length_t j = 0; j < trg_size; ++j) {
+                const word_t f_j = trg[j];
 
-            if (!row.empty()) {
-                io_write(out, sourceWord);
-                io_write(out, row.size());
+                double prob_a_i = 1.0 / (src_size + (use_null ? 1 : 0));
+                if (use_null && favor_diagonal)
+                    prob_a_i = prob_align_null;
 
-                for (auto entry = row.begin(); entry != row.end(); ++entry) {
-                    io_write(out, entry->first);
-                    io_write(out, (float) (entry->second.first));
+                double null_prob = has_null ? Probability<false>(kNullWord, f_j) * prob_a_i : 0.;
+
+                for (length_t i = 0; i < src_size; ++i)
+                    row[i] = Contains(src[i]) ? Probability<false>(src[i], f_j) : 0.;
+
+                if (favor_diagonal) {
+                    ops.Multiply(row.data(), prior + (size_t) j * src_size, src_size);
+                } else {
+                    for (length_t i = 0; i < src_size; ++i)
+                        row[i] *= prob_a_i;
+                }
+
+                if (!kPosteriors) {
+                    line_sums[j] += ops.Sum(row.data(), src_size, null_prob);
+                    continue;
+                }
+
+                double sum = line_sums[j];
+                assert(isnormal(sum));
+
+                if (outLogLikelihood)
+                    log_likelihood += log(sum);
+
+                if (has_null)
+                    Increment(kNullWord, f_j, null_prob / sum);
+
+                line_feat = ops.Normalize(row.data(), src_size, sum, j, trg_size, src_size, line_feat);
+
+                for (length_t i = 0; i < src_size; ++i) {
+                    if (Contains(src[i]))
+                        Increment(src[i], f_j, row[i]);
                 }
             }
+
+            emp_feat += line_feat;
         }
+
+        if (outLogLikelihood)
+            *outLogLikelihood += log_likelihood;
+
+        return emp_feat;
+    }
+
+    inline size_t Find(word_t source, word_t target) const {
+        if (!Contains(source))
+            return kNoCell;
+
+        const size_t row = source - first_row;
+        const size_t begin = offsets[row];
+        const word_t *ptr = TranslationTable::Search(columns.data() + begin, offsets[row + 1] - begin, target);
+
+        return ptr == nullptr ? kNoCell : (size_t) (ptr - columns.data());
     }
 };
 
 Builder::Builder(Options options) : case_sensitive(options.case_sensitive),
                                     initial_diagonal_tension(options.initial_diagonal_tension),
                                     iterations(options.iterations),
+                                    min_iterations(options.min_iterations),
+                                    convergence_threshold(options.convergence_threshold),
                                     favor_diagonal(options.favor_diagonal),
                                     prob_align_null(options.prob_align_null),
                                     optimize_tension(options.optimize_tension),
@@ -155,10 +633,27 @@ Builder::Builder(Options options) : case_sensitive(options.case_sensitive),
                                     pruning(options.pruning_threshold),
                                     max_length(options.max_line_length),
                                     vocabulary_threshold(options.vocabulary_threshold),
+                                    quantization_bits(options.quantization_bits),
+                                    encoded_corpus_path(options.encoded_corpus_path),
+                                    cooccurrences_memory(options.cooccurrences_memory),
+                                    training_memory(options.training_memory),
+                                    workers(options.workers),
+                                    work_dir(options.work_dir),
+                                    initial_model(options.initial_model),
                                     threads((options.threads == 0) ? (int) thread::hardware_concurrency()
                                                                    : options.threads) {
     if (variational_bayes && alpha <= 0.0)
         throw invalid_argument("Parameter 'alpha' must be greather than 0");
+    if (quantization_bits != 0 && quantization_bits != 8 && quantization_bits != 16)
+        throw invalid_argument("Parameter 'quantization_bits' must be 0, 8 or 16");
+    if (convergence_threshold < 0.0)
+        throw invalid_argument("Parameter 'convergence_threshold' must be greater than or equal to 0");
+    if (workers > 0 && work_dir.empty())
+        throw invalid_argument("Parameter 'work_dir' is required by distributed training");
+    if (workers > 0 && training_memory > 0)
+        throw invalid_argument("Distributed training does not support a limited 'training_memory'");
+    if (workers > 0 && !encoded_corpus_path.empty())
+        throw invalid_argument("Distributed training does not support 'encoded_corpus_path'");
 
 #ifdef _OPENMP
     omp_set_dynamic(0);
@@ -170,309 +665,1581 @@ void Builder::setListener(Builder::Listener *listener) {
     Builder::listener = listener;
 }
 
-void Builder::AllocateTTableSpace(Model *_model, const unordered_map<word_t, wordvec_t> &values,
-                                  const word_t sourceWordMaxValue) {
-    BuilderModel *model = (BuilderModel *) _model;
-    if (model->data.size() <= sourceWordMaxValue)
-        model->data.resize(sourceWordMaxValue + 1);
-
-#pragma omp parallel for schedule(dynamic)
-    for (size_t bucket = 0; bucket < values.bucket_count(); ++bucket) {
-        for (auto row_ptr = values.begin(bucket); row_ptr != values.end(bucket); ++row_ptr) {
-            word_t sourceWord = row_ptr->first;
-
-            for (auto targetWord = row_ptr->second.begin(); targetWord != row_ptr->second.end(); ++targetWord)
-                model->data[sourceWord][*targetWord] = pair<double, double>(kNullProbability, 0);
-        }
+/*
+ * Normalization sums of all the target words of the training corpus, stored on disk in corpus order: every pass
+ * over a partition of the table reads the sums written by the previous pass and writes the updated ones.
+ */
+class PartialSums {
+public:
+    explicit PartialSums(const string &path) : current(0), writing(false) {
+        paths[0] = path + ".0";
+        paths[1] = path + ".1";
     }
-}
-
-void Builder::InitialPass(const Vocabulary &vocab, Model *_model, const std::vector<Corpus> &corpora,
-                          double *n_target_tokens, vector<pair<pair<length_t, length_t>, size_t>> *size_counts) {
-    auto *model = (BuilderModel *) _model;
-
-    unordered_map<pair<length_t, length_t>, size_t, LengthPairHash> size_counts_;
 
-    unordered_map<word_t, wordvec_t> buffer;
-    word_t maxSourceWord = 0;
-    size_t buffer_items = 0;
-    wordvec_t src, trg;
+    ~PartialSums() {
+        remove(paths[0].c_str());
+        remove(paths[1].c_str());
+    }
 
-    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
-        CorpusReader reader(*corpus, &vocab, max_length, true);
+    /*
+     * Starts a pass: if "read" is false, all the sums read are 0.
+     */
+    void Begin(bool read, bool write) {
+        if (read) {
+            in.open(paths[current], ios::binary | ios::in);
+            if (!in.is_open())
+                throw runtime_error("Unable to open sums file: " + paths[current]);
+        }
 
-        while (reader.Read(src, trg)) {
-            if (model->is_reverse)
-                swap(src, trg);
+        if (write) {
+            out.open(paths[1 - current], ios::binary | ios::out);
+            if (!out.is_open())
+                throw runtime_error("Unable to create sums file: " + paths[1 - current]);
+        }
 
-            *n_target_tokens += trg.size();
+        writing = write;
+    }
 
-            if (use_null) {
-                for (size_t idxf = 0; idxf < trg.size(); ++idxf) {
-                    buffer[kNullWord].push_back(trg[idxf]);
-                }
+    void Read(double *outValues, size_t size) {
+        if (!in.is_open()) {
+            std::fill(outValues, outValues + size, 0.);
+            return;
+        }
 
-                buffer_items += trg.size();
-            }
+        in.read((char *) outValues, size * sizeof(double));
+        if (!in)
+            throw runtime_error("Truncated sums file: " + paths[current]);
+    }
 
-            for (size_t idxe = 0; idxe < src.size(); ++idxe) {
-                for (size_t idxf = 0; idxf < trg.size(); ++idxf) {
-                    maxSourceWord = max(maxSourceWord, src[idxe]);
-                    buffer[src[idxe]].push_back(trg[idxf]);
-                }
-                buffer_items += trg.size();
-            }
+    void Write(const double *values, size_t size) {
+        out.write((const char *) values, size * sizeof(double));
+        if (!out)
+            throw runtime_error("Error writing sums file: " + paths[1 - current]);
+    }
 
-            if (buffer_items > buffer_size * 100) {
-                AllocateTTableSpace(model, buffer, maxSourceWord);
-                buffer_items = 0;
-                maxSourceWord = 0;
-                buffer.clear();
-            }
+    void End() {
+        if (in.is_open())
+            in.close();
 
-            ++size_counts_[make_pair<length_t, length_t>((length_t) trg.size(), (length_t) src.size())];
+        if (writing) {
+            out.close();
+            current = 1 - current;
+            writing = false;
         }
     }
 
-    for (auto p = size_counts_.begin(); p != size_counts_.end(); ++p) {
-        size_counts->push_back(*p);
-    }
+private:
+    string paths[2];
+    size_t current;
+    bool writing;
 
-    AllocateTTableSpace(model, buffer, maxSourceWord);
-}
+    ifstream in;
+    ofstream out;
+};
 
-void Builder::Build(const std::vector<Corpus> &corpora, const string &path) {
-    if (listener) {
-        std::ostringstream opts;
-        opts << "{"
-             << "alpha=" << alpha << ", "
-             << "buffer_size=" << buffer_size << ", "
-             << "case_sensitive=" << (case_sensitive ? "true" : "false") << ", "
-             << "favor_diagonal=" << (favor_diagonal ? "true" : "false") << ", "
-             << "initial_diagonal_tension=" << initial_diagonal_tension << ", "
-             << "iterations=" << iterations << ", "
-             << "max_length=" << max_length << ", "
-             << "optimize_tension=" << (optimize_tension ? "true" : "false") << ", "
-             << "prob_align_null=" << prob_align_null << ", "
-             << "pruning=" << pruning << ", "
-             << "threads=" << threads << ", "
-             << "use_null=" << (use_null ? "true" : "false") << ", "
-             << "variational_bayes=" << (variational_bayes ? "true" : "false") << ", "
-             << "vocabulary_threshold=" << vocabulary_threshold
-             << "}";
+/*
+ * Computes the position of the first target word of every line of the batch; returns the number of target words.
+ */
+static size_t GetTargetPositions(const PrefetchReader::batch_t &batch, bool is_reverse, vector<size_t> &outPositions) {
+    outPositions.resize(batch.size());
 
-        listener->BuildStart(opts.str());
+    size_t size = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        outPositions[i] = size;
+        size += is_reverse ? batch[i].first.size() : batch[i].second.size();
     }
 
-    fs::path model_path = fs::absolute(fs::path(path));
-    fs::path fwd_model_filename = model_path.parent_path() / fs::path("fwd_model.tmp");
-    fs::path bwd_model_filename = model_path.parent_path() / fs::path("bwd_model.tmp");
-
-    if (listener) listener->VocabularyBuildBegin();
-    Vocabulary vocab(case_sensitive);
-    vocab.BuildFromCorpora(corpora, max_length, vocabulary_threshold);
-    if (listener) listener->VocabularyBuildEnd();
-
-    auto *forward = (BuilderModel *) BuildModel(vocab, corpora, true);
-    forward->Store(fwd_model_filename.string());
-    delete forward;
+    return size;
+}
 
-    auto *backward = (BuilderModel *) BuildModel(vocab, corpora, false);
-    backward->Store(bwd_model_filename.string());
-    delete backward;
+/*
+ * Source of PrefetchReader returning the training batches of all the parts of the corpus
+ */
+class TrainingBatches {
+public:
+    TrainingBatches(const EncodedCorpus &corpus, size_t max_length, size_t buffer_size)
+            : corpus(corpus), max_length(max_length), buffer_size(buffer_size), part(0) {
+    }
 
-    if (listener) listener->ModelDumpBegin();
-    ofstream out(model_path.string(), ios::binary | ios::out);
-    vocab.Store(out);
-    MergeAndStore(out, fwd_model_filename.string(), bwd_model_filename.string());
-    out.close();
+    bool operator()(PrefetchReader::batch_t &outBatch) {
+        while (part < corpus.Size()) {
+            if (!reader)
+                reader = make_shared<EncodedCorpusReader>(corpus, part, max_length, true);
 
-    if (remove(fwd_model_filename.c_str()) != 0)
-        throw runtime_error("Error deleting the forward model file");
+            if (reader->Read(outBatch, buffer_size))
+                return true;
 
-    if (remove(bwd_model_filename.c_str()) != 0)
-        throw runtime_error("Error deleting the backward model file");
+            reader.reset();
+            ++part;
+        }
 
-    if (listener) listener->ModelDumpEnd();
-}
+        return false;
+    }
 
-Model *Builder::BuildModel(const Vocabulary &vocab, const std::vector<Corpus> &corpora, bool forward) {
-    auto *model = new BuilderModel(!forward, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+private:
+    const EncodedCorpus &corpus;
+    const size_t max_length;
+    const size_t buffer_size;
 
-    if (listener) listener->Begin(forward);
+    size_t part;
+    shared_ptr<EncodedCorpusReader> reader;
+};
 
-    vector<pair<pair<length_t, length_t>, size_t>> size_counts;
-    double n_target_tokens = 0;
+/*
+ * Length pairs collected for a single direction during the initial pass
+ */
+struct InitialPassBuffer {
+    word_t maxSourceWord = 0;
+    vector<bool> sourceWords;
 
-    if (listener) listener->Begin(forward, kBuilderStepSetup, 0);
-    InitialPass(vocab, model, corpora, &n_target_tokens, &size_counts);
-    if (listener) listener->End(forward, kBuilderStepSetup, 0);
+    unordered_map<pair<length_t, length_t>, size_t, LengthPairHash> size_counts;
+};
 
-    for (int iter = 0; iter < iterations; ++iter) {
-        if (listener) listener->IterationBegin(forward, iter + 1);
+// Memory used by every cell of a table under training: column, probability and count
+static const size_t kTrainingCellSize = sizeof(word_t) + 2 * sizeof(double);
 
-        double emp_feat = 0.0;
+static inline string GetPartitionPath(const string &tmpPath, size_t direction, size_t partition) {
+    return tmpPath + (direction == 0 ? ".fwd." : ".bwd.") + to_string(partition);
+}
 
-        vector<pair<wordvec_t, wordvec_t>> batch;
+/*
+ * Counts the cells of every row of both directions: the co-occurrences of the row word plus, in the null row,
+ * every word of the other side.
+ */
+static void CountRows(CooccurrenceSorter &sorter, const InitialPassBuffer buffers[2], bool use_null,
+                      vector<size_t> outSizes[2]) {
+    for (size_t direction = 0; direction < 2; ++direction) {
+        outSizes[direction].assign((size_t) buffers[direction].maxSourceWord + 1, 0);
+
+        if (use_null) {
+            const vector<bool> &words = buffers[1 - direction].sourceWords;
+            outSizes[direction][kNullWord] = (size_t) std::count(words.begin(), words.end(), true);
+        }
+    }
 
-        if (listener) listener->Begin(forward, kBuilderStepAligning, iter + 1);
-        for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
-            CorpusReader reader(*corpus, &vocab, max_length, true);
+    vector<CooccurrenceSorter::key_t> keys(1 << 16);
+    CooccurrenceSorter::Reader reader(sorter);
 
-            while (reader.Read(batch, buffer_size)) {
-                emp_feat += model->ComputeAlignments(batch, model, nullptr);
-                batch.clear();
-            }
+    size_t size;
+    while ((size = reader.Read(keys.data(), keys.size())) > 0) {
+        for (size_t i = 0; i < size; ++i) {
+            ++outSizes[0][CooccurrenceSorter::GetSource(keys[i])];
+            ++outSizes[1][CooccurrenceSorter::GetTarget(keys[i])];
         }
-        if (listener) listener->End(forward, kBuilderStepAligning, iter + 1);
-
-        emp_feat /= n_target_tokens;
+    }
+}
 
-        if (favor_diagonal && optimize_tension) {
-            if (listener) listener->Begin(forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+/*
+ * Splits the rows in the given number of ranges with about the same number of cells; returns the bounds of the
+ * ranges (the last ones may be empty).
+ */
+static vector<size_t> SplitRows(const vector<size_t> &sizes, size_t partitions) {
+    size_t total = 0;
+    for (auto size = sizes.begin(); size != sizes.end(); ++size)
+        total += *size;
+
+    vector<size_t> bounds(1, 0);
+    size_t cells = 0;
+
+    for (size_t row = 0; row < sizes.size() && bounds.size() < partitions; ++row) {
+        cells += sizes[row];
+        if (cells * partitions >= total * bounds.size())
+            bounds.push_back(row + 1);
+    }
 
-            for (int ii = 0; ii < 8; ++ii) {
-                double mod_feat = 0;
-#pragma omp parallel for reduction(+:mod_feat)
-                for (size_t i = 0; i < size_counts.size(); ++i) {
-                    const pair<length_t, length_t> &p = size_counts[i].first;
-                    double _tmp_mod_feat = 0.0;
-                    for (length_t j = 1; j <= p.first; ++j)
-                        _tmp_mod_feat += DiagonalAlignment::ComputeDLogZ(j, p.first, p.second, model->diagonal_tension);
-                    mod_feat += size_counts[i].second * _tmp_mod_feat;
-                }
+    while (bounds.size() <= partitions)
+        bounds.push_back(sizes.size());
 
-                mod_feat /= n_target_tokens;
-                model->diagonal_tension += (emp_feat - mod_feat) * 20.0;
-                if (model->diagonal_tension <= 0.1) model->diagonal_tension = 0.1;
-                if (model->diagonal_tension > 14) model->diagonal_tension = 14;
-            }
+    return bounds;
+}
 
-            if (listener) listener->End(forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+/*
+ * Builds the skeleton of rows [begin, end) of a direction from the sorted co-occurrences. Backward rows are
+ * target words, so their keys are transposed: keys are sorted by source and then by target, so the columns
+ * of every row come out sorted in both cases.
+ */
+static void BuildRows(CooccurrenceSorter &sorter, const vector<size_t> &sizes, const InitialPassBuffer &target,
+                      bool use_null, bool transpose, size_t begin, size_t end, BuilderModel *model) {
+    model->first_row = (word_t) begin;
+    model->offsets.assign(end - begin + 1, 0);
+    for (size_t row = begin; row < end; ++row)
+        model->offsets[row - begin + 1] = model->offsets[row - begin] + sizes[row];
+
+    model->columns.resize(model->offsets.back());
+    vector<size_t> positions(model->offsets.begin(), model->offsets.end() - 1);
+
+    if (use_null && begin == kNullWord && end > begin) {
+        for (word_t word = 0; word < target.sourceWords.size(); ++word) {
+            if (target.sourceWords[word])
+                model->columns[positions[0]++] = word;
         }
-
-        if (listener) listener->Begin(forward, kBuilderStepNormalizing, iter + 1);
-        model->Swap();
-        model->Normalize(variational_bayes ? alpha : 0);
-        if (listener) listener->End(forward, kBuilderStepNormalizing, iter + 1);
-
-        if (listener) listener->IterationEnd(forward, iter + 1);
     }
 
-    if (listener) listener->Begin(forward, kBuilderStepPruning, 0);
-    model->Prune(pruning);
-    if (listener) listener->End(forward, kBuilderStepPruning, 0);
+    vector<CooccurrenceSorter::key_t> keys(1 << 16);
+    CooccurrenceSorter::Reader reader(sorter);
 
-    if (listener) listener->End(forward);
+    size_t size;
+    while ((size = reader.Read(keys.data(), keys.size())) > 0) {
+        for (size_t i = 0; i < size; ++i) {
+            word_t source = CooccurrenceSorter::GetSource(keys[i]);
+            word_t target_word = CooccurrenceSorter::GetTarget(keys[i]);
 
-    return model;
+            size_t row = transpose ? target_word : source;
+            if (row >= begin && row < end)
+                model->columns[positions[row - begin]++] = transpose ? source : target_word;
+        }
+    }
 }
 
-void Builder::MergeAndStore(std::ostream &out, const string &fwd_path, const string &bwd_path) {
-    // creating the bitable
-    auto *table = new bitable_t;
+size_t Builder::InitialPass(const EncodedCorpus &corpus, const string &tmpPath, Model *forward, Model *backward) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+    InitialPassBuffer buffers[2];
 
-    // opening forward model file for reading
-    ifstream fwd_in(fwd_path, ios::binary | ios::in);
+    size_t threads = 1;
+#ifdef _OPENMP
+    threads = (size_t) omp_get_max_threads();
+#endif
 
-    // loading forward header
-    auto fwd_use_null = io_read<bool>(fwd_in);
-    auto fwd_favor_diagonal = io_read<bool>(fwd_in);
-    auto fwd_prob_align_null = io_read<double>(fwd_in);
-    auto fwd_diagonal_tension = io_read<double>(fwd_in);
-    auto fwd_ttable_size = io_read<size_t>(fwd_in);
+    // Co-occurrences are collected once, as forward (source, target) pairs: backward ones are the same, transposed
+    CooccurrenceSorter sorter(cooccurrences_memory, tmpPath + ".cooccurrences");
+    const size_t keys_limit = sorter.GetBufferSize(threads);
+    vector<vector<CooccurrenceSorter::key_t>> keys(threads);
 
-    if (fwd_ttable_size == 0)
-        throw runtime_error("The forward model is empty");
+    PrefetchReader prefetch(TrainingBatches(corpus, max_length, buffer_size));
 
-    // resizing the bitable
-    table->resize(fwd_ttable_size);
+    PrefetchReader::batch_t batch;
+    while (prefetch.Read(batch)) {
+        for (auto line = batch.begin(); line != batch.end(); ++line) {
+            for (size_t direction = 0; direction < 2; ++direction) {
+                BuilderModel *model = models[direction];
+                InitialPassBuffer &buffer = buffers[direction];
 
-    // loading forward entries and fill the bitable
-    while (true) {
-        auto src_word = io_read<word_t>(fwd_in);
-        if (fwd_in.eof())
-            break;
+                const wordvec_t &src = model->is_reverse ? line->second : line->first;
+                const wordvec_t &trg = model->is_reverse ? line->first : line->second;
 
-        auto row_size = io_read<size_t>(fwd_in);
-        table->at(src_word).reserve(row_size);
+                model->n_target_tokens += trg.size();
 
-        for (size_t i = 0; i < row_size; ++i) {
-            auto tgt_word = io_read<word_t>(fwd_in);
-            auto score = io_read<float>(fwd_in);
+                for (auto word = src.begin(); word != src.end(); ++word) {
+                    if (*word >= buffer.sourceWords.size())
+                        buffer.sourceWords.resize(std::max((size_t) *word + 1, buffer.sourceWords.size() * 2));
+                    buffer.sourceWords[*word] = true;
+                    buffer.maxSourceWord = max(buffer.maxSourceWord, *word);
+                }
 
-            table->at(src_word)[tgt_word] = pair<float, float>(score, kNullProbability);
+                ++buffer.size_counts[make_pair<length_t, length_t>((length_t) trg.size(), (length_t) src.size())];
+            }
         }
-    }
 
-    // closing forward model file
-    fwd_in.close();
-
-    // opening backward model file for reading
-    ifstream bwd_in(bwd_path, ios::binary | ios::in);
+#pragma omp parallel for schedule(dynamic, 64)
+        for (size_t i = 0; i < batch.size(); ++i) {
+            size_t thread_id = 0;
+#ifdef _OPENMP
+            thread_id = (size_t) omp_get_thread_num();
+#endif
+            vector<CooccurrenceSorter::key_t> &thread_keys = keys[thread_id];
 
-    // loading backward header
-    auto bwd_use_null = io_read<bool>(bwd_in);
-    auto bwd_favor_diagonal = io_read<bool>(bwd_in);
-    auto bwd_prob_align_null = io_read<double>(bwd_in);
-    auto bwd_diagonal_tension = io_read<double>(bwd_in);
-    auto bwd_ttable_size = io_read<size_t>(bwd_in);
+            const wordvec_t &src = batch[i].first;
+            const wordvec_t &trg = batch[i].second;
 
-    // checking consistency of forward and backward models
-    assert(fwd_use_null == bwd_use_null);
-    assert(fwd_favor_diagonal == bwd_favor_diagonal);
-    assert(fwd_prob_align_null == bwd_prob_align_null);
-    assert(fwd_ttable_size == bwd_ttable_size);
+            for (auto s = src.begin(); s != src.end(); ++s) {
+                for (auto t = trg.begin(); t != trg.end(); ++t)
+                    thread_keys.push_back(CooccurrenceSorter::MakeKey(*s, *t));
+            }
 
-    if (bwd_ttable_size == 0)
-        throw runtime_error("The backward model is empty");
+            if (thread_keys.size() >= keys_limit)
+                sorter.Add(thread_keys);
+        }
+    }
 
-    // loading backward entries and fill the bitable
-    while (true) {
-        auto tgt_word = io_read<word_t>(bwd_in);
-        if (bwd_in.eof())
-            break;
+    for (auto thread_keys = keys.begin(); thread_keys != keys.end(); ++thread_keys) {
+        if (!thread_keys->empty())
+            sorter.Add(*thread_keys);
+    }
 
-        auto row_size = io_read<size_t>(bwd_in);
+    vector<vector<CooccurrenceSorter::key_t>>().swap(keys);
 
-        for (size_t i = 0; i < row_size; ++i) {
-            auto src_word = io_read<word_t>(bwd_in);
-            auto score = io_read<float>(bwd_in);
+    vector<size_t> sizes[2];
+    CountRows(sorter, buffers, use_null, sizes);
 
-            assert(src_word < table->size());
+    // Tables exceeding the training memory are split in partitions of rows, stored on disk
+    size_t partitions = 1;
+    if (training_memory > 0) {
+        for (size_t direction = 0; direction < 2; ++direction) {
+            size_t cells = 0;
+            for (auto size = sizes[direction].begin(); size != sizes[direction].end(); ++size)
+                cells += *size;
 
-            auto cell = table->at(src_word).emplace(tgt_word, pair<float, float>(kNullProbability, kNullProbability));
-            pair<float, float> &el = cell.first->second;
-            el.second = score;
+            size_t memory = std::max((size_t) 1, training_memory / 2);
+            partitions = std::max(partitions, (cells * kTrainingCellSize + memory - 1) / memory);
         }
-
     }
 
-    // closing backward model file
-    bwd_in.close();
+    for (size_t direction = 0; direction < 2; ++direction) {
+        BuilderModel *model = models[direction];
+        InitialPassBuffer &buffer = buffers[direction];
 
-    // writing header
-    io_write(out, fwd_use_null);
-    io_write(out, fwd_favor_diagonal);
-    io_write(out, fwd_prob_align_null);
-    io_write(out, fwd_diagonal_tension);
-    io_write(out, bwd_diagonal_tension);
-    io_write(out, fwd_ttable_size);
+        for (auto p = buffer.size_counts.begin(); p != buffer.size_counts.end(); ++p) {
+            model->size_counts.push_back(*p);
+        }
 
-    // writing all entries of the bitable
-    for (word_t src_word = 0; src_word < fwd_ttable_size; ++src_word) {
-        auto &row = table->at(src_word);
+        vector<size_t> bounds = SplitRows(sizes[direction], partitions);
 
-        io_write(out, src_word);
-        io_write(out, row.size());
+        for (size_t partition = 0; partition < partitions; ++partition) {
+            BuildRows(sorter, sizes[direction], buffers[1 - direction], use_null, direction == 1,
+                      bounds[partition], bounds[partition + 1], model);
+            model->Allocate();
+            if (initial_table)
+                InitializeProbabilities(model);
 
-        for (auto tgt_entry = row.begin(); tgt_entry != row.end(); ++tgt_entry) {
-            io_write(out, tgt_entry->first);
-            io_write(out, tgt_entry->second.first);
-            io_write(out, tgt_entry->second.second);
+            if (partitions > 1)
+                model->Store(GetPartitionPath(tmpPath, direction, partition));
         }
     }
 
-    // deleting bitable
-    delete table;
+    return partitions;
+}
+
+void Builder::Build(const std::vector<Corpus> &corpora, const string &path) {
+    if (listener) {
+        std::ostringstream opts;
+        opts << "{"
+             << "alpha=" << alpha << ", "
+             << "buffer_size=" << buffer_size << ", "
+             << "case_sensitive=" << (case_sensitive ? "true" : "false") << ", "
+             << "convergence_threshold=" << convergence_threshold << ", "
+             << "cooccurrences_memory=" << cooccurrences_memory << ", "
+             << "favor_diagonal=" << (favor_diagonal ? "true" : "false") << ", "
+             << "initial_diagonal_tension=" << initial_diagonal_tension << ", "
+             << "initial_model=" << (initial_model.empty() ? "none" : initial_model) << ", "
+             << "iterations=" << iterations << ", "
+             << "max_length=" << max_length << ", "
+             << "min_iterations=" << min_iterations << ", "
+             << "optimize_tension=" << (optimize_tension ? "true" : "false") << ", "
+             << "prob_align_null=" << prob_align_null << ", "
+             << "pruning=" << pruning << ", "
+             << "quantization_bits=" << quantization_bits << ", "
+             << "threads=" << threads << ", "
+             << "training_memory=" << training_memory << ", "
+             << "use_null=" << (use_null ? "true" : "false") << ", "
+             << "variational_bayes=" << (variational_bayes ? "true" : "false") << ", "
+             << "vocabulary_threshold=" << vocabulary_threshold << ", "
+             << "workers=" << workers
+             << "}";
+
+        listener->BuildStart(opts.str());
+    }
+
+    if (listener) listener->VocabularyBuildBegin();
+    Vocabulary vocab(case_sensitive);
+    vocab.BuildFromCorpora(corpora, max_length, vocabulary_threshold);
+
+    auto *forward = new BuilderModel(false, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+    auto *backward = new BuilderModel(true, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+
+    if (!initial_model.empty())
+        WarmStart(vocab, forward, backward);
+
+    // Tables trained out of core are left on disk in partitions, see TrainPartitions()
+    const string tmpPath = path + ".tmp";
+    size_t partitions = 1;
+
+    if (workers > 0) {
+        if (listener) listener->VocabularyBuildEnd();
+
+        TrainDistributed(vocab, forward, backward);
+    } else {
+        // From now on, every pass reads the word ids from the encoded corpus instead of parsing the text again;
+        // with a limited training memory, the encoded corpus is always mapped from disk
+        string corpus_path = encoded_corpus_path;
+        if (corpus_path.empty() && training_memory > 0)
+            corpus_path = path + ".corpus";
+
+        auto *corpus = new EncodedCorpus(corpora, vocab, (size_t) threads);
+        if (!corpus_path.empty()) {
+            corpus->Store(corpus_path);
+            delete corpus;
+            corpus = new EncodedCorpus(corpus_path);
+        }
+        if (listener) listener->VocabularyBuildEnd();
+
+        partitions = Train(*corpus, tmpPath, forward, backward);
+        delete corpus;
+
+        if (corpus_path != encoded_corpus_path)
+            remove(corpus_path.c_str());
+    }
+
+    initial_table.reset();
+    vector<word_t>().swap(initial_mapping);
+
+    if (listener) listener->ModelDumpBegin();
+    MergeAndStore(vocab, path, tmpPath, partitions, forward, backward);
+    if (listener) listener->ModelDumpEnd();
+
+    delete forward;
+    delete backward;
+}
+
+void Builder::WarmStart(const Vocabulary &vocab, Model *forward, Model *backward) {
+    Vocabulary initial_vocab;
+    Model *initial_forward, *initial_backward;
+    BidirectionalModel::Open(initial_model, &initial_vocab, &initial_forward, &initial_backward, 0);
+
+    initial_table = ((BidirectionalModel *) initial_forward)->GetTable();
+    initial_mapping = vocab.GetMapping(initial_vocab);
+
+    forward->SetDiagonalTension(initial_forward->diagonal_tension);
+    backward->SetDiagonalTension(initial_backward->diagonal_tension);
+
+    delete initial_forward;
+    delete initial_backward;
+}
+
+void Builder::InitializeProbabilities(Model *_model) {
+    auto *model = (BuilderModel *) _model;
+    const TranslationTable &table = *initial_table;
+    const vector<word_t> &mapping = initial_mapping;
+    const size_t rows = model->offsets.size() - 1;
+
+    // Words missing from the initial model are mapped to kUnknownWord: their cells keep kNullProbability,
+    // as in a training from scratch
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < rows; ++i) {
+        const word_t word = (word_t) (model->first_row + i);
+        const word_t row = mapping[word];
+        if (row == kUnknownWord && word != kUnknownWord)
+            continue;
+
+        for (size_t cell = model->offsets[i]; cell < model->offsets[i + 1]; ++cell) {
+            const word_t column = mapping[model->columns[cell]];
+            if (column == kUnknownWord && model->columns[cell] != kUnknownWord)
+                continue;
+
+            // backward rows are target words, the columns of the table
+            double probability = model->is_reverse ? table.Get(column, row, 1, -1.) : table.Get(row, column, 0, -1.);
+            if (probability >= 0)
+                model->probs[cell] = probability;
+        }
+    }
+}
+
+size_t Builder::Train(const EncodedCorpus &corpus, const string &tmpPath, Model *forward, Model *backward) {
+    if (listener) listener->Begin(true);
+
+    if (listener) listener->Begin(true, kBuilderStepSetup, 0);
+    size_t partitions = InitialPass(corpus, tmpPath, forward, backward);
+    if (listener) listener->End(true, kBuilderStepSetup, 0);
+
+    if (partitions > 1) {
+        TrainPartitions(corpus, tmpPath, partitions, forward, backward);
+        if (listener) listener->End(true);
+        return partitions;
+    }
+
+    bool active[2] = {true, true};
+    double previous[2] = {0.0, 0.0};
+
+    for (int iter = 0; iter < iterations && (active[0] || active[1]); ++iter) {
+        if (listener) listener->IterationBegin(true, iter + 1);
+
+        double emp_feat[2] = {0.0, 0.0};
+        double log_likelihood[2] = {0.0, 0.0};
+
+        if (listener) listener->Begin(true, kBuilderStepAligning, iter + 1);
+        Align(corpus, forward, backward, active, emp_feat, log_likelihood);
+        if (listener) listener->End(true, kBuilderStepAligning, iter + 1);
+
+        Maximize(forward, backward, active, emp_feat, iter + 1);
+        CheckConvergence(forward, backward, iter + 1, log_likelihood, previous, active);
+
+        if (listener) listener->IterationEnd(true, iter + 1);
+    }
+
+    Prune(forward, backward);
+
+    if (listener) listener->End(true);
+
+    return 1;
+}
+
+void Builder::Align(const EncodedCorpus &corpus, Model *forward, Model *backward, const bool active[2],
+                    double outEmpFeat[2], double outLogLikelihood[2]) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+
+    // Both directions are trained on the same batches: every model reverses the pairs by itself.
+    // The next batches are read in background while the current one is aligned.
+    PrefetchReader prefetch(TrainingBatches(corpus, max_length, buffer_size));
+
+    PrefetchReader::batch_t batch;
+    while (prefetch.Read(batch)) {
+        for (size_t direction = 0; direction < 2; ++direction) {
+            if (active[direction])
+                outEmpFeat[direction] += models[direction]->ComputeAlignments(batch, models[direction], nullptr,
+                                                                              nullptr, &outLogLikelihood[direction]);
+        }
+    }
+}
+
+void Builder::Maximize(Model *forward, Model *backward, const bool active[2], const double emp_feat[2],
+                       int iteration) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+
+    for (size_t direction = 0; direction < 2; ++direction) {
+        if (!active[direction])
+            continue;
+
+        BuilderModel *model = models[direction];
+        bool is_forward = !model->is_reverse;
+
+        if (favor_diagonal && optimize_tension) {
+            if (listener) listener->Begin(is_forward, kBuilderStepOptimizingDiagonalTension, iteration);
+            model->OptimizeDiagonalTension(emp_feat[direction] / model->n_target_tokens);
+            if (listener) listener->End(is_forward, kBuilderStepOptimizingDiagonalTension, iteration);
+        }
+
+        // The last iteration prunes the table while normalizing it
+        if (listener) listener->Begin(is_forward, kBuilderStepNormalizing, iteration);
+        model->Normalize(variational_bayes ? alpha : 0, iteration == iterations, pruning);
+        if (listener) listener->End(is_forward, kBuilderStepNormalizing, iteration);
+    }
+}
+
+void Builder::CheckConvergence(Model *forward, Model *backward, int iteration, const double log_likelihood[2],
+                               double previous[2], bool active[2]) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+
+    for (size_t direction = 0; direction < 2; ++direction) {
+        if (!active[direction])
+            continue;
+
+        BuilderModel *model = models[direction];
+        bool is_forward = !model->is_reverse;
+
+        double perplexity = exp(-log_likelihood[direction] / model->n_target_tokens);
+        if (listener) listener->LogLikelihood(is_forward, iteration, log_likelihood[direction], perplexity);
+
+        // The first iteration has no previous log-likelihood to compare with
+        if (convergence_threshold > 0 && iteration > 1 && iteration >= min_iterations) {
+            double improvement = (log_likelihood[direction] - previous[direction]) / fabs(previous[direction]);
+
+            if (improvement < convergence_threshold) {
+                active[direction] = false;
+                if (listener) listener->Converged(is_forward, iteration);
+            }
+        }
+
+        previous[direction] = log_likelihood[direction];
+    }
+}
+
+void Builder::Prune(Model *forward, Model *backward) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+
+    for (size_t direction = 0; direction < 2; ++direction) {
+        bool is_forward = !models[direction]->is_reverse;
+
+        if (models[direction]->pruned)
+            continue;
+
+        if (listener) listener->Begin(is_forward, kBuilderStepPruning, 0);
+        models[direction]->Prune(pruning);
+        if (listener) listener->End(is_forward, kBuilderStepPruning, 0);
+    }
+}
+
+void Builder::TrainPartitions(const EncodedCorpus &corpus, const string &tmpPath, size_t partitions,
+                              Model *forward, Model *backward) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+
+    PartialSums forward_sums(tmpPath + ".fwd.sums");
+    PartialSums backward_sums(tmpPath + ".bwd.sums");
+    PartialSums *sums[2] = {&forward_sums, &backward_sums};
+
+    vector<size_t> positions[2];
+    vector<double> values[2];
+
+    bool active[2] = {true, true};
+    bool pruned[2] = {false, false};
+    double previous[2] = {0.0, 0.0};
+
+    for (int iter = 0; iter < iterations && (active[0] || active[1]); ++iter) {
+        if (listener) listener->IterationBegin(true, iter + 1);
+
+        double emp_feat[2] = {0.0, 0.0};
+        double log_likelihood[2] = {0.0, 0.0};
+
+        // The first pass over the partitions computes the normalization sum of every target word, the second
+        // one computes the posteriors and normalizes every partition as soon as its counts are complete
+        if (listener) listener->Begin(true, kBuilderStepAligning, iter + 1);
+        for (size_t pass = 0; pass < 2; ++pass) {
+            bool posteriors = pass == 1;
+
+            for (size_t partition = 0; partition < partitions; ++partition) {
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    if (!active[direction])
+                        continue;
+
+                    models[direction]->Load(GetPartitionPath(tmpPath, direction, partition));
+                    if (posteriors)
+                        models[direction]->AllocateCounts();
+
+                    sums[direction]->Begin(posteriors || partition > 0, !posteriors);
+                }
+
+                PrefetchReader prefetch(TrainingBatches(corpus, max_length, buffer_size));
+
+                PrefetchReader::batch_t batch;
+                while (prefetch.Read(batch)) {
+                    for (size_t direction = 0; direction < 2; ++direction) {
+                        if (!active[direction])
+                            continue;
+
+                        BuilderModel *model = models[direction];
+
+                        size_t size = GetTargetPositions(batch, model->is_reverse, positions[direction]);
+                        values[direction].resize(size);
+                        sums[direction]->Read(values[direction].data(), size);
+
+                        // The sums are complete in every partition: the log-likelihood is counted once
+                        if (posteriors) {
+                            emp_feat[direction] += model->AddPartialPosteriors(
+                                    batch, positions[direction], values[direction].data(),
+                                    partition == 0 ? &log_likelihood[direction] : nullptr);
+                        } else {
+                            model->AddPartialSums(batch, positions[direction], values[direction].data());
+                            sums[direction]->Write(values[direction].data(), size);
+                        }
+                    }
+                }
+
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    if (!active[direction])
+                        continue;
+
+                    sums[direction]->End();
+
+                    if (posteriors) {
+                        pruned[direction] = iter + 1 == iterations;
+                        models[direction]->Normalize(variational_bayes ? alpha : 0, pruned[direction], pruning);
+                        models[direction]->Store(GetPartitionPath(tmpPath, direction, partition));
+                    }
+                }
+            }
+        }
+        if (listener) listener->End(true, kBuilderStepAligning, iter + 1);
+
+        for (size_t direction = 0; direction < 2; ++direction) {
+            BuilderModel *model = models[direction];
+            bool is_forward = !model->is_reverse;
+
+            if (active[direction] && favor_diagonal && optimize_tension) {
+                if (listener) listener->Begin(is_forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+                model->OptimizeDiagonalTension(emp_feat[direction] / model->n_target_tokens);
+                if (listener) listener->End(is_forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+            }
+        }
+
+        CheckConvergence(forward, backward, iter + 1, log_likelihood, previous, active);
+
+        if (listener) listener->IterationEnd(true, iter + 1);
+    }
+
+    for (size_t direction = 0; direction < 2; ++direction) {
+        bool is_forward = !models[direction]->is_reverse;
+
+        if (pruned[direction])
+            continue;
+
+        if (listener) listener->Begin(is_forward, kBuilderStepPruning, 0);
+        for (size_t partition = 0; partition < partitions; ++partition) {
+            string path = GetPartitionPath(tmpPath, direction, partition);
+
+            models[direction]->Load(path);
+            models[direction]->Prune(pruning);
+            models[direction]->Store(path);
+        }
+        if (listener) listener->End(is_forward, kBuilderStepPruning, 0);
+    }
+
+    // The pruned partitions stay on disk: MergeAndStore() reads them one at a time
+    for (size_t direction = 0; direction < 2; ++direction)
+        models[direction]->Release();
+}
+
+/*
+ * Distributed training: the coordinator and the workers exchange files through the shared work directory.
+ * Every file is written with a temporary name and renamed when complete, so that a process waiting for a file
+ * never reads it partially. A process failing writes "error.<name>" with its message, and every other process
+ * stops waiting as soon as it finds it.
+ */
+static const char *const kWorkErrorPrefix = "error.";
+
+static string GetWorkPath(const string &dir, const string &name) {
+    return (fs::path(dir) / name).string();
+}
+
+static string GetCountsName(int iteration, size_t worker) {
+    return "counts." + to_string(iteration) + "." + to_string(worker);
+}
+
+static string GetTableName(int iteration) {
+    return "table." + to_string(iteration);
+}
+
+static void Publish(const string &tmpPath, const string &path) {
+    fs::rename(tmpPath, path);
+}
+
+static void CheckErrors(const string &dir) {
+    if (!fs::is_directory(dir))
+        return;
+
+    for (fs::directory_iterator file(dir); file != fs::directory_iterator(); ++file) {
+        string name = file->path().filename().string();
+
+        if (name.compare(0, strlen(kWorkErrorPrefix), kWorkErrorPrefix) != 0 || file->path().extension() == ".tmp")
+            continue;
+
+        ifstream in(file->path().string());
+        string message;
+        getline(in, message);
+
+        throw runtime_error("Distributed training failed in " + name.substr(strlen(kWorkErrorPrefix)) + ": " +
+                            message);
+    }
+}
+
+static void WaitFor(const string &dir, const string &name) {
+    const string path = GetWorkPath(dir, name);
+
+    while (!fs::exists(path)) {
+        CheckErrors(dir);
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+}
+
+static void StoreTable(const string &path, const BuilderModel *model, bool storeCounts = false) {
+    model->Store(path + ".tmp", storeCounts);
+    Publish(path + ".tmp", path);
+}
+
+/*
+ * Publishes the header of the table of an iteration: the diagonal tension of every direction and whether it is
+ * still trained, that is if its table is published too.
+ */
+static void PublishTableHeader(const string &path, const double tensions[2], const bool active[2]) {
+    ofstream out(path + ".tmp", ios::binary | ios::out);
+    for (size_t direction = 0; direction < 2; ++direction) {
+        io_write(out, tensions[direction]);
+        io_write(out, (uint8_t) (active[direction] ? 1 : 0));
+    }
+    out.close();
+
+    Publish(path + ".tmp", path);
+}
+
+void Builder::ReportError(const string &workDir, const string &process, const string &message) {
+    try {
+        string path = GetWorkPath(workDir, kWorkErrorPrefix + process);
+        if (fs::exists(path))
+            return;  // the first error of a process is the most relevant
+
+        fs::create_directories(workDir);
+        ofstream out(path + ".tmp");
+        out << message << endl;
+        out.close();
+
+        Publish(path + ".tmp", path);
+    } catch (...) {
+        // best effort: the process is failing anyway
+    }
+}
+
+void Builder::TrainDistributed(const Vocabulary &vocab, Model *forward, Model *backward) {
+    BuilderModel *models[2] = {(BuilderModel *) forward, (BuilderModel *) backward};
+    const char *suffixes[2] = {".fwd", ".bwd"};
+
+    if (fs::exists(work_dir) && !fs::is_empty(work_dir))
+        throw runtime_error("Work directory is not empty: " + work_dir);
+    fs::create_directories(work_dir);
+
+    try {
+        string vocabulary_path = GetWorkPath(work_dir, "vocabulary");
+        {
+            ofstream out(vocabulary_path + ".tmp", ios::binary | ios::out);
+            vocab.Store(out);
+            if (!out)
+                throw runtime_error("Error writing vocabulary file: " + vocabulary_path);
+        }
+        Publish(vocabulary_path + ".tmp", vocabulary_path);
+
+        for (size_t direction = 0; direction < 2; ++direction)
+            models[direction]->offsets.assign(1, 0);
+
+        if (listener) listener->Begin(true);
+
+        bool active[2] = {true, true};
+        double previous[2] = {0.0, 0.0};
+
+        int iter = 0;
+        for (; iter < iterations && (active[0] || active[1]); ++iter) {
+            if (listener) listener->IterationBegin(true, iter + 1);
+
+            // The first iteration needs no table: workers initialize their own ones
+            string table_path = GetWorkPath(work_dir, GetTableName(iter + 1));
+            if (iter > 0) {
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    if (active[direction])
+                        StoreTable(table_path + suffixes[direction], models[direction]);
+                }
+
+                double tensions[2] = {forward->diagonal_tension, backward->diagonal_tension};
+                PublishTableHeader(table_path, tensions, active);
+            }
+
+            double emp_feat[2] = {0.0, 0.0};
+            double log_likelihood[2] = {0.0, 0.0};
+
+            if (listener) listener->Begin(true, kBuilderStepAligning, iter + 1);
+            for (size_t worker = 0; worker < workers; ++worker) {
+                string counts_path = GetWorkPath(work_dir, GetCountsName(iter + 1, worker));
+                WaitFor(work_dir, GetCountsName(iter + 1, worker));
+
+                ifstream in(counts_path, ios::binary | ios::in);
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    emp_feat[direction] += io_read<double>(in);
+                    log_likelihood[direction] += io_read<double>(in);
+                }
+
+                // Corpus statistics are sent only once; length pairs keep the order they are first seen
+                if (iter == 0) {
+                    for (size_t direction = 0; direction < 2; ++direction) {
+                        BuilderModel *model = models[direction];
+                        model->n_target_tokens += io_read<double>(in);
+
+                        unordered_map<pair<length_t, length_t>, size_t, LengthPairHash> index;
+                        for (size_t i = 0; i < model->size_counts.size(); ++i)
+                            index[model->size_counts[i].first] = i;
+
+                        auto size = (size_t) io_read<uint64_t>(in);
+                        for (size_t i = 0; i < size; ++i) {
+                            pair<length_t, length_t> lengths;
+                            lengths.first = io_read<length_t>(in);
+                            lengths.second = io_read<length_t>(in);
+                            auto count = (size_t) io_read<uint64_t>(in);
+
+                            auto entry = index.find(lengths);
+                            if (entry == index.end()) {
+                                index[lengths] = model->size_counts.size();
+                                model->size_counts.emplace_back(lengths, count);
+                            } else {
+                                model->size_counts[entry->second].second += count;
+                            }
+                        }
+                    }
+                }
+
+                if (!in)
+                    throw runtime_error("Truncated counts file: " + counts_path);
+                in.close();
+
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    if (!active[direction])
+                        continue;
+
+                    BuilderModel *model = models[direction];
+                    string path = counts_path + suffixes[direction];
+
+                    BuilderModel partial(model->is_reverse, use_null, favor_diagonal, prob_align_null,
+                                         initial_diagonal_tension);
+                    partial.Load(path);
+                    model->AddCounts(partial);
+
+                    fs::remove(path);
+                }
+
+                fs::remove(counts_path);
+            }
+            if (listener) listener->End(true, kBuilderStepAligning, iter + 1);
+
+            // All the workers have read the table by now
+            if (iter > 0) {
+                for (size_t direction = 0; direction < 2; ++direction)
+                    fs::remove(table_path + suffixes[direction]);
+                fs::remove(table_path);
+            }
+
+            Maximize(forward, backward, active, emp_feat, iter + 1);
+            CheckConvergence(forward, backward, iter + 1, log_likelihood, previous, active);
+
+            if (listener) listener->IterationEnd(true, iter + 1);
+        }
+
+        // Training converged before the last iteration: a table with no active directions stops the workers,
+        // that acknowledge it with empty counts before the work directory is removed
+        if (iter < iterations) {
+            double tensions[2] = {forward->diagonal_tension, backward->diagonal_tension};
+            PublishTableHeader(GetWorkPath(work_dir, GetTableName(iter + 1)), tensions, active);
+
+            for (size_t worker = 0; worker < workers; ++worker)
+                WaitFor(work_dir, GetCountsName(iter + 1, worker));
+        }
+
+        Prune(forward, backward);
+
+        if (listener) listener->End(true);
+    } catch (exception &e) {
+        ReportError(work_dir, "coordinator", e.what());
+        throw;
+    }
+
+    fs::remove_all(work_dir);
+}
+
+void Builder::Work(const vector<Corpus> &corpora, size_t worker) {
+    if (workers == 0)
+        throw invalid_argument("Parameter 'workers' is required by distributed training");
+    if (worker >= workers)
+        throw invalid_argument("Invalid worker " + to_string(worker) + ", workers are " + to_string(workers));
+
+    const char *suffixes[2] = {".fwd", ".bwd"};
+
+    try {
+        WaitFor(work_dir, "vocabulary");
+
+        ifstream vocabulary_in(GetWorkPath(work_dir, "vocabulary"), ios::binary | ios::in);
+        Vocabulary vocab(vocabulary_in);
+        vocabulary_in.close();
+
+        vector<Corpus> shard;
+        for (size_t i = worker; i < corpora.size(); i += workers)
+            shard.push_back(corpora[i]);
+
+        EncodedCorpus corpus(shard, vocab);
+
+        BuilderModel forward(false, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+        BuilderModel backward(true, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+        BuilderModel *models[2] = {&forward, &backward};
+
+        if (!initial_model.empty())
+            WarmStart(vocab, &forward, &backward);
+
+        InitialPass(corpus, GetWorkPath(work_dir, "worker." + to_string(worker)), &forward, &backward);
+
+        initial_table.reset();
+        vector<word_t>().swap(initial_mapping);
+
+        bool active[2] = {true, true};
+
+        for (int iter = 0; iter < iterations; ++iter) {
+            string counts_path = GetWorkPath(work_dir, GetCountsName(iter + 1, worker));
+
+            if (iter > 0) {
+                string table_path = GetWorkPath(work_dir, GetTableName(iter + 1));
+                WaitFor(work_dir, GetTableName(iter + 1));
+
+                ifstream in(table_path, ios::binary | ios::in);
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    models[direction]->SetDiagonalTension(io_read<double>(in));
+                    active[direction] = io_read<uint8_t>(in) != 0;
+                }
+                if (!in)
+                    throw runtime_error("Truncated table file: " + table_path);
+
+                if (!active[0] && !active[1]) {
+                    ofstream(counts_path + ".tmp").close();
+                    Publish(counts_path + ".tmp", counts_path);
+                    break;
+                }
+
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    if (!active[direction])
+                        continue;
+
+                    BuilderModel table(models[direction]->is_reverse, use_null, favor_diagonal, prob_align_null,
+                                       initial_diagonal_tension);
+                    table.Load(table_path + suffixes[direction]);
+                    models[direction]->CopyProbabilities(table);
+                }
+            }
+
+            double emp_feat[2] = {0.0, 0.0};
+            double log_likelihood[2] = {0.0, 0.0};
+            Align(corpus, &forward, &backward, active, emp_feat, log_likelihood);
+
+            // Align() flushes the counts after every batch; they are reset by the next CopyProbabilities()
+            for (size_t direction = 0; direction < 2; ++direction) {
+                if (active[direction])
+                    StoreTable(counts_path + suffixes[direction], models[direction], true);
+            }
+
+            ofstream out(counts_path + ".tmp", ios::binary | ios::out);
+            for (size_t direction = 0; direction < 2; ++direction) {
+                io_write(out, emp_feat[direction]);
+                io_write(out, log_likelihood[direction]);
+            }
+
+            if (iter == 0) {
+                for (size_t direction = 0; direction < 2; ++direction) {
+                    BuilderModel *model = models[direction];
+
+                    io_write(out, model->n_target_tokens);
+                    io_write(out, (uint64_t) model->size_counts.size());
+                    for (auto p = model->size_counts.begin(); p != model->size_counts.end(); ++p) {
+                        io_write(out, p->first.first);
+                        io_write(out, p->first.second);
+                        io_write(out, (uint64_t) p->second);
+                    }
+                }
+            }
+
+            out.close();
+            if (!out)
+                throw runtime_error("Error writing counts file: " + counts_path);
+
+            Publish(counts_path + ".tmp", counts_path);
+        }
+    } catch (exception &e) {
+        ReportError(work_dir, "worker" + to_string(worker), e.what());
+        throw;
+    }
+}
+
+// Number of cells read at a time from a file of transposed cells
+static const size_t kCellBlockSize = (size_t) 1 << 16;
+
+/*
+ * Sequential source of the rows of a table to merge, starting from row 0: Read() returns the cells of the next row,
+ * sorted by column, and Rewind() restarts from the first row.
+ */
+class TableRows {
+public:
+    virtual ~TableRows() = default;
+
+    virtual size_t Rows() const = 0;
+
+    virtual void Rewind() = 0;
+
+    virtual void Read(vector<word_t> &outColumns, vector<float> &outProbs) = 0;
+};
+
+/*
+ * Rows of a table held in memory.
+ */
+class ModelRows : public TableRows {
+public:
+    explicit ModelRows(const BuilderModel &model) : model(model) {}
+
+    size_t Rows() const override {
+        return model.offsets.size() - 1;
+    }
+
+    void Rewind() override {
+        row = 0;
+    }
+
+    void Read(vector<word_t> &outColumns, vector<float> &outProbs) override {
+        const size_t begin = model.offsets[row];
+        const size_t end = model.offsets[row + 1];
+        ++row;
+
+        outColumns.assign(model.columns.begin() + begin, model.columns.begin() + end);
+        outProbs.assign(model.probs.begin() + begin, model.probs.begin() + end);
+    }
+
+private:
+    const BuilderModel &model;
+    size_t row = 0;
+};
+
+/*
+ * Rows stored with BuilderModel::Store() in a sequence of partition files of contiguous rows, starting from row 0.
+ * The files are read one at a time and only one row is held in memory: offsets, columns and probabilities of the
+ * current file are read sequentially by three streams, one for each section.
+ */
+class PartitionRows : public TableRows {
+public:
+    explicit PartitionRows(const vector<string> &paths) : paths(paths), rows(0) {
+        for (auto path = paths.begin(); path != paths.end(); ++path) {
+            ifstream in(*path, ios::binary | ios::in);
+            if (!in.is_open())
+                throw runtime_error("Unable to open partition file: " + *path);
+
+            auto first_row = io_read<word_t>(in);
+            auto offsets_size = (size_t) io_read<uint64_t>(in);
+
+            if (!in || offsets_size == 0)
+                throw runtime_error("Truncated partition file: " + *path);
+            if (first_row != rows)
+                throw runtime_error("Partition file is not contiguous: " + *path);
+
+            rows += offsets_size - 1;
+        }
+    }
+
+    size_t Rows() const override {
+        return rows;
+    }
+
+    void Rewind() override {
+        next_file = 0;
+        file_rows = 0;
+        file_row = 0;
+    }
+
+    void Read(vector<word_t> &outColumns, vector<float> &outProbs) override {
+        while (file_row == file_rows)
+            Open();
+
+        auto end = io_read<size_t>(offsets_in);
+        if (!offsets_in || end < offset)
+            throw runtime_error("Invalid partition file: " + paths[next_file - 1]);
+
+        const size_t size = end - offset;
+        offset = end;
+        ++file_row;
+
+        outColumns.resize(size);
+        probs.resize(size);
+        columns_in.read((char *) outColumns.data(), size * sizeof(word_t));
+        probs_in.read((char *) probs.data(), size * sizeof(double));
+
+        if (!columns_in || !probs_in)
+            throw runtime_error("Truncated partition file: " + paths[next_file - 1]);
+
+        outProbs.assign(probs.begin(), probs.end());
+    }
+
+private:
+    const vector<string> paths;
+    size_t rows;
+
+    size_t next_file = 0;
+    size_t file_rows = 0;
+    size_t file_row = 0;
+    size_t offset = 0;
+    vector<double> probs;
+
+    ifstream offsets_in;
+    ifstream columns_in;
+    ifstream probs_in;
+
+    static void OpenAt(ifstream &in, const string &path, size_t position) {
+        in.close();
+        in.clear();
+        in.open(path, ios::binary | ios::in);
+        if (!in.is_open())
+            throw runtime_error("Unable to open partition file: " + path);
+
+        in.seekg(position);
+    }
+
+    void Open() {
+        if (next_file >= paths.size())
+            throw runtime_error("Reading past the last partition file");
+
+        const string &path = paths[next_file++];
+
+        OpenAt(offsets_in, path, 0);
+        io_read<word_t>(offsets_in);
+        auto offsets_size = (size_t) io_read<uint64_t>(offsets_in);
+        auto size = (size_t) io_read<uint64_t>(offsets_in);
+
+        // the first offset of the partition is always 0
+        offset = io_read<size_t>(offsets_in);
+        if (!offsets_in || offset != 0)
+            throw runtime_error("Invalid partition file: " + path);
+
+        const size_t columns_position = sizeof(word_t) + 2 * sizeof(uint64_t) + offsets_size * sizeof(size_t);
+        OpenAt(columns_in, path, columns_position);
+        OpenAt(probs_in, path, columns_position + size * sizeof(word_t));
+
+        file_rows = offsets_size - 1;
+        file_row = 0;
+    }
+};
+
+/*
+ * Rows of the backward table held in memory, transposed at once with a counting sort: the rows are source words.
+ */
+class TransposedModelRows : public TableRows {
+public:
+    TransposedModelRows(const BuilderModel &backward, size_t rows) : offsets(rows + 1, 0) {
+        for (auto source = backward.columns.begin(); source != backward.columns.end(); ++source) {
+            if (*source >= rows)
+                throw runtime_error("Backward model is not consistent with the forward model");
+            ++offsets[*source + 1];
+        }
+
+        for (size_t source = 0; source < rows; ++source)
+            offsets[source + 1] += offsets[source];
+
+        columns.resize(backward.columns.size());
+        probs.resize(backward.columns.size());
+
+        // backward rows are visited in ascending order, so every transposed row comes out sorted
+        vector<size_t> positions(offsets.begin(), offsets.end() - 1);
+        for (size_t target = 0; target + 1 < backward.offsets.size(); ++target) {
+            for (size_t cell = backward.offsets[target]; cell < backward.offsets[target + 1]; ++cell) {
+                size_t position = positions[backward.columns[cell]]++;
+                columns[position] = (word_t) target;
+                probs[position] = (float) backward.probs[cell];
+            }
+        }
+    }
+
+    size_t Rows() const override {
+        return offsets.size() - 1;
+    }
+
+    void Rewind() override {
+        row = 0;
+    }
+
+    void Read(vector<word_t> &outColumns, vector<float> &outProbs) override {
+        const size_t begin = offsets[row];
+        const size_t end = offsets[row + 1];
+        ++row;
+
+        outColumns.assign(columns.begin() + begin, columns.begin() + end);
+        outProbs.assign(probs.begin() + begin, probs.begin() + end);
+    }
+
+private:
+    vector<size_t> offsets;
+    vector<word_t> columns;
+    vector<float> probs;
+    size_t row = 0;
+};
+
+/*
+ * Cell of the transposed backward table: the backward table has a row for every target word.
+ */
+struct TransposedCell {
+    word_t source;
+    word_t target;
+    float probability;
+
+    inline bool operator<(const TransposedCell &other) const {
+        return source < other.source || (source == other.source && target < other.target);
+    }
+};
+
+/*
+ * Sequential reader of a file of transposed cells, written by WriteCells(), one block at a time.
+ */
+class CellReader {
+public:
+    CellReader(const string &path, size_t blockSize) : path(path), block(blockSize) {
+        Rewind();
+    }
+
+    /*
+     * Returns the next cell without consuming it, or nullptr at the end of the file.
+     */
+    const TransposedCell *Peek() {
+        if (ptr < end)
+            return ptr;
+        if (remaining == 0)
+            return nullptr;
+
+        size_t size = (size_t) std::min(remaining, (uint64_t) block.size());
+        in.read((char *) block.data(), size * sizeof(TransposedCell));
+        if (!in)
+            throw runtime_error("Truncated transposed table file: " + path);
+
+        remaining -= size;
+        ptr = block.data();
+        end = block.data() + size;
+
+        return ptr;
+    }
+
+    void Pop() {
+        ++ptr;
+    }
+
+    void Rewind() {
+        in.close();
+        in.clear();
+        in.open(path, ios::binary | ios::in);
+        if (!in.is_open())
+            throw runtime_error("Unable to open transposed table file: " + path);
+
+        remaining = io_read<uint64_t>(in);
+        ptr = end = nullptr;
+    }
+
+private:
+    const string path;
+    ifstream in;
+    vector<TransposedCell> block;
+    uint64_t remaining = 0;
+    const TransposedCell *ptr = nullptr;
+    const TransposedCell *end = nullptr;
+};
+
+static void WriteCells(const string &path, const vector<TransposedCell> &cells) {
+    ofstream out(path, ios::binary | ios::out);
+    if (!out.is_open())
+        throw runtime_error("Unable to create transposed table file: " + path);
+
+    io_write(out, (uint64_t) cells.size());
+    out.write((const char *) cells.data(), cells.size() * sizeof(TransposedCell));
+
+    if (!out)
+        throw runtime_error("Error writing transposed table file: " + path);
+}
+
+/*
+ * Transposes the stored backward table into the file "path", with its cells sorted by source word and then by
+ * target word. The cells are sorted in runs of at most "memory" bytes, spilled to disk and then merged, so that the
+ * table is read only once.
+ */
+static void TransposeRows(PartitionRows &backward, size_t rows, size_t memory, const string &path) {
+    const size_t capacity = std::max(memory / sizeof(TransposedCell), (size_t) 1);
+
+    vector<string> runs;
+    vector<TransposedCell> run;
+    vector<word_t> columns;
+    vector<float> probs;
+
+    backward.Rewind();
+    for (size_t target = 0; target < backward.Rows(); ++target) {
+        backward.Read(columns, probs);
+
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i] >= rows)
+                throw runtime_error("Backward model is not consistent with the forward model");
+
+            if (run.size() == capacity) {
+                std::sort(run.begin(), run.end());
+                runs.push_back(path + "." + to_string(runs.size()));
+                WriteCells(runs.back(), run);
+                run.clear();
+            }
+
+            run.push_back(TransposedCell{columns[i], (word_t) target, probs[i]});
+        }
+    }
+
+    std::sort(run.begin(), run.end());
+
+    if (runs.empty()) {
+        WriteCells(path, run);
+        return;
+    }
+
+    runs.push_back(path + "." + to_string(runs.size()));
+    WriteCells(runs.back(), run);
+    vector<TransposedCell>().swap(run);
+
+    // Merges the runs, with the memory shared by their read blocks and the output block
+    const size_t block_size = std::max((size_t) 1, std::min(kCellBlockSize, capacity / (runs.size() + 1)));
+
+    vector<unique_ptr<CellReader>> readers;
+    for (auto file = runs.begin(); file != runs.end(); ++file)
+        readers.emplace_back(new CellReader(*file, block_size));
+
+    typedef pair<pair<word_t, word_t>, size_t> HeapEntry;
+    vector<HeapEntry> heap;
+    for (size_t i = 0; i < readers.size(); ++i) {
+        const TransposedCell *cell = readers[i]->Peek();
+        if (cell)
+            heap.push_back(HeapEntry(make_pair(cell->source, cell->target), i));
+    }
+    std::make_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+
+    ofstream out(path, ios::binary | ios::out);
+    if (!out.is_open())
+        throw runtime_error("Unable to create transposed table file: " + path);
+
+    io_write(out, (uint64_t) 0);  // the number of cells is written at the end
+
+    uint64_t size = 0;
+    vector<TransposedCell> block;
+    block.reserve(block_size);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        HeapEntry &top = heap.back();
+        CellReader &reader = *readers[top.second];
+
+        block.push_back(*reader.Peek());
+        reader.Pop();
+
+        const TransposedCell *cell = reader.Peek();
+        if (cell) {
+            top.first = make_pair(cell->source, cell->target);
+            std::push_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        } else {
+            heap.pop_back();
+        }
+
+        if (block.size() == block_size || heap.empty()) {
+            out.write((const char *) block.data(), block.size() * sizeof(TransposedCell));
+            size += block.size();
+            block.clear();
+        }
+    }
+
+    out.seekp(0);
+    io_write(out, size);
+
+    if (!out)
+        throw runtime_error("Error writing transposed table file: " + path);
+
+    readers.clear();
+    for (auto file = runs.begin(); file != runs.end(); ++file)
+        remove(file->c_str());
+}
+
+/*
+ * Rows of the backward table transposed by TransposeRows(): the rows are source words.
+ */
+class TransposedFileRows : public TableRows {
+public:
+    TransposedFileRows(const string &path, size_t rows) : reader(path, kCellBlockSize), rows(rows) {}
+
+    size_t Rows() const override {
+        return rows;
+    }
+
+    void Rewind() override {
+        reader.Rewind();
+        row = 0;
+    }
+
+    void Read(vector<word_t> &outColumns, vector<float> &outProbs) override {
+        outColumns.clear();
+        outProbs.clear();
+
+        const TransposedCell *cell;
+        while ((cell = reader.Peek()) != nullptr && cell->source == row) {
+            outColumns.push_back(cell->target);
+            outProbs.push_back(cell->probability);
+            reader.Pop();
+        }
+
+        ++row;
+    }
+
+private:
+    CellReader reader;
+    const size_t rows;
+    size_t row = 0;
+};
+
+/*
+ * Rows of the final bidirectional table: every row is a merge-join of the sorted forward row and the sorted row
+ * of the transposed backward table, so that every pass over the rows reads each table once.
+ */
+class MergedRows : public TranslationTable::RowReader {
+public:
+    MergedRows(TableRows &forward, TableRows &backward) : forward(forward), backward(backward) {}
+
+    size_t Rows() const override {
+        return forward.Rows();
+    }
+
+    void Rewind() override {
+        forward.Rewind();
+        backward.Rewind();
+    }
+
+    void Read(TranslationTable::row_t &outRow) override {
+        forward.Read(forward_columns, forward_probs);
+        backward.Read(backward_columns, backward_probs);
+
+        size_t f = 0;
+        const size_t f_end = forward_columns.size();
+        size_t b = 0;
+        const size_t b_end = backward_columns.size();
+
+        outRow.clear();
+        outRow.reserve(f_end + b_end);
+
+        while (f < f_end || b < b_end) {
+            if (b == b_end || (f < f_end && forward_columns[f] < backward_columns[b])) {
+                outRow.emplace_back(forward_columns[f], pair<float, float>(forward_probs[f], kNullProbability));
+                ++f;
+            } else if (f == f_end || backward_columns[b] < forward_columns[f]) {
+                outRow.emplace_back(backward_columns[b], pair<float, float>(kNullProbability, backward_probs[b]));
+                ++b;
+            } else {
+                outRow.emplace_back(forward_columns[f], pair<float, float>(forward_probs[f], backward_probs[b]));
+                ++f;
+                ++b;
+            }
+        }
+    }
+
+private:
+    TableRows &forward;
+    TableRows &backward;
+
+    vector<word_t> forward_columns;
+    vector<float> forward_probs;
+    vector<word_t> backward_columns;
+    vector<float> backward_probs;
+};
+
+void Builder::MergeAndStore(const Vocabulary &vocab, const string &path, const string &tmpPath, size_t partitions,
+                            Model *_forward, Model *_backward) {
+    auto *forward = (BuilderModel *) _forward;
+    auto *backward = (BuilderModel *) _backward;
+
+    unique_ptr<TableRows> rows[2];
+    vector<string> paths;
+
+    if (partitions > 1) {
+        // Tables trained out of core: the forward rows are read from the partition files, while the backward
+        // table is transposed once with an external sort bounded by the training memory
+        vector<string> partition_paths[2];
+        for (size_t direction = 0; direction < 2; ++direction) {
+            for (size_t partition = 0; partition < partitions; ++partition)
+                partition_paths[direction].push_back(GetPartitionPath(tmpPath, direction, partition));
+        }
+
+        rows[0].reset(new PartitionRows(partition_paths[0]));
+        paths = partition_paths[0];
+
+        if (rows[0]->Rows() == 0)
+            throw runtime_error("The forward model is empty");
+
+        {
+            PartitionRows backward_rows(partition_paths[1]);
+            if (backward_rows.Rows() == 0)
+                throw runtime_error("The backward model is empty");
+
+            paths.push_back(tmpPath + ".bwd.transposed");
+            TransposeRows(backward_rows, rows[0]->Rows(), training_memory, paths.back());
+        }
+
+        for (auto p = partition_paths[1].begin(); p != partition_paths[1].end(); ++p)
+            remove(p->c_str());
+
+        rows[1].reset(new TransposedFileRows(paths.back(), rows[0]->Rows()));
+    } else {
+        // The backward table is released as soon as it is transposed
+        rows[0].reset(new ModelRows(*forward));
+
+        if (rows[0]->Rows() == 0)
+            throw runtime_error("The forward model is empty");
+        if (backward->offsets.size() <= 1)
+            throw runtime_error("The backward model is empty");
+
+        rows[1].reset(new TransposedModelRows(*backward, rows[0]->Rows()));
+        backward->Release();
+    }
+
+    MergedRows merged(*rows[0], *rows[1]);
+    BidirectionalModel::Store(path, vocab, use_null, favor_diagonal, prob_align_null,
+                              forward->diagonal_tension, backward->diagonal_tension, merged,
+                              TranslationTable::GetEncodingForBits(quantization_bits));
+
+    rows[0].reset();
+    rows[1].reset();
+    for (auto p = paths.begin(); p != paths.end(); ++p)
+        remove(p->c_str());
 }
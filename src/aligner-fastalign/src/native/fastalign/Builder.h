@@ -5,10 +5,13 @@
 #ifndef FASTALIGN_BUILDER_H
 #define FASTALIGN_BUILDER_H
 
+#include <memory>
 #include <string>
 #include <vector>
 #include "Model.h"
 #include "Corpus.h"
+#include "EncodedCorpus.h"
+#include "TranslationTable.h"
 #include "Vocabulary.h"
 
 namespace mmt {
@@ -16,7 +19,9 @@ namespace mmt {
 
         struct Options {
             bool case_sensitive = true;
-            int iterations = 5;
+            int iterations = 5; // maximum number of iterations if the convergence threshold is not 0
+            int min_iterations = 2;
+            double convergence_threshold = 0; // 0 always runs all the iterations, see Builder::Listener
             bool favor_diagonal = true;
             double prob_align_null = 0.08;
             double initial_diagonal_tension = 4.0;
@@ -29,6 +34,13 @@ namespace mmt {
             double vocabulary_threshold = 0.9999;
             double pruning_threshold = 1.e-20;
             size_t max_line_length = 80;
+            int quantization_bits = 0; // 0 (no quantization), 8 or 16
+            std::string encoded_corpus_path; // if not empty, the encoded corpus is stored and mapped from this file
+            size_t cooccurrences_memory = (size_t) 1 << 30; // bytes; larger co-occurrence sets are sorted on disk
+            size_t training_memory = 0; // bytes, 0 is unlimited; larger tables are trained by partitions on disk
+            size_t workers = 0; // if not 0, training is distributed to this number of worker processes
+            std::string work_dir; // directory shared by the processes of a distributed training
+            std::string initial_model; // if not empty, training starts from the tables and tensions of this model
         };
 
         typedef int BuilderStep;
@@ -42,6 +54,26 @@ namespace mmt {
         class Builder {
         public:
 
+            /**
+             * Forward and backward models are trained together: steps shared by both directions (setup and
+             * aligning), as well as the whole training and its iterations, are notified once with forward = true;
+             * the other steps are notified once for every direction.
+             *
+             * When the tables exceed the training memory and they are trained by partitions, every partition
+             * is normalized as part of the aligning step and no normalizing step is notified.
+             *
+             * The normalizing step of the last iteration also prunes the tables: the pruning step is notified
+             * only for a direction that converged before the last iteration.
+             *
+             * In a distributed training the aligning step of every iteration waits for the counts of all the
+             * workers; the setup is done by the workers as part of the first aligning step and is not notified.
+             *
+             * At every iteration, the log-likelihood of the corpus computed by the aligning step (with the
+             * parameters of the previous iteration) is notified for every direction, with its perplexity per
+             * target token. A direction converges when the relative improvement of its log-likelihood falls
+             * below the convergence threshold, after at least the minimum number of iterations: it is notified
+             * with Converged() and it is not trained anymore, and training ends when both directions converged.
+             */
             class Listener {
             public:
                 virtual void BuildStart(const std::string &opts) = 0;
@@ -58,6 +90,10 @@ namespace mmt {
 
                 virtual void End(bool forward, BuilderStep step, int iteration) = 0;
 
+                virtual void LogLikelihood(bool forward, int iteration, double logLikelihood, double perplexity) {}
+
+                virtual void Converged(bool forward, int iteration) {}
+
                 virtual void IterationEnd(bool forward, int iteration) = 0;
 
                 virtual void End(bool forward) = 0;
@@ -71,12 +107,35 @@ namespace mmt {
 
             void setListener(Listener *listener);
 
+            /**
+             * Builds the model; if "workers" is not 0, this process is the coordinator of a distributed training
+             * and the workers must be started with Work(), on the same corpora, options and work directory.
+             *
+             * Distributed training runs one EM iteration at a time: the coordinator publishes the vocabulary and
+             * the translation tables in the work directory, every worker aligns its shard of the corpora and
+             * writes back its expected counts, that the coordinator sums and normalizes for the next iteration.
+             */
             void Build(const std::vector<Corpus> &corpora, const std::string &path);
 
+            /**
+             * Runs worker "worker" (from 0 to workers - 1) of a distributed training: it trains on the corpora
+             * with index i such that i % workers == worker.
+             */
+            void Work(const std::vector<Corpus> &corpora, size_t worker);
+
+            /**
+             * Makes all the processes of a distributed training fail with the given message, for example when
+             * a worker process crashed; "process" names the failed process.
+             */
+            static void ReportError(const std::string &workDir, const std::string &process,
+                                    const std::string &message);
+
         private:
             const bool case_sensitive;
             const double initial_diagonal_tension;
             const int iterations;
+            const int min_iterations;
+            const double convergence_threshold;
             const bool favor_diagonal;
             const double prob_align_null;
             const bool optimize_tension;
@@ -87,20 +146,48 @@ namespace mmt {
             double pruning;
             size_t max_length;
             double vocabulary_threshold;
+            const int quantization_bits;
+            const std::string encoded_corpus_path;
+            const size_t cooccurrences_memory;
+            const size_t training_memory;
+            const size_t workers;
+            const std::string work_dir;
+            const std::string initial_model;
             const int threads;
 
             Listener *listener;
 
-            void AllocateTTableSpace(Model *_model, const std::unordered_map<word_t, wordvec_t> &values,
-                                     word_t sourceWordMaxValue);
+            // Warm start: table of the initial model and id in the initial model of every word (see WarmStart())
+            std::shared_ptr<TranslationTable> initial_table;
+            std::vector<word_t> initial_mapping;
+
+            void WarmStart(const Vocabulary &vocab, Model *forward, Model *backward);
+
+            void InitializeProbabilities(Model *model);
+
+            size_t InitialPass(const EncodedCorpus &corpus, const std::string &tmpPath,
+                               Model *forward, Model *backward);
+
+            size_t Train(const EncodedCorpus &corpus, const std::string &tmpPath, Model *forward, Model *backward);
+
+            void Align(const EncodedCorpus &corpus, Model *forward, Model *backward, const bool active[2],
+                       double outEmpFeat[2], double outLogLikelihood[2]);
+
+            void Maximize(Model *forward, Model *backward, const bool active[2], const double emp_feat[2],
+                          int iteration);
+
+            void CheckConvergence(Model *forward, Model *backward, int iteration, const double log_likelihood[2],
+                                  double previous[2], bool active[2]);
+
+            void Prune(Model *forward, Model *backward);
 
-            void InitialPass(const Vocabulary &vocab, Model *model, const std::vector<Corpus> &corpora,
-                             double *n_target_tokens,
-                             std::vector<std::pair<std::pair<length_t, length_t>, size_t>> *size_counts);
+            void TrainPartitions(const EncodedCorpus &corpus, const std::string &tmpPath, size_t partitions,
+                                 Model *forward, Model *backward);
 
-            Model *BuildModel(const Vocabulary &vocab, const std::vector<Corpus> &corpora, bool forward);
+            void TrainDistributed(const Vocabulary &vocab, Model *forward, Model *backward);
 
-            void MergeAndStore(std::ostream &out, const std::string &fwd_path, const std::string &bwd_path);
+            void MergeAndStore(const Vocabulary &vocab, const std::string &path, const std::string &tmpPath,
+                               size_t partitions, Model *forward, Model *backward);
         };
     }
 }
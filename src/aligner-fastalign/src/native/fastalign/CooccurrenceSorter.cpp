@@ -0,0 +1,216 @@
+#include "CooccurrenceSorter.h"
+#include "ioutils.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+typedef pair<CooccurrenceSorter::key_t, size_t> HeapEntry;
+
+static const size_t kRadixSortThreshold = 256;
+static const size_t kMinBufferSize = 1 << 16;
+static const size_t kReadBlockSize = 1 << 16;
+
+CooccurrenceSorter::CooccurrenceSorter(size_t memoryBudget, const string &spillPath)
+        : memoryBudget(memoryBudget), spillPath(spillPath), runsSize(0), filesSize(0) {
+}
+
+CooccurrenceSorter::~CooccurrenceSorter() {
+    for (auto file = files.begin(); file != files.end(); ++file)
+        remove(file->c_str());
+}
+
+void CooccurrenceSorter::Sort(vector<key_t> &keys, vector<key_t> &buffer) {
+    const size_t size = keys.size();
+
+    if (size < kRadixSortThreshold) {
+        std::sort(keys.begin(), keys.end());
+        return;
+    }
+
+    // word ids rarely use all their bits: compute all the histograms at once and skip the constant bytes
+    vector<size_t> histograms(8 * 256, 0);
+    for (auto key = keys.begin(); key != keys.end(); ++key) {
+        key_t value = *key;
+        for (size_t byte = 0; byte < 8; ++byte)
+            ++histograms[byte * 256 + ((value >> (byte * 8)) & 0xff)];
+    }
+
+    buffer.resize(size);
+    key_t *src = keys.data();
+    key_t *dst = buffer.data();
+
+    for (size_t byte = 0; byte < 8; ++byte) {
+        size_t *histogram = histograms.data() + byte * 256;
+        const size_t shift = byte * 8;
+
+        if (histogram[(src[0] >> shift) & 0xff] == size)
+            continue;
+
+        size_t offset = 0;
+        for (size_t digit = 0; digit < 256; ++digit) {
+            size_t count = histogram[digit];
+            histogram[digit] = offset;
+            offset += count;
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            key_t value = src[i];
+            dst[histogram[(value >> shift) & 0xff]++] = value;
+        }
+
+        std::swap(src, dst);
+    }
+
+    if (src != keys.data())
+        keys.swap(buffer);
+}
+
+void CooccurrenceSorter::Add(vector<key_t> &keys) {
+    vector<key_t> run;
+    run.swap(keys);
+
+    vector<key_t> buffer;
+    Sort(run, buffer);
+    run.erase(std::unique(run.begin(), run.end()), run.end());
+    run.shrink_to_fit();
+
+    lock_guard<std::mutex> lock(mutex);
+
+    runsSize += run.size();
+    runs.push_back(std::move(run));
+
+    if (runsSize * sizeof(key_t) > memoryBudget / 2)
+        Compact();
+}
+
+size_t CooccurrenceSorter::GetMaxSize() const {
+    lock_guard<std::mutex> lock(mutex);
+    return runsSize + filesSize;
+}
+
+size_t CooccurrenceSorter::GetBufferSize(size_t threads) const {
+    return std::max(kMinBufferSize, memoryBudget / sizeof(key_t) / (4 * std::max(threads, (size_t) 1)));
+}
+
+void CooccurrenceSorter::Compact() {
+    vector<key_t> merged(runsSize);
+
+    Reader reader(runs, vector<string>());
+    merged.resize(reader.Read(merged.data(), merged.size()));
+    merged.shrink_to_fit();
+
+    runs.clear();
+    runsSize = 0;
+
+    if (merged.size() * sizeof(key_t) > memoryBudget / 4) {
+        Spill(merged);
+    } else {
+        runsSize = merged.size();
+        runs.push_back(std::move(merged));
+    }
+}
+
+void CooccurrenceSorter::Spill(const vector<key_t> &run) {
+    string path = spillPath + "." + to_string(files.size());
+
+    ofstream out(path, ios::binary | ios::out);
+    if (!out.is_open())
+        throw runtime_error("Unable to create co-occurrences file: " + path);
+
+    io_write(out, (uint64_t) run.size());
+    out.write((const char *) run.data(), run.size() * sizeof(key_t));
+
+    if (!out)
+        throw runtime_error("Error writing co-occurrences file: " + path);
+
+    files.push_back(path);
+    filesSize += run.size();
+}
+
+CooccurrenceSorter::Reader::Reader(const CooccurrenceSorter &sorter) {
+    lock_guard<std::mutex> lock(sorter.mutex);
+    Open(sorter.runs, sorter.files);
+}
+
+CooccurrenceSorter::Reader::Reader(const vector<vector<key_t>> &runs, const vector<string> &files) {
+    Open(runs, files);
+}
+
+void CooccurrenceSorter::Reader::Open(const vector<vector<key_t>> &runs, const vector<string> &files) {
+    cursors.resize(runs.size() + files.size());
+
+    for (size_t i = 0; i < runs.size(); ++i) {
+        cursors[i].ptr = runs[i].data();
+        cursors[i].end = runs[i].data() + runs[i].size();
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        Cursor &cursor = cursors[runs.size() + i];
+
+        cursor.file.reset(new ifstream(files[i], ios::binary | ios::in));
+        if (!cursor.file->is_open())
+            throw runtime_error("Unable to open co-occurrences file: " + files[i]);
+
+        cursor.remaining = io_read<uint64_t>(*cursor.file);
+        cursor.block.resize((size_t) std::min(cursor.remaining, (uint64_t) kReadBlockSize));
+    }
+
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        if (cursors[i].IsValid())
+            heap.push_back(HeapEntry(*cursors[i].ptr, i));
+    }
+
+    std::make_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+}
+
+bool CooccurrenceSorter::Reader::Cursor::IsValid() {
+    if (ptr < end)
+        return true;
+
+    if (!file || remaining == 0)
+        return false;
+
+    size_t size = (size_t) std::min(remaining, (uint64_t) block.size());
+    file->read((char *) block.data(), size * sizeof(key_t));
+    if (!*file)
+        throw runtime_error("Truncated co-occurrences file");
+
+    remaining -= size;
+    ptr = block.data();
+    end = block.data() + size;
+
+    return true;
+}
+
+size_t CooccurrenceSorter::Reader::Read(key_t *outKeys, size_t size) {
+    size_t count = 0;
+
+    while (count < size && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        HeapEntry &top = heap.back();
+
+        key_t key = top.first;
+        Cursor &cursor = cursors[top.second];
+
+        ++cursor.ptr;
+        if (cursor.IsValid()) {
+            top.first = *cursor.ptr;
+            std::push_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        } else {
+            heap.pop_back();
+        }
+
+        if (!hasLast || key != last) {
+            outKeys[count++] = key;
+            last = key;
+            hasLast = true;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,123 @@
+#ifndef MMT_FASTALIGN_COOCCURRENCESORTER_H
+#define MMT_FASTALIGN_COOCCURRENCESORTER_H
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Collects the distinct (source, target) co-occurrences of a corpus as packed 64-bit keys
+         * (source << 32 | target), so that they come out sorted by source and then by target.
+         *
+         * Threads fill their own key buffers and hand them to Add(), which radix-sorts and deduplicates them
+         * into a sorted run. When runs exceed half of the memory budget they are merged together and, if the
+         * result is still too large, the merged run is spilled to disk. Reader merges all the runs, in memory
+         * and on disk, returning every distinct key once.
+         */
+        class CooccurrenceSorter {
+        public:
+            typedef uint64_t key_t;
+
+            static inline key_t MakeKey(word_t source, word_t target) {
+                return ((key_t) source << 32) | target;
+            }
+
+            static inline word_t GetSource(key_t key) {
+                return (word_t) (key >> 32);
+            }
+
+            static inline word_t GetTarget(key_t key) {
+                return (word_t) key;
+            }
+
+            /**
+             * Spilled runs are stored in temporary files named after "spillPath", removed on destruction.
+             */
+            CooccurrenceSorter(size_t memoryBudget, const std::string &spillPath);
+
+            CooccurrenceSorter(const CooccurrenceSorter &) = delete;
+
+            CooccurrenceSorter &operator=(const CooccurrenceSorter &) = delete;
+
+            ~CooccurrenceSorter();
+
+            /**
+             * Sorts, deduplicates and collects the given keys; "keys" is left empty. Thread-safe.
+             */
+            void Add(std::vector<key_t> &keys);
+
+            /**
+             * Returns an upper bound of the number of distinct keys collected so far.
+             */
+            size_t GetMaxSize() const;
+
+            /**
+             * Number of keys a thread should buffer before calling Add(), given the number of threads.
+             */
+            size_t GetBufferSize(size_t threads) const;
+
+            /**
+             * Sorts keys in place with an LSD radix sort; passes on bytes equal in all keys are skipped.
+             */
+            static void Sort(std::vector<key_t> &keys, std::vector<key_t> &buffer);
+
+            /**
+             * Merges sorted runs, returning every distinct key once in ascending order.
+             */
+            class Reader {
+            public:
+                explicit Reader(const CooccurrenceSorter &sorter);
+
+                Reader(const std::vector<std::vector<key_t>> &runs, const std::vector<std::string> &files);
+
+                /**
+                 * Reads up to "size" keys, returns the number of keys read (0 at the end).
+                 */
+                size_t Read(key_t *outKeys, size_t size);
+
+            private:
+                struct Cursor {
+                    const key_t *ptr = nullptr;
+                    const key_t *end = nullptr;
+
+                    // spilled runs are read one block at a time
+                    std::unique_ptr<std::ifstream> file;
+                    std::vector<key_t> block;
+                    uint64_t remaining = 0;
+
+                    bool IsValid();
+                };
+
+                std::vector<Cursor> cursors;
+                std::vector<std::pair<key_t, size_t>> heap;
+                bool hasLast = false;
+                key_t last = 0;
+
+                void Open(const std::vector<std::vector<key_t>> &runs, const std::vector<std::string> &files);
+            };
+
+        private:
+            const size_t memoryBudget;
+            const std::string spillPath;
+
+            mutable std::mutex mutex;
+            std::vector<std::vector<key_t>> runs;
+            size_t runsSize;
+            std::vector<std::string> files;
+            size_t filesSize;
+
+            void Compact();
+
+            void Spill(const std::vector<key_t> &run);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_COOCCURRENCESORTER_H
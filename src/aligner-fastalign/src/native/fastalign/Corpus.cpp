@@ -7,6 +7,7 @@
 
 #include "Corpus.h"
 #include "Vocabulary.h"
+#include "ThreadPool.h"
 #include <boost/filesystem.hpp>
 
 
@@ -65,9 +66,9 @@ static inline void ParseLine(const Vocabulary *vocab, const string &line, wordve
 }
 
 CorpusReader::CorpusReader(const Corpus &corpus, const Vocabulary *vocabulary,
-                           const size_t maxLineLength, const bool skipEmptyLines)
+                           const size_t maxLineLength, const bool skipEmptyLines, const size_t concurrency)
         : drained(false), vocabulary(vocabulary), source(corpus.sourceFile.c_str()), target(corpus.targetFile.c_str()),
-          maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines) {
+          maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines), concurrency(concurrency) {
 }
 
 bool CorpusReader::Read(sentence_t &outSource, sentence_t &outTarget) {
@@ -91,30 +92,36 @@ bool CorpusReader::Read(sentence_t &outSource, sentence_t &outTarget) {
     }
 }
 
-bool CorpusReader::Read(vector<pair<sentence_t, sentence_t>> &outBuffer, size_t limit) {
-    if (drained)
-        return false;
+bool CorpusReader::ReadLines(vector<pair<string, string>> &outBuffer, size_t limit) {
+    outBuffer.resize(limit);
 
-    vector<pair<string, string>> batch;
-    for (size_t i = 0; i < limit; ++i) {
-        string sourceLine, targetLine;
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
+    size_t size = 0;
+    while (!drained && size < limit) {
+        if (!getline(source, outBuffer[size].first) || !getline(target, outBuffer[size].second)) {
             drained = true;
             break;
         }
 
-        batch.push_back(pair<string, string>(sourceLine, targetLine));
+        ++size;
     }
 
-    if (batch.empty())
+    outBuffer.resize(size);
+    return size > 0;
+}
+
+bool CorpusReader::Read(vector<pair<sentence_t, sentence_t>> &outBuffer, size_t limit) {
+    if (drained)
+        return false;
+
+    vector<pair<string, string>> batch;
+    if (!ReadLines(batch, limit))
         return false;
 
     outBuffer.resize(batch.size());
-#pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < batch.size(); ++i) {
+    ThreadPool::Shared().ParallelFor(batch.size(), concurrency, [&](size_t i, size_t worker) {
         ParseLine(batch[i].first, outBuffer[i].first);
         ParseLine(batch[i].second, outBuffer[i].second);
-    }
+    });
 
     if (skipEmptyLines || maxLineLength > 0) {
         for (auto sentence = outBuffer.begin(); sentence != outBuffer.end(); /* no increment */) {
@@ -154,25 +161,14 @@ bool CorpusReader::Read(std::vector<std::pair<wordvec_t, wordvec_t>> &outBuffer,
         return false;
 
     vector<pair<string, string>> batch;
-    for (size_t i = 0; i < limit; ++i) {
-        string sourceLine, targetLine;
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
-            drained = true;
-            break;
-        }
-
-        batch.push_back(pair<string, string>(sourceLine, targetLine));
-    }
-
-    if (batch.empty())
+    if (!ReadLines(batch, limit))
         return false;
 
     outBuffer.resize(batch.size());
-#pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < batch.size(); ++i) {
+    ThreadPool::Shared().ParallelFor(batch.size(), concurrency, [&](size_t i, size_t worker) {
         ParseLine(vocabulary, batch[i].first, outBuffer[i].first);
         ParseLine(vocabulary, batch[i].second, outBuffer[i].second);
-    }
+    });
 
     if (skipEmptyLines || maxLineLength > 0) {
         for (auto sentence = outBuffer.begin(); sentence != outBuffer.end(); /* no increment */) {
@@ -37,11 +37,23 @@ namespace mmt {
 
         class CorpusReader {
         public:
+            /**
+             * Batches are parsed by at most "concurrency" workers of the shared ThreadPool (0 is all of them).
+             */
             explicit CorpusReader(const Corpus &corpus, const Vocabulary *vocabulary = nullptr,
-                                  size_t maxLineLength = 0, bool skipEmptyLines = false);
+                                  size_t maxLineLength = 0, bool skipEmptyLines = false, size_t concurrency = 0);
+
+            /**
+             * Reads up to "limit" pairs of lines as they are, neither parsed nor filtered; the strings of
+             * "outBuffer" are reused.
+             */
+            bool ReadLines(std::vector<std::pair<std::string, std::string>> &outBuffer, size_t limit);
 
             bool Read(sentence_t &outSource, sentence_t &outTarget);
 
+            /**
+             * Reads up to "limit" pairs of lines, parsed in parallel by the shared ThreadPool.
+             */
             bool Read(std::vector<std::pair<sentence_t, sentence_t>> &outBuffer, size_t limit);
 
             bool Read(wordvec_t &outSource, wordvec_t &outTarget);
@@ -57,6 +69,7 @@ namespace mmt {
 
             const size_t maxLineLength;
             const bool skipEmptyLines;
+            const size_t concurrency;
 
             inline bool Skip(const sentence_t &source, const sentence_t &target) const {
                 if (skipEmptyLines && (source.empty() || target.empty()))
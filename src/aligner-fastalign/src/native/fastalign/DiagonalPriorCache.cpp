@@ -0,0 +1,113 @@
+#include "DiagonalPriorCache.h"
+#include "DiagonalAlignment.h"
+#include <limits>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+DiagonalPriorCache::DiagonalPriorCache(double prob_align_null, double diagonal_tension,
+                                       length_t max_length, size_t budget)
+        : prob_align_null(prob_align_null), max_length(max_length), budget(budget), tension(diagonal_tension),
+          priors(new atomic<double *>[slots()]), dlogz(new atomic<double>[slots()]), allocated(0) {
+    for (size_t i = 0; i < slots(); ++i) {
+        priors[i].store(nullptr);
+        dlogz[i].store(numeric_limits<double>::quiet_NaN());
+    }
+}
+
+DiagonalPriorCache::~DiagonalPriorCache() {
+    Clear();
+}
+
+void DiagonalPriorCache::Clear() {
+    for (size_t i = 0; i < slots(); ++i) {
+        delete[] priors[i].exchange(nullptr);
+        dlogz[i].store(numeric_limits<double>::quiet_NaN());
+    }
+
+    allocated.store(0);
+}
+
+void DiagonalPriorCache::SetTension(double _tension) {
+    if (tension == _tension)
+        return;
+
+    tension = _tension;
+    Clear();
+}
+
+void DiagonalPriorCache::ComputePrior(length_t m, length_t n, double prob_align_null, double tension,
+                                      double *output) {
+    for (length_t j = 0; j < m; ++j) {
+        double az = DiagonalAlignment::ComputeZ(j + 1, m, n, tension) / (1. - prob_align_null);
+
+        for (length_t i = 1; i <= n; ++i)
+            output[(size_t) j * n + i - 1] = DiagonalAlignment::UnnormalizedProb(j + 1, i, m, n, tension) / az;
+    }
+}
+
+void DiagonalPriorCache::GetPriorRow(length_t m, length_t n, length_t j, length_t lo, length_t hi,
+                                     double *output) const {
+    double az = DiagonalAlignment::ComputeZ(j + 1, m, n, tension) / (1. - prob_align_null);
+
+    for (length_t i = lo; i < hi; ++i)
+        output[i - lo] = DiagonalAlignment::UnnormalizedProb(j + 1, i + 1, m, n, tension) / az;
+}
+
+const double *DiagonalPriorCache::GetPrior(length_t m, length_t n, vector<double> &buffer) {
+    size_t size = (size_t) m * n;
+    size_t bytes = size * sizeof(double);
+
+    if (!IsCacheable(m, n)) {
+        buffer.resize(size);
+        ComputePrior(m, n, prob_align_null, tension, buffer.data());
+        return buffer.data();
+    }
+
+    atomic<double *> &entry = priors[slot(m, n)];
+
+    double *prior = entry.load(memory_order_acquire);
+    if (prior)
+        return prior;
+
+    if (allocated.fetch_add(bytes) + bytes > budget) {
+        allocated.fetch_sub(bytes);
+
+        buffer.resize(size);
+        ComputePrior(m, n, prob_align_null, tension, buffer.data());
+        return buffer.data();
+    }
+
+    prior = new double[size];
+    ComputePrior(m, n, prob_align_null, tension, prior);
+
+    double *expected = nullptr;
+    if (!entry.compare_exchange_strong(expected, prior, memory_order_acq_rel)) {
+        // another thread filled the entry first
+        delete[] prior;
+        allocated.fetch_sub(bytes);
+        return expected;
+    }
+
+    return prior;
+}
+
+double DiagonalPriorCache::GetDLogZ(length_t m, length_t n) {
+    atomic<double> *entry = (m <= max_length && n <= max_length) ? &dlogz[slot(m, n)] : nullptr;
+
+    if (entry) {
+        double value = entry->load(memory_order_relaxed);
+        if (value == value) // not NaN
+            return value;
+    }
+
+    double value = 0.0;
+    for (length_t j = 1; j <= m; ++j)
+        value += DiagonalAlignment::ComputeDLogZ(j, m, n, tension);
+
+    if (entry)
+        entry->store(value, memory_order_relaxed);
+
+    return value;
+}
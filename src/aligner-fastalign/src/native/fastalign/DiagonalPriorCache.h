@@ -0,0 +1,98 @@
+#ifndef MMT_FASTALIGN_DIAGONALPRIORCACHE_H
+#define MMT_FASTALIGN_DIAGONALPRIORCACHE_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Cache of the normalized diagonal alignment prior, keyed by sentence lengths (m = target, n = source).
+         *
+         * The prior of a (m, n) pair only depends on the diagonal tension, so it is computed once (exp() and pow()
+         * included) and then shared by all the sentences with the same lengths. Entries are created lazily and
+         * concurrently by the alignment threads; SetTension() invalidates the whole cache and it must not be
+         * called while other threads are reading it.
+         *
+         * Only pairs with both lengths up to "max_length" are cached, and only as long as the cache stays within
+         * its memory budget (bytes): all the other priors are computed on the fly in a caller-provided buffer.
+         * Training aligns the whole corpus many times with the same tensions and uses the default budget,
+         * loaded models use kServingMemoryBudget.
+         */
+        class DiagonalPriorCache {
+        public:
+            static const length_t kDefaultMaxLength = 256;
+            static const size_t kDefaultMemoryBudget = 128 * 1024 * 1024;
+            static const size_t kServingMemoryBudget = 16 * 1024 * 1024;
+
+            DiagonalPriorCache(double prob_align_null, double diagonal_tension,
+                               length_t max_length = kDefaultMaxLength, size_t budget = kDefaultMemoryBudget);
+
+            ~DiagonalPriorCache();
+
+            DiagonalPriorCache(const DiagonalPriorCache &) = delete;
+
+            DiagonalPriorCache &operator=(const DiagonalPriorCache &) = delete;
+
+            inline double GetTension() const {
+                return tension;
+            }
+
+            void SetTension(double tension);
+
+            /**
+             * Returns the (m x n) prior matrix: the element (j * n + i) is the probability of the target
+             * word j to be aligned to the source word i (both 0-based), already scaled by (1 - prob_align_null).
+             * If the matrix cannot be cached, it is computed in "buffer".
+             */
+            const double *GetPrior(length_t m, length_t n, std::vector<double> &buffer);
+
+            /**
+             * Returns true if the prior of the (m, n) pair can be cached.
+             */
+            inline bool IsCacheable(length_t m, length_t n) const {
+                return m <= max_length && n <= max_length;
+            }
+
+            /**
+             * Computes the elements [lo, hi) of row j of the (m x n) prior matrix in output[0, hi - lo), without
+             * caching them: banded alignments of long sentences only need a few elements of every row.
+             */
+            void GetPriorRow(length_t m, length_t n, length_t j, length_t lo, length_t hi, double *output) const;
+
+            /**
+             * Returns the sum of DiagonalAlignment::ComputeDLogZ(j, m, n) for j in [1, m], as used by the
+             * diagonal tension optimizer.
+             */
+            double GetDLogZ(length_t m, length_t n);
+
+        private:
+            const double prob_align_null;
+            const length_t max_length;
+            const size_t budget;
+            double tension;
+
+            std::unique_ptr<std::atomic<double *>[]> priors;
+            std::unique_ptr<std::atomic<double>[]> dlogz;
+            std::atomic<size_t> allocated;
+
+            inline size_t slot(length_t m, length_t n) const {
+                return (size_t) m * (max_length + 1) + n;
+            }
+
+            inline size_t slots() const {
+                return (size_t) (max_length + 1) * (max_length + 1);
+            }
+
+            void Clear();
+
+            static void ComputePrior(length_t m, length_t n, double prob_align_null, double tension, double *output);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_DIAGONALPRIORCACHE_H
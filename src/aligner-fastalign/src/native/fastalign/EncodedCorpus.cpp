@@ -0,0 +1,252 @@
+#include "EncodedCorpus.h"
+#include "Vocabulary.h"
+#include "ioutils.h"
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+// "FAENCCR1" in little-endian byte order
+static const uint64_t kEncodedCorpusMagic = 0x315243434E454146ULL;
+static const uint32_t kEncodedCorpusVersion = 1;
+
+static const size_t kEncodingBatchSize = 100000;
+static const size_t kSectionAlignment = 64;
+
+static inline size_t AlignOffset(size_t offset) {
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+static inline void WritePadding(ostream &out, size_t offset) {
+    static const char zeros[kSectionAlignment] = {0};
+
+    auto position = (size_t) out.tellp();
+    if (offset > position)
+        out.write(zeros, offset - position);
+}
+
+/*
+ * Returns the size of every section of a part and its total (aligned) size
+ */
+static size_t GetPartLayout(size_t lines, size_t sourceWords, size_t targetWords, size_t outSections[4]) {
+    outSections[0] = (lines + 1) * sizeof(uint64_t);
+    outSections[1] = (lines + 1) * sizeof(uint64_t);
+    outSections[2] = sourceWords * sizeof(word_t);
+    outSections[3] = targetWords * sizeof(word_t);
+
+    size_t size = 0;
+    for (size_t i = 0; i < 4; ++i)
+        size += AlignOffset(outSections[i]);
+    return size;
+}
+
+/*
+ * Returns true if the line offsets of a side start at 0, never decrease and end at the number of words of the side
+ */
+static bool IsValidOffsets(const uint64_t *offsets, size_t lines, size_t words) {
+    if (offsets[0] != 0 || offsets[lines] != words)
+        return false;
+
+    for (size_t i = 0; i < lines; ++i) {
+        if (offsets[i] > offsets[i + 1])
+            return false;
+    }
+
+    return true;
+}
+
+EncodedCorpus::EncodedCorpus(const vector<Corpus> &corpora, const Vocabulary &vocabulary, size_t concurrency)
+        : fingerprint(vocabulary.GetFingerprint()), parts(corpora.size()) {
+    vector<pair<wordvec_t, wordvec_t>> batch;
+
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        Part &part = parts[i];
+        part.name = corpora[i].GetName();
+
+        for (size_t side = 0; side < 2; ++side)
+            part.offsets_data[side].push_back(0);
+
+        CorpusReader reader(corpora[i], &vocabulary, 0, false, concurrency);
+        while (reader.Read(batch, kEncodingBatchSize)) {
+            for (auto line = batch.begin(); line != batch.end(); ++line) {
+                const wordvec_t *sides[2] = {&line->first, &line->second};
+
+                for (size_t side = 0; side < 2; ++side) {
+                    part.words_data[side].insert(part.words_data[side].end(), sides[side]->begin(),
+                                                 sides[side]->end());
+                    part.offsets_data[side].push_back(part.words_data[side].size());
+                }
+            }
+
+            part.lines += batch.size();
+            batch.clear();
+        }
+    }
+
+    // parts do not move anymore: pointers can now refer to their storage
+    for (auto part = parts.begin(); part != parts.end(); ++part) {
+        for (size_t side = 0; side < 2; ++side) {
+            part->words_data[side].shrink_to_fit();
+            part->offsets[side] = part->offsets_data[side].data();
+            part->words[side] = part->words_data[side].data();
+        }
+    }
+}
+
+EncodedCorpus::EncodedCorpus(const string &path) {
+    ifstream in(path, ios::binary | ios::in);
+    if (!in.is_open())
+        throw runtime_error("Unable to open encoded corpus file: " + path);
+
+    if (io_read<uint64_t>(in) != kEncodedCorpusMagic)
+        throw runtime_error("Invalid encoded corpus file: " + path);
+
+    auto version = io_read<uint32_t>(in);
+    if (version != kEncodedCorpusVersion)
+        throw runtime_error("Unsupported encoded corpus version: " + to_string(version));
+
+    fingerprint = io_read<uint64_t>(in);
+    parts.resize(io_read<uint32_t>(in));
+
+    vector<size_t> dataOffsets(parts.size());
+    vector<size_t> sizes[2];
+
+    for (size_t i = 0; i < parts.size(); ++i) {
+        io_read(in, parts[i].name);
+        parts[i].lines = io_read<uint64_t>(in);
+        sizes[0].push_back(io_read<uint64_t>(in));
+        sizes[1].push_back(io_read<uint64_t>(in));
+        dataOffsets[i] = io_read<uint64_t>(in);
+    }
+
+    if (!in)
+        throw runtime_error("Invalid encoded corpus file: " + path);
+
+    in.close();
+
+    file.reset(new MappedFile(path));
+
+    for (size_t i = 0; i < parts.size(); ++i) {
+        Part &part = parts[i];
+
+        // bound the descriptor values before computing the layout, so that it cannot overflow
+        size_t fileSize = file->GetSize();
+        if (dataOffsets[i] > fileSize || part.lines > fileSize || sizes[0][i] > fileSize || sizes[1][i] > fileSize)
+            throw runtime_error("Invalid encoded corpus file: " + path);
+
+        size_t sections[4];
+        size_t end = dataOffsets[i] + GetPartLayout(part.lines, sizes[0][i], sizes[1][i], sections);
+        if (end > fileSize)
+            throw runtime_error("Truncated encoded corpus file: " + path);
+
+        const char *data = file->GetData() + dataOffsets[i];
+        part.offsets[0] = (const uint64_t *) data;
+        data += AlignOffset(sections[0]);
+        part.offsets[1] = (const uint64_t *) data;
+        data += AlignOffset(sections[1]);
+        part.words[0] = (const word_t *) data;
+        data += AlignOffset(sections[2]);
+        part.words[1] = (const word_t *) data;
+
+        // the readers copy the words of every line without any further check
+        for (size_t side = 0; side < 2; ++side) {
+            if (!IsValidOffsets(part.offsets[side], part.lines, sizes[side][i]))
+                throw runtime_error("Invalid encoded corpus file: " + path + " (corrupted offsets of " +
+                                    part.name + ")");
+        }
+    }
+}
+
+void EncodedCorpus::Store(const string &path) const {
+    ofstream out(path, ios::binary | ios::out);
+    if (!out.is_open())
+        throw runtime_error("Unable to create encoded corpus file: " + path);
+
+    size_t headerSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    for (auto part = parts.begin(); part != parts.end(); ++part)
+        headerSize += sizeof(uint32_t) + part->name.size() + 4 * sizeof(uint64_t);
+
+    io_write(out, kEncodedCorpusMagic);
+    io_write(out, kEncodedCorpusVersion);
+    io_write(out, fingerprint);
+    io_write(out, (uint32_t) parts.size());
+
+    size_t sections[4];
+    size_t offset = AlignOffset(headerSize);
+
+    for (auto part = parts.begin(); part != parts.end(); ++part) {
+        uint64_t sourceWords = part->offsets[0][part->lines];
+        uint64_t targetWords = part->offsets[1][part->lines];
+
+        io_write(out, part->name);
+        io_write(out, (uint64_t) part->lines);
+        io_write(out, sourceWords);
+        io_write(out, targetWords);
+        io_write(out, (uint64_t) offset);
+
+        offset += GetPartLayout(part->lines, sourceWords, targetWords, sections);
+    }
+
+    for (auto part = parts.begin(); part != parts.end(); ++part) {
+        GetPartLayout(part->lines, part->offsets[0][part->lines], part->offsets[1][part->lines], sections);
+
+        const char *arrays[4] = {(const char *) part->offsets[0], (const char *) part->offsets[1],
+                                 (const char *) part->words[0], (const char *) part->words[1]};
+
+        for (size_t i = 0; i < 4; ++i) {
+            WritePadding(out, AlignOffset((size_t) out.tellp()));
+            out.write(arrays[i], sections[i]);
+        }
+    }
+
+    WritePadding(out, AlignOffset((size_t) out.tellp()));
+
+    if (!out)
+        throw runtime_error("Error writing encoded corpus file: " + path);
+}
+
+EncodedCorpusReader::EncodedCorpusReader(const EncodedCorpus &corpus, size_t part, size_t maxLineLength,
+                                         bool skipEmptyLines)
+        : part(corpus.parts.at(part)), line(0), maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines) {
+}
+
+bool EncodedCorpusReader::Read(wordvec_t &outSource, wordvec_t &outTarget) {
+    while (line < part.lines) {
+        const uint64_t *src = part.offsets[0] + line;
+        const uint64_t *trg = part.offsets[1] + line;
+        ++line;
+
+        if (Skip(src[1] - src[0], trg[1] - trg[0]))
+            continue;
+
+        outSource.assign(part.words[0] + src[0], part.words[0] + src[1]);
+        outTarget.assign(part.words[1] + trg[0], part.words[1] + trg[1]);
+        return true;
+    }
+
+    return false;
+}
+
+bool EncodedCorpusReader::Read(vector<pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit) {
+    outBuffer.clear();
+
+    // Like CorpusReader, "limit" counts the lines read, including the skipped ones
+    while (outBuffer.empty() && line < part.lines) {
+        size_t end = min(part.lines, line + limit);
+
+        for (; line < end; ++line) {
+            const uint64_t *src = part.offsets[0] + line;
+            const uint64_t *trg = part.offsets[1] + line;
+
+            if (Skip(src[1] - src[0], trg[1] - trg[0]))
+                continue;
+
+            outBuffer.emplace_back(wordvec_t(part.words[0] + src[0], part.words[0] + src[1]),
+                                   wordvec_t(part.words[1] + trg[0], part.words[1] + trg[1]));
+        }
+    }
+
+    return !outBuffer.empty();
+}
@@ -0,0 +1,115 @@
+#ifndef MMT_FASTALIGN_ENCODEDCORPUS_H
+#define MMT_FASTALIGN_ENCODEDCORPUS_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "alignment.h"
+#include "Corpus.h"
+#include "MappedFile.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        class Vocabulary;
+
+        /**
+         * A collection of parallel corpora encoded with a vocabulary: for every corpus (part) and for both sides,
+         * the word ids of all the lines in a single array plus the offset of every line.
+         *
+         * Text is parsed and looked up in the vocabulary only once, when the corpus is encoded; all the following
+         * passes just copy ids. An encoded corpus can be stored to disk and memory-mapped by other processes
+         * (i.e. fa_align and fa_score after fa_build): the file records a fingerprint of the vocabulary
+         * in order to detect corpora encoded with a different model.
+         *
+         * File layout: a header (magic, version, vocabulary fingerprint and the descriptor of every part),
+         * followed by the arrays of every part, each one aligned to 64 bytes:
+         *  - source offsets (uint64, lines + 1) and target offsets (uint64, lines + 1)
+         *  - source words (word_t) and target words (word_t)
+         */
+        class EncodedCorpus {
+            friend class EncodedCorpusReader;
+
+        public:
+            /**
+             * Encodes all the lines of the given corpora in memory, parsing them with at most "concurrency"
+             * workers of the shared ThreadPool (0 is all of them).
+             */
+            EncodedCorpus(const std::vector<Corpus> &corpora, const Vocabulary &vocabulary, size_t concurrency = 0);
+
+            /**
+             * Maps an encoded corpus file created with Store().
+             */
+            explicit EncodedCorpus(const std::string &path);
+
+            EncodedCorpus(const EncodedCorpus &) = delete;
+
+            EncodedCorpus &operator=(const EncodedCorpus &) = delete;
+
+            void Store(const std::string &path) const;
+
+            inline size_t Size() const {
+                return parts.size();
+            }
+
+            inline const std::string &GetName(size_t part) const {
+                return parts[part].name;
+            }
+
+            inline size_t GetLines(size_t part) const {
+                return parts[part].lines;
+            }
+
+            inline uint64_t GetVocabularyFingerprint() const {
+                return fingerprint;
+            }
+
+        private:
+            struct Part {
+                std::string name;
+                size_t lines = 0;
+
+                const uint64_t *offsets[2] = {nullptr, nullptr};
+                const word_t *words[2] = {nullptr, nullptr};
+
+                // storage of in-memory corpora
+                std::vector<uint64_t> offsets_data[2];
+                std::vector<word_t> words_data[2];
+            };
+
+            std::unique_ptr<MappedFile> file;
+            uint64_t fingerprint;
+            std::vector<Part> parts;
+        };
+
+        /**
+         * Reads the lines of a part of an EncodedCorpus, with the same filters of CorpusReader.
+         */
+        class EncodedCorpusReader {
+        public:
+            explicit EncodedCorpusReader(const EncodedCorpus &corpus, size_t part, size_t maxLineLength = 0,
+                                         bool skipEmptyLines = false);
+
+            bool Read(wordvec_t &outSource, wordvec_t &outTarget);
+
+            bool Read(std::vector<std::pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit);
+
+        private:
+            const EncodedCorpus::Part &part;
+            size_t line;
+
+            const size_t maxLineLength;
+            const bool skipEmptyLines;
+
+            inline bool Skip(size_t sourceLength, size_t targetLength) const {
+                if (skipEmptyLines && (sourceLength == 0 || targetLength == 0))
+                    return true;
+
+                return maxLineLength > 0 && (sourceLength > maxLineLength || targetLength > maxLineLength);
+            }
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_ENCODEDCORPUS_H
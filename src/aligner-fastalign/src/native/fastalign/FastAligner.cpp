@@ -5,12 +5,12 @@
 #include <symal/SymAlignment.h>
 #include "FastAligner.h"
 #include <thread>
+#include <cmath>
+#include <map>
+#include <unordered_map>
 #include <boost/filesystem.hpp>
 #include "BidirectionalModel.h"
-
-#ifdef _OPENMP
-#include <omp.h>
-#endif
+#include "AlignmentKernel.h"
 
 namespace fs = boost::filesystem;
 
@@ -18,21 +18,25 @@ using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
 
-FastAligner::FastAligner(const string &path, int threads) {
+FastAligner::FastAligner(const string &path, int threads, size_t denseRank) {
     fs::path model_path = fs::absolute(fs::path(path));
     if (!fs::is_regular(model_path))
         throw invalid_argument("file not found: " + model_path.string());
 
-    ifstream in(model_path.string(), ios::binary | ios::in);
-    vocabulary = Vocabulary(in);
-    BidirectionalModel::Open(in, &forwardModel, &backwardModel);
-    in.close();
+    BidirectionalModel::Open(model_path.string(), &vocabulary, &forwardModel, &backwardModel, denseRank);
+    trained_words = vocabulary.Size();
 
     this->threads = threads > 0 ? threads : (int) thread::hardware_concurrency();
-#ifdef _OPENMP
-    omp_set_dynamic(0);
-    omp_set_num_threads(this->threads);
-#endif
+
+    // the pool is shared by all the aligners of the process, "threads" only limits the workers of every batch
+    pool = &ThreadPool::Shared();
+
+    Model *models[2] = {forwardModel, backwardModel};
+    for (size_t direction = 0; direction < 2; ++direction) {
+        models[direction]->pool = pool;
+        models[direction]->concurrency = (size_t) this->threads;
+        models[direction]->utilization = &utilization;
+    }
 }
 
 FastAligner::~FastAligner() {
@@ -42,84 +46,220 @@ FastAligner::~FastAligner() {
 
 alignment_t FastAligner::GetAlignment(const sentence_t &_source, const sentence_t &_target,
                                       Symmetrization symmetrization) {
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+
     wordvec_t source, target;
     vocabulary.Encode(_source, source);
     vocabulary.Encode(_target, target);
 
-    return GetAlignment(source, target, symmetrization);
+    return Align(source, target, symmetrization);
 }
 
 alignment_t FastAligner::GetAlignment(const wordvec_t &source, const wordvec_t &target, Symmetrization symmetrization) {
-    alignment_t forward = forwardModel->ComputeAlignment(source, target, &vocabulary);
-    alignment_t backward = backwardModel->ComputeAlignment(source, target, &vocabulary);
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    return Align(source, target, symmetrization);
+}
 
-    SymAlignment symmetrizer(source.size(), target.size());
+void FastAligner::GetAlignments(const std::vector<std::pair<sentence_t, sentence_t>> &_batch,
+                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+
+    vector<pair<wordvec_t, wordvec_t>> batch;
+    batch.resize(_batch.size());
+
+    pool->ParallelFor(batch.size(), (size_t) threads, [&](size_t i, size_t worker) {
+        vocabulary.Encode(_batch[i].first, batch[i].first);
+        vocabulary.Encode(_batch[i].second, batch[i].second);
+    });
+
+    Align(batch, outAlignments, symmetrization);
+}
+
+void FastAligner::GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    Align(batch, outAlignments, symmetrization);
+}
 
+/*
+ * Symmetrizes the alignments of a sentence pair; "symal" must be reset to the lengths of the pair.
+ */
+static void Symmetrize(SymAlignment &symal, const alignment_t &forward, const alignment_t &backward,
+                       Symmetrization symmetrization) {
     switch (symmetrization) {
         case GrowDiagonalFinalAnd:
-            symmetrizer.Grow(forward, backward, true, true);
+            symal.Grow(forward, backward, true, true);
             break;
         case GrowDiagonal:
-            symmetrizer.Grow(forward, backward, true, false);
+            symal.Grow(forward, backward, true, false);
             break;
         case Intersection:
-            symmetrizer.Intersection(forward, backward);
+            symal.Intersection(forward, backward);
             break;
         case Union:
-            symmetrizer.Union(forward, backward);
+            symal.Union(forward, backward);
             break;
     }
+}
+
+alignment_t FastAligner::Align(const wordvec_t &source, const wordvec_t &target, Symmetrization symmetrization) {
+    alignment_t forward = forwardModel->ComputeAlignment(source, target, &vocabulary);
+    alignment_t backward = backwardModel->ComputeAlignment(source, target, &vocabulary);
+
+    SymAlignment symmetrizer(source.size(), target.size());
+    Symmetrize(symmetrizer, forward, backward, symmetrization);
 
     return symmetrizer.ToAlignment();
 }
 
-void FastAligner::GetAlignments(const std::vector<std::pair<sentence_t, sentence_t>> &_batch,
-                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
-    vector<pair<wordvec_t, wordvec_t>> batch;
-    batch.resize(_batch.size());
+/*
+ * Scratch buffers of a worker aligning a batch
+ */
+struct AlignmentScratch {
+    alignment_t forward;
+    alignment_t backward;
+    SymAlignment symal;
+};
 
-#pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < batch.size(); ++i) {
-        vocabulary.Encode(_batch[i].first, batch[i].first);
-        vocabulary.Encode(_batch[i].second, batch[i].second);
+void FastAligner::Align(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                        std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
+    outAlignments.resize(batch.size());
+
+    // Every worker aligns a sentence pair end to end: forward, backward and symmetrization
+    size_t workers = std::max(std::min((size_t) threads, pool->GetMaxConcurrency()), (size_t) 1);
+    vector<AlignmentScratch> scratches(workers);
+
+    vector<size_t> order;
+    if (workers > 1)
+        AlignmentKernel::GetCostOrder(batch, order);
+
+    pool->ParallelFor(batch.size(), workers, [&](size_t k, size_t worker) {
+        const size_t i = order.empty() ? k : order[k];
+        const wordvec_t &source = batch[i].first;
+        const wordvec_t &target = batch[i].second;
+        AlignmentScratch &scratch = scratches[worker];
+
+        scratch.forward.points.clear();
+        scratch.backward.points.clear();
+        forwardModel->ComputeAlignment(source, target, nullptr, &scratch.forward, &vocabulary);
+        backwardModel->ComputeAlignment(source, target, nullptr, &scratch.backward, &vocabulary);
+
+        scratch.symal.Reset(source.size(), target.size());
+        Symmetrize(scratch.symal, scratch.forward, scratch.backward, symmetrization);
+
+        outAlignments[i] = scratch.symal.ToAlignment();
+    }, &utilization);
+}
+
+/*
+ * Collects the expected counts of the E-step of a batch: the kernel calls IncrementProbability() concurrently,
+ * so every worker of the thread pool has its own counts.
+ */
+class ExpectedCounts final : public Model {
+public:
+    typedef map<word_t, vector<pair<word_t, double>>> rows_t;
+
+    ExpectedCounts(bool is_reverse, int threads)
+            : Model(is_reverse, false, false, 0., 0.), counts((size_t) std::max(threads, 1)) {
+    }
+
+    double GetProbability(word_t source, word_t target) override {
+        return kNullProbability;
+    }
+
+    void IncrementProbability(word_t source, word_t target, double amount) override {
+        counts[ThreadPool::GetWorker()][((uint64_t) source << 32) | target] += amount;
+    }
+
+    /*
+     * Returns the normalized distribution of the counts of every row, sorted by word.
+     */
+    void GetRows(rows_t &outRows) const {
+        for (auto thread_counts = counts.begin(); thread_counts != counts.end(); ++thread_counts) {
+            for (auto count = thread_counts->begin(); count != thread_counts->end(); ++count)
+                outRows[(word_t) (count->first >> 32)].emplace_back((word_t) count->first, count->second);
+        }
+
+        for (auto row = outRows.begin(); row != outRows.end(); ++row) {
+            vector<pair<word_t, double>> &cells = row->second;
+            std::sort(cells.begin(), cells.end());
+
+            // the same cell may have been incremented by different threads
+            size_t size = 0;
+            double total = 0;
+            for (size_t i = 0; i < cells.size(); ++i) {
+                if (size > 0 && cells[size - 1].first == cells[i].first)
+                    cells[size - 1].second += cells[i].second;
+                else
+                    cells[size++] = cells[i];
+
+                total += cells[i].second;
+            }
+
+            cells.resize(size);
+            for (auto cell = cells.begin(); cell != cells.end(); ++cell)
+                cell->second /= total;
+        }
     }
 
-    GetAlignments(batch, outAlignments, symmetrization);
+private:
+    vector<unordered_map<uint64_t, double>> counts;
+};
+
+void FastAligner::SetBandTolerance(double tolerance) {
+    if (tolerance < 0. || tolerance >= 1.)
+        throw invalid_argument("band tolerance must be in [0, 1)");
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    forwardModel->band_tolerance = tolerance;
+    backwardModel->band_tolerance = tolerance;
 }
 
-void FastAligner::GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
-                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
-    vector<alignment_t> forwards;
-    vector<alignment_t> backwards;
+void FastAligner::Update(const std::vector<std::pair<sentence_t, sentence_t>> &_batch, double decay, double offset) {
+    if (decay <= 0. || decay > 1.)
+        throw invalid_argument("update decay must be in (0, 1]");
+    if (offset <= 1.)
+        throw invalid_argument("update offset must be greater than 1");
 
-    forwardModel->ComputeAlignments(batch, forwards, &vocabulary);
-    backwardModel->ComputeAlignments(batch, backwards, &vocabulary);
+    // Only one update at a time: the model can change only while holding this lock
+    lock_guard<std::mutex> update_lock(update_mutex);
 
-    outAlignments.resize(batch.size());
+    vector<pair<wordvec_t, wordvec_t>> batch(_batch.size());
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
 
-    SymAlignment symal;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            for (auto word = _batch[i].first.begin(); word != _batch[i].first.end(); ++word)
+                batch[i].first.push_back(vocabulary.Add(*word));
+            for (auto word = _batch[i].second.begin(); word != _batch[i].second.end(); ++word)
+                batch[i].second.push_back(vocabulary.Add(*word));
+        }
+    }
 
-    for (size_t i = 0; i < batch.size(); ++i) {
-        symal.Reset(batch[i].first.size(), batch[i].second.size());
-
-        alignment_t &forward = forwards[i];
-        alignment_t &backward = backwards[i];
-
-        switch (symmetrization) {
-            case GrowDiagonalFinalAnd:
-                symal.Grow(forward, backward, true, true);
-                break;
-            case GrowDiagonal:
-                symal.Grow(forward, backward, true, false);
-                break;
-            case Intersection:
-                symal.Intersection(forward, backward);
-                break;
-            case Union:
-                symal.Union(forward, backward);
-                break;
+    ExpectedCounts::rows_t rows[2];
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+
+        Model *models[2] = {forwardModel, backwardModel};
+        for (size_t direction = 0; direction < 2; ++direction) {
+            ExpectedCounts counts(models[direction]->is_reverse, threads);
+            models[direction]->ComputeAlignments(batch, &counts, nullptr, nullptr);
+            counts.GetRows(rows[direction]);
         }
+    }
 
-        outAlignments[i] = symal.ToAlignment();
+    // Backward rows are target words, i.e. columns of the table
+    TranslationTable *table = ((BidirectionalModel *) forwardModel)->GetTable().get();
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+
+        for (unsigned direction = 0; direction < 2; ++direction) {
+            for (auto row = rows[direction].begin(); row != rows[direction].end(); ++row) {
+                double row_offset = row->first < trained_words ? offset : 2.;
+                double step = pow((double) table->GetUpdates(direction, row->first) + row_offset, -decay);
+
+                table->Update(direction, row->first, row->second, step);
+            }
+        }
     }
-}
\ No newline at end of file
+}
@@ -5,9 +5,12 @@
 #ifndef FASTALIGN_ALIGNER_H
 #define FASTALIGN_ALIGNER_H
 
+#include <mutex>
 #include <string>
+#include <boost/thread/shared_mutex.hpp>
 #include "Model.h"
 #include "Vocabulary.h"
+#include "ThreadPool.h"
 
 namespace mmt {
     namespace fastalign {
@@ -19,9 +22,24 @@ namespace mmt {
             Union = 4
         };
 
+        // Step size of the online updates, see FastAligner::Update()
+        const double kDefaultUpdateDecay = 0.7;
+        const double kDefaultUpdateOffset = 10.;
+
+        /**
+         * Aligns sentence pairs with a bidirectional model. All the methods are thread-safe: the model can be
+         * updated with Update() while other threads align.
+         *
+         * Batches are aligned by the process-wide ThreadPool: "threads" (default is the number of CPUs) is the
+         * maximum number of workers of every batch, not a number of threads owned by the aligner, so that
+         * many aligners can be loaded and used concurrently in the same process.
+         *
+         * The model file is memory-mapped and shared by all the processes that load it: only if "denseRank" is not
+         * 0 the aligner also copies the most frequent cells in a private dense block (see kDefaultDenseRank).
+         */
         class FastAligner {
         public:
-            explicit FastAligner(const std::string &path, int threads = 0);
+            explicit FastAligner(const std::string &path, int threads = 0, size_t denseRank = 0);
 
             alignment_t GetAlignment(const sentence_t &source, const sentence_t &target, Symmetrization symmetrization);
 
@@ -33,6 +51,40 @@ namespace mmt {
             void GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization);
 
+            /**
+             * Online stepwise-EM update with a batch of new sentence pairs: the expected counts of the batch are
+             * computed with the current model, and every row with counts (the translation probabilities of a
+             * word, in either direction) moves towards their normalized distribution with step
+             * (n + offset)^(-decay), where n is the number of previous updates of the row. The offset of the words
+             * of the model file is "offset", so that rows trained offline move slowly; the offset of the words
+             * added to the vocabulary by the updates is 2.
+             *
+             * Updates are kept in memory and they are not written to the model file. Decay must be in (0, 1]
+             * and offset must be greater than 1.
+             */
+            void Update(const std::vector<std::pair<sentence_t, sentence_t>> &batch,
+                        double decay = kDefaultUpdateDecay, double offset = kDefaultUpdateOffset);
+
+            /**
+             * Aligns only the source words close to the diagonal of every target word, leaving out at most
+             * "tolerance" of its prior mass: the band of a sentence grows with its length and it shrinks as the
+             * diagonal tension grows, see AlignmentKernel::GetBandWidth(). A tolerance of 0 (the default) aligns
+             * every target word with all the source words; Update() always uses all of them.
+             */
+            void SetBandTolerance(double tolerance);
+
+            /**
+             * Returns the fraction of time the workers of all the batches aligned so far were busy, see
+             * ThreadPool::Utilization; the longest sentences of a batch are aligned first, so that the workers
+             * finish together.
+             */
+            double GetBusyFraction() const {
+                return utilization.GetBusyFraction();
+            }
+
+            /**
+             * The vocabulary grows with Update(): reading it while another thread updates the model is not safe.
+             */
             const Vocabulary &GetVocabulary() const {
                 return vocabulary;
             }
@@ -45,6 +97,18 @@ namespace mmt {
             Model *backwardModel;
 
             int threads;
+            ThreadPool *pool;
+            ThreadPool::Utilization utilization;
+
+            // Alignments hold a shared lock, updates hold the exclusive lock only while changing the model
+            mutable boost::shared_mutex mutex;
+            std::mutex update_mutex;
+            size_t trained_words;
+
+            alignment_t Align(const wordvec_t &source, const wordvec_t &target, Symmetrization symmetrization);
+
+            void Align(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                       std::vector<alignment_t> &outAlignments, Symmetrization symmetrization);
         };
 
     }
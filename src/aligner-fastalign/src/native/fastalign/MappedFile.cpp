@@ -0,0 +1,42 @@
+#include "MappedFile.h"
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace mmt::fastalign;
+
+MappedFile::MappedFile(const string &path) : data(nullptr), size(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("unable to open file: " + path);
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error("unable to stat file: " + path);
+    }
+
+    size = (size_t) st.st_size;
+
+    if (size > 0) {
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("unable to map file: " + path);
+        }
+
+        // lookups are random, the kernel should not waste I/O on read-ahead
+        madvise(ptr, size, MADV_RANDOM);
+        data = (const char *) ptr;
+    }
+
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data)
+        munmap((void *) data, size);
+}
@@ -0,0 +1,41 @@
+#ifndef MMT_FASTALIGN_MAPPEDFILE_H
+#define MMT_FASTALIGN_MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Read-only, shared memory mapping of a whole file.
+         * Pages are served by the OS page cache, so multiple processes mapping
+         * the same file share the same physical memory.
+         */
+        class MappedFile {
+        public:
+            explicit MappedFile(const std::string &path);
+
+            MappedFile(const MappedFile &) = delete;
+
+            MappedFile &operator=(const MappedFile &) = delete;
+
+            ~MappedFile();
+
+            inline const char *GetData() const {
+                return data;
+            }
+
+            inline size_t GetSize() const {
+                return size;
+            }
+
+        private:
+            const char *data;
+            size_t size;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_MAPPEDFILE_H
@@ -5,22 +5,34 @@
 #ifndef FASTALIGN_MODEL_H
 #define FASTALIGN_MODEL_H
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include "alignment.h"
 #include "Vocabulary.h"
+#include "DiagonalPriorCache.h"
+#include "ThreadPool.h"
 
 namespace mmt {
     namespace fastalign {
 
         const double kNullProbability = 1e-9;
 
+        // Batch tools keep the probabilities of the 1024 most frequent words in a dense matrix (8MB); the matrix is
+        // private memory of the process, so models loaded for serving do not build it unless requested
+        const size_t kDefaultDenseRank = 1024;
+
+        struct AlignmentKernel;
+
         class Model {
             friend class Builder;
+            friend class FastAligner;
+            friend struct AlignmentKernel;
 
         public:
-            Model(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension);
+            Model(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension,
+                  size_t prior_cache_memory = DiagonalPriorCache::kDefaultMemoryBudget);
 
             inline alignment_t ComputeAlignment(const wordvec_t &source, const wordvec_t &target,
                                                 const Vocabulary *vocab = nullptr) {
@@ -48,12 +60,47 @@ namespace mmt {
 
             double diagonal_tension;
 
-            double ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
-                                    alignment_t *outAlignment, const Vocabulary *vocab = nullptr);
+            // Normalized alignment prior for every (target, source) length pair, valid for the current tension
+            // (null if the model does not favor the diagonal)
+            std::unique_ptr<DiagonalPriorCache> prior_cache;
+
+            // If not null, batches are aligned by this pool with the given concurrency instead of an OpenMP team,
+            // measuring the busy fraction of the workers in "utilization" (if not null)
+            ThreadPool *pool = nullptr;
+            size_t concurrency = 0;
+            ThreadPool::Utilization *utilization = nullptr;
+
+            // If greater than 0, alignments with the diagonal prior only evaluate the cells within a band around
+            // the diagonal that leaves out at most this fraction of the prior mass (see AlignmentKernel)
+            double band_tolerance = 0;
+
+            inline void SetDiagonalTension(double tension) {
+                diagonal_tension = tension;
+                if (prior_cache)
+                    prior_cache->SetTension(tension);
+            }
+
+            /*
+             * The default implementations run the alignment kernel through the virtual GetProbability() and
+             * IncrementProbability() methods: concrete models override them with kernels specialized
+             * on their own type (see AlignmentKernel).
+             */
+
+            virtual double ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
+                                            alignment_t *outAlignment, const Vocabulary *vocab = nullptr);
+
+            virtual double ComputeAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                             Model *outModel, std::vector<alignment_t> *outAlignments,
+                                             const Vocabulary *vocab = nullptr, double *outLogLikelihood = nullptr);
 
-            double ComputeAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
-                                     Model *outModel, std::vector<alignment_t> *outAlignments,
-                                     const Vocabulary *vocab = nullptr);
+            template<bool kReverse>
+            inline double Probability(word_t source, word_t target) {
+                return GetProbability(source, target);
+            }
+
+            inline void Increment(word_t source, word_t target, double amount) {
+                IncrementProbability(source, target, amount);
+            }
         };
 
     }
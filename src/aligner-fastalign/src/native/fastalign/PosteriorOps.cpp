@@ -0,0 +1,499 @@
+#include "PosteriorOps.h"
+#include "DiagonalAlignment.h"
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FASTALIGN_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+// Series of log((1 + f) / (1 - f)) / 2f in powers of f^2, for |f| < 0.172
+static const double kLogSeries[] = {
+        1.0, 1.0 / 3.0, 1.0 / 5.0, 1.0 / 7.0, 1.0 / 9.0, 1.0 / 11.0, 1.0 / 13.0, 1.0 / 15.0, 1.0 / 17.0, 1.0 / 19.0,
+        1.0 / 21.0, 1.0 / 23.0
+};
+static const size_t kLogSeriesSize = sizeof(kLogSeries) / sizeof(double);
+
+// Taylor series of exp(r), for |r| < 0.347
+static const double kExpSeries[] = {
+        1.0, 1.0, 1.0 / 2.0, 1.0 / 6.0, 1.0 / 24.0, 1.0 / 120.0, 1.0 / 720.0, 1.0 / 5040.0, 1.0 / 40320.0,
+        1.0 / 362880.0, 1.0 / 3628800.0, 1.0 / 39916800.0, 1.0 / 479001600.0, 1.0 / 6227020800.0
+};
+static const size_t kExpSeriesSize = sizeof(kExpSeries) / sizeof(double);
+
+// ln(2) split in a high part with 32 significant bits, so that k * kLn2Hi is exact, and the rest
+static const double kLn2Hi = 6.93147180369123816490e-01;
+static const double kLn2Lo = 1.90821492927058770002e-10;
+static const double kLog2e = 1.44269504088896338700e+00;
+static const double kSqrt2 = 1.41421356237309504880e+00;
+
+// exp() is 0 below and infinity above these limits
+static const double kExpMin = -746.0;
+static const double kExpMax = 710.0;
+
+double PosteriorOps::Digamma(double x) {
+    double result = 0, xx, xx2, xx4;
+    for (; x < 7; ++x)
+        result -= 1 / x;
+    x -= 1.0 / 2.0;
+    xx = 1.0 / x;
+    xx2 = xx * xx;
+    xx4 = xx2 * xx2;
+    result += log(x) + (1. / 24.) * xx2 - (7.0 / 960.0) * xx4 + (31.0 / 8064.0) * xx4 * xx2 -
+              (127.0 / 30720.0) * xx4 * xx4;
+    return result;
+}
+
+// Scalar
+
+static void Multiply_Scalar(double *values, const double *factors, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        values[i] *= factors[i];
+}
+
+static double Sum_Scalar(const double *values, size_t size, double init) {
+    for (size_t i = 0; i < size; ++i)
+        init += values[i];
+    return init;
+}
+
+static size_t ArgMax_Scalar(const double *values, size_t size) {
+    size_t max_index = size;
+    double max_p = -1;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (values[i] > max_p) {
+            max_index = i;
+            max_p = values[i];
+        }
+    }
+
+    return max_index;
+}
+
+static double Normalize_Scalar(double *values, size_t size, double sum, length_t j, length_t m, length_t n,
+                               double init) {
+    for (size_t i = 0; i < size; ++i) {
+        values[i] /= sum;
+        init += DiagonalAlignment::Feature(j, (unsigned) (i + 1), m, n) * values[i];
+    }
+
+    return init;
+}
+
+static void ExpDigamma_Scalar(const double *values, double *outValues, size_t size, double alpha, double offset) {
+    for (size_t i = 0; i < size; ++i)
+        outValues[i] = exp(PosteriorOps::Digamma(values[i] + alpha) - offset);
+}
+
+#ifdef FASTALIGN_X86_DISPATCH
+
+// AVX2
+
+__attribute__((target("avx2")))
+static void Multiply_AVX2(double *values, const double *factors, size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), _mm256_loadu_pd(factors + i)));
+    for (; i < size; ++i)
+        values[i] *= factors[i];
+}
+
+__attribute__((target("avx2")))
+static inline double HorizontalSum_AVX2(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2")))
+static double Sum_AVX2(const double *values, size_t size, double init) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+    }
+    for (; i + 4 <= size; i += 4)
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+
+    double sum = HorizontalSum_AVX2(_mm256_add_pd(acc0, acc1));
+    for (; i < size; ++i)
+        sum += values[i];
+
+    return init + sum;
+}
+
+__attribute__((target("avx2")))
+static size_t ArgMax_AVX2(const double *values, size_t size) {
+    if (size < 8)
+        return ArgMax_Scalar(values, size);
+
+    __m256d vmax = _mm256_loadu_pd(values);
+    size_t i = 4;
+    for (; i + 4 <= size; i += 4)
+        vmax = _mm256_max_pd(vmax, _mm256_loadu_pd(values + i));
+
+    __m128d m = _mm_max_pd(_mm256_castpd256_pd128(vmax), _mm256_extractf128_pd(vmax, 1));
+    double max_p = _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+    for (; i < size; ++i)
+        max_p = values[i] > max_p ? values[i] : max_p;
+
+    // First occurrence of the maximum, as in the scalar version
+    const __m256d key = _mm256_set1_pd(max_p);
+    for (i = 0; i + 4 <= size; i += 4) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i), key, _CMP_EQ_OQ));
+        if (mask)
+            return i + __builtin_ctz((unsigned) mask);
+    }
+    for (; i < size; ++i) {
+        if (values[i] == max_p)
+            return i;
+    }
+
+    return ArgMax_Scalar(values, size);
+}
+
+__attribute__((target("avx2")))
+static double Normalize_AVX2(double *values, size_t size, double sum, length_t j, length_t m, length_t n,
+                             double init) {
+    const __m256d vsum = _mm256_set1_pd(sum);
+    const __m256d vm = _mm256_set1_pd((double) m);
+    const __m256d vjn = _mm256_set1_pd((double) j * n);
+    const __m256d vmn = _mm256_set1_pd((double) m * n);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d step = _mm256_set1_pd(4.0);
+
+    __m256d index = _mm256_set_pd(4.0, 3.0, 2.0, 1.0);
+    __m256d acc = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m256d p = _mm256_div_pd(_mm256_loadu_pd(values + i), vsum);
+        _mm256_storeu_pd(values + i, p);
+
+        // Feature = -|(i + 1) * m - j * n| / (m * n), all integers are exactly representable
+        __m256d distance = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_mul_pd(index, vm), vjn));
+        __m256d feature = _mm256_xor_pd(sign, _mm256_div_pd(distance, vmn));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(feature, p));
+
+        index = _mm256_add_pd(index, step);
+    }
+
+    double result = HorizontalSum_AVX2(acc);
+    for (; i < size; ++i) {
+        values[i] /= sum;
+        result += DiagonalAlignment::Feature(j, (unsigned) (i + 1), m, n) * values[i];
+    }
+
+    return init + result;
+}
+
+// log(x) for x normal and positive: x = m * 2^e, with m in [sqrt(2) / 2, sqrt(2)]
+__attribute__((target("avx2")))
+static inline __m256d Log_AVX2(__m256d x) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256i bits = _mm256_castpd_si256(x);
+
+    // The biased exponent, as a double: 2^52 + e + 1023 - (2^52 + 1023)
+    __m256i exponent = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(0x4330000000000000LL));
+    __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(exponent), _mm256_set1_pd(4503599627370496.0 + 1023.0));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+                                                    _mm256_castpd_si256(one)));
+
+    __m256d large = _mm256_cmp_pd(m, _mm256_set1_pd(kSqrt2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), large);
+    e = _mm256_add_pd(e, _mm256_and_pd(large, one));
+
+    // log(m) = log((1 + f) / (1 - f)), with f = (m - 1) / (m + 1)
+    __m256d f = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d f2 = _mm256_mul_pd(f, f);
+
+    __m256d series = _mm256_set1_pd(kLogSeries[kLogSeriesSize - 1]);
+    for (size_t k = kLogSeriesSize - 1; k-- > 0;)
+        series = _mm256_add_pd(_mm256_mul_pd(series, f2), _mm256_set1_pd(kLogSeries[k]));
+
+    __m256d log_m = _mm256_mul_pd(_mm256_add_pd(f, f), series);
+    return _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(kLn2Hi)),
+                         _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(kLn2Lo)), log_m));
+}
+
+// 2^k for k integer in [-1022, 1023]
+__attribute__((target("avx2")))
+static inline __m256d Pow2_AVX2(__m256d k) {
+    __m256i bits = _mm256_castpd_si256(_mm256_add_pd(k, _mm256_set1_pd(6755399441055744.0)));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52));
+}
+
+// exp(x) = exp(r) * 2^k, with r = x - k * ln(2) and |r| < ln(2) / 2
+__attribute__((target("avx2")))
+static inline __m256d Exp_AVX2(__m256d x) {
+    x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(kExpMax)), _mm256_set1_pd(kExpMin));
+
+    __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(kLog2e)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(k, _mm256_set1_pd(kLn2Hi))),
+                              _mm256_mul_pd(k, _mm256_set1_pd(kLn2Lo)));
+
+    __m256d p = _mm256_set1_pd(kExpSeries[kExpSeriesSize - 1]);
+    for (size_t n = kExpSeriesSize - 1; n-- > 0;)
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(kExpSeries[n]));
+
+    // 2^k is split in two factors, so that results down to the subnormal range are scaled correctly
+    __m256d k1 = _mm256_floor_pd(_mm256_mul_pd(k, _mm256_set1_pd(0.5)));
+    __m256d k2 = _mm256_sub_pd(k, k1);
+    return _mm256_mul_pd(_mm256_mul_pd(p, Pow2_AVX2(k1)), Pow2_AVX2(k2));
+}
+
+// Same arithmetic of PosteriorOps::Digamma(), except for log()
+__attribute__((target("avx2")))
+static inline __m256d Digamma_AVX2(__m256d x) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d seven = _mm256_set1_pd(7.0);
+
+    // x > 0: the recurrence runs at most 7 times
+    __m256d result = _mm256_setzero_pd();
+    for (int t = 0; t < 7; ++t) {
+        __m256d small = _mm256_cmp_pd(x, seven, _CMP_LT_OQ);
+        if (!_mm256_movemask_pd(small))
+            break;
+
+        result = _mm256_sub_pd(result, _mm256_and_pd(small, _mm256_div_pd(one, x)));
+        x = _mm256_add_pd(x, _mm256_and_pd(small, one));
+    }
+
+    x = _mm256_sub_pd(x, _mm256_set1_pd(0.5));
+    __m256d xx = _mm256_div_pd(one, x);
+    __m256d xx2 = _mm256_mul_pd(xx, xx);
+    __m256d xx4 = _mm256_mul_pd(xx2, xx2);
+
+    __m256d series = _mm256_add_pd(Log_AVX2(x), _mm256_mul_pd(_mm256_set1_pd(1. / 24.), xx2));
+    series = _mm256_sub_pd(series, _mm256_mul_pd(_mm256_set1_pd(7.0 / 960.0), xx4));
+    series = _mm256_add_pd(series, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(31.0 / 8064.0), xx4), xx2));
+    series = _mm256_sub_pd(series, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(127.0 / 30720.0), xx4), xx4));
+
+    return _mm256_add_pd(result, series);
+}
+
+__attribute__((target("avx2")))
+static void ExpDigamma_AVX2(const double *values, double *outValues, size_t size, double alpha, double offset) {
+    const __m256d valpha = _mm256_set1_pd(alpha);
+    const __m256d voffset = _mm256_set1_pd(offset);
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m256d digamma = Digamma_AVX2(_mm256_add_pd(_mm256_loadu_pd(values + i), valpha));
+        _mm256_storeu_pd(outValues + i, Exp_AVX2(_mm256_sub_pd(digamma, voffset)));
+    }
+
+    ExpDigamma_Scalar(values + i, outValues + i, size - i, alpha, offset);
+}
+
+// AVX-512
+
+// GCC 12 reports the _mm512_undefined_pd() placeholders of its own intrinsics as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static void Multiply_AVX512(double *values, const double *factors, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+        _mm512_storeu_pd(values + i, _mm512_mul_pd(_mm512_loadu_pd(values + i), _mm512_loadu_pd(factors + i)));
+    if (i < size) {
+        __mmask8 tail = (__mmask8) ((1u << (size - i)) - 1);
+        __m512d v = _mm512_maskz_loadu_pd(tail, values + i);
+        __m512d f = _mm512_maskz_loadu_pd(tail, factors + i);
+        _mm512_mask_storeu_pd(values + i, tail, _mm512_mul_pd(v, f));
+    }
+}
+
+__attribute__((target("avx512f")))
+static double Sum_AVX512(const double *values, size_t size, double init) {
+    __m512d acc = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+        acc = _mm512_add_pd(acc, _mm512_loadu_pd(values + i));
+    if (i < size) {
+        __mmask8 tail = (__mmask8) ((1u << (size - i)) - 1);
+        acc = _mm512_add_pd(acc, _mm512_maskz_loadu_pd(tail, values + i));
+    }
+
+    return init + _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+static size_t ArgMax_AVX512(const double *values, size_t size) {
+    if (size < 16)
+        return ArgMax_Scalar(values, size);
+
+    __m512d vmax = _mm512_loadu_pd(values);
+    size_t i = 8;
+    for (; i + 8 <= size; i += 8)
+        vmax = _mm512_max_pd(vmax, _mm512_loadu_pd(values + i));
+
+    double max_p = _mm512_reduce_max_pd(vmax);
+    for (; i < size; ++i)
+        max_p = values[i] > max_p ? values[i] : max_p;
+
+    // First occurrence of the maximum, as in the scalar version
+    const __m512d key = _mm512_set1_pd(max_p);
+    for (i = 0; i + 8 <= size; i += 8) {
+        __mmask8 mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(values + i), key, _CMP_EQ_OQ);
+        if (mask)
+            return i + __builtin_ctz((unsigned) mask);
+    }
+    for (; i < size; ++i) {
+        if (values[i] == max_p)
+            return i;
+    }
+
+    return ArgMax_Scalar(values, size);
+}
+
+__attribute__((target("avx512f")))
+static double Normalize_AVX512(double *values, size_t size, double sum, length_t j, length_t m, length_t n,
+                               double init) {
+    const __m512d vsum = _mm512_set1_pd(sum);
+    const __m512d vm = _mm512_set1_pd((double) m);
+    const __m512d vjn = _mm512_set1_pd((double) j * n);
+    const __m512d vmn = _mm512_set1_pd((double) m * n);
+    const __m512d step = _mm512_set1_pd(8.0);
+
+    __m512d index = _mm512_set_pd(8.0, 7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0);
+    __m512d acc = _mm512_setzero_pd();
+
+    for (size_t i = 0; i < size; i += 8) {
+        __mmask8 lanes = size - i >= 8 ? (__mmask8) 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+
+        __m512d p = _mm512_div_pd(_mm512_maskz_loadu_pd(lanes, values + i), vsum);
+        _mm512_mask_storeu_pd(values + i, lanes, p);
+
+        // Feature = -|(i + 1) * m - j * n| / (m * n), all integers are exactly representable
+        __m512d distance = _mm512_abs_pd(_mm512_sub_pd(_mm512_mul_pd(index, vm), vjn));
+        __m512d feature = _mm512_sub_pd(_mm512_setzero_pd(), _mm512_div_pd(distance, vmn));
+        acc = _mm512_mask_add_pd(acc, lanes, acc, _mm512_mul_pd(feature, p));
+
+        index = _mm512_add_pd(index, step);
+    }
+
+    return init + _mm512_reduce_add_pd(acc);
+}
+
+// log(x) for x normal and positive: x = m * 2^e, with m in [sqrt(2) / 2, sqrt(2)]
+__attribute__((target("avx512f")))
+static inline __m512d Log_AVX512(__m512d x) {
+    const __m512d one = _mm512_set1_pd(1.0);
+
+    __m512d e = _mm512_getexp_pd(x);
+    __m512d m = _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero);
+
+    __mmask8 large = _mm512_cmp_pd_mask(m, _mm512_set1_pd(kSqrt2), _CMP_GT_OQ);
+    m = _mm512_mask_mul_pd(m, large, m, _mm512_set1_pd(0.5));
+    e = _mm512_mask_add_pd(e, large, e, one);
+
+    // log(m) = log((1 + f) / (1 - f)), with f = (m - 1) / (m + 1)
+    __m512d f = _mm512_div_pd(_mm512_sub_pd(m, one), _mm512_add_pd(m, one));
+    __m512d f2 = _mm512_mul_pd(f, f);
+
+    __m512d series = _mm512_set1_pd(kLogSeries[kLogSeriesSize - 1]);
+    for (size_t k = kLogSeriesSize - 1; k-- > 0;)
+        series = _mm512_add_pd(_mm512_mul_pd(series, f2), _mm512_set1_pd(kLogSeries[k]));
+
+    __m512d log_m = _mm512_mul_pd(_mm512_add_pd(f, f), series);
+    return _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(kLn2Hi)),
+                         _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(kLn2Lo)), log_m));
+}
+
+// exp(x) = exp(r) * 2^k, with r = x - k * ln(2) and |r| < ln(2) / 2
+__attribute__((target("avx512f")))
+static inline __m512d Exp_AVX512(__m512d x) {
+    x = _mm512_max_pd(_mm512_min_pd(x, _mm512_set1_pd(kExpMax)), _mm512_set1_pd(kExpMin));
+
+    __m512d k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(kLog2e)),
+                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_sub_pd(_mm512_sub_pd(x, _mm512_mul_pd(k, _mm512_set1_pd(kLn2Hi))),
+                              _mm512_mul_pd(k, _mm512_set1_pd(kLn2Lo)));
+
+    __m512d p = _mm512_set1_pd(kExpSeries[kExpSeriesSize - 1]);
+    for (size_t n = kExpSeriesSize - 1; n-- > 0;)
+        p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(kExpSeries[n]));
+
+    return _mm512_scalef_pd(p, k);
+}
+
+// Same arithmetic of PosteriorOps::Digamma(), except for log()
+__attribute__((target("avx512f")))
+static inline __m512d Digamma_AVX512(__m512d x) {
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d seven = _mm512_set1_pd(7.0);
+
+    // x > 0: the recurrence runs at most 7 times
+    __m512d result = _mm512_setzero_pd();
+    for (int t = 0; t < 7; ++t) {
+        __mmask8 small = _mm512_cmp_pd_mask(x, seven, _CMP_LT_OQ);
+        if (!small)
+            break;
+
+        result = _mm512_mask_sub_pd(result, small, result, _mm512_div_pd(one, x));
+        x = _mm512_mask_add_pd(x, small, x, one);
+    }
+
+    x = _mm512_sub_pd(x, _mm512_set1_pd(0.5));
+    __m512d xx = _mm512_div_pd(one, x);
+    __m512d xx2 = _mm512_mul_pd(xx, xx);
+    __m512d xx4 = _mm512_mul_pd(xx2, xx2);
+
+    __m512d series = _mm512_add_pd(Log_AVX512(x), _mm512_mul_pd(_mm512_set1_pd(1. / 24.), xx2));
+    series = _mm512_sub_pd(series, _mm512_mul_pd(_mm512_set1_pd(7.0 / 960.0), xx4));
+    series = _mm512_add_pd(series, _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(31.0 / 8064.0), xx4), xx2));
+    series = _mm512_sub_pd(series, _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(127.0 / 30720.0), xx4), xx4));
+
+    return _mm512_add_pd(result, series);
+}
+
+__attribute__((target("avx512f")))
+static void ExpDigamma_AVX512(const double *values, double *outValues, size_t size, double alpha, double offset) {
+    const __m512d valpha = _mm512_set1_pd(alpha);
+    const __m512d voffset = _mm512_set1_pd(offset);
+    const __m512d one = _mm512_set1_pd(1.0);
+
+    for (size_t i = 0; i < size; i += 8) {
+        __mmask8 lanes = size - i >= 8 ? (__mmask8) 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+
+        // Lanes past the end are 1, a valid argument of digamma
+        __m512d digamma = Digamma_AVX512(_mm512_add_pd(_mm512_mask_loadu_pd(one, lanes, values + i), valpha));
+        _mm512_mask_storeu_pd(outValues + i, lanes, Exp_AVX512(_mm512_sub_pd(digamma, voffset)));
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+static PosteriorOps SelectPosteriorOps() {
+#ifdef FASTALIGN_X86_DISPATCH
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return {"avx512", Multiply_AVX512, Sum_AVX512, ArgMax_AVX512, Normalize_AVX512, ExpDigamma_AVX512};
+    if (__builtin_cpu_supports("avx2"))
+        return {"avx2", Multiply_AVX2, Sum_AVX2, ArgMax_AVX2, Normalize_AVX2, ExpDigamma_AVX2};
+#endif
+
+    return {"scalar", Multiply_Scalar, Sum_Scalar, ArgMax_Scalar, Normalize_Scalar, ExpDigamma_Scalar};
+}
+
+const PosteriorOps &PosteriorOps::Get() {
+    static const PosteriorOps ops = SelectPosteriorOps();
+    return ops;
+}
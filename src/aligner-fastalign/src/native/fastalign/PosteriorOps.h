@@ -0,0 +1,59 @@
+#ifndef MMT_FASTALIGN_POSTERIOROPS_H
+#define MMT_FASTALIGN_POSTERIOROPS_H
+
+#include <cstddef>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Vector primitives of the alignment posterior, applied to the source row of a single target word
+         * (the null word excluded), and of the normalization of the expected counts of a row of the translation
+         * table. The implementation is selected once at runtime, based on the instruction sets supported by the
+         * CPU: AVX-512, AVX2 or a portable scalar fallback.
+         *
+         * The scalar implementation accumulates values in the same order as the original loops; vector
+         * implementations accumulate them lane by lane, so their sums may differ in the last bits.
+         */
+        struct PosteriorOps {
+            const char *name;
+
+            /** values[i] *= factors[i] */
+            void (*Multiply)(double *values, const double *factors, size_t size);
+
+            /** Returns init + sum(values) */
+            double (*Sum)(const double *values, size_t size, double init);
+
+            /** Returns the index of the first maximum of values, or "size" if values is empty */
+            size_t (*ArgMax)(const double *values, size_t size);
+
+            /**
+             * Divides every value by "sum" and returns init + sum(Feature(j, i + 1, m, n) * values[i]),
+             * where Feature is the diagonal alignment feature (see DiagonalAlignment).
+             */
+            double (*Normalize)(double *values, size_t size, double sum, length_t j, length_t m, length_t n,
+                                double init);
+
+            /**
+             * outValues[i] = exp(Digamma(values[i] + alpha) - offset), the variational Bayes normalization of
+             * the expected counts of a row; vector implementations compute log() and exp() with polynomial
+             * approximations, with a relative error of a few units in the last place of the digamma.
+             */
+            void (*ExpDigamma)(const double *values, double *outValues, size_t size, double alpha, double offset);
+
+            /**
+             * Scalar digamma function, for x > 0
+             */
+            static double Digamma(double x);
+
+            /**
+             * Returns the best implementation for the current CPU.
+             */
+            static const PosteriorOps &Get();
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_POSTERIOROPS_H
@@ -0,0 +1,90 @@
+#include "PrefetchReader.h"
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+PrefetchReader::PrefetchReader(source_t source, size_t depth)
+        : source(std::move(source)), depth(depth > 0 ? depth : 1), drained(false), stopped(false) {
+    worker = thread(&PrefetchReader::Run, this);
+}
+
+PrefetchReader::~PrefetchReader() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+
+    freeCondition.notify_all();
+    worker.join();
+}
+
+void PrefetchReader::Run() {
+    while (true) {
+        batch_t batch;
+
+        {
+            unique_lock<std::mutex> lock(mutex);
+            freeCondition.wait(lock, [this] { return stopped || ready.size() < depth; });
+
+            if (stopped)
+                return;
+
+            if (!recycled.empty()) {
+                batch.swap(recycled.back());
+                recycled.pop_back();
+            }
+        }
+
+        batch.clear();
+
+        bool more;
+        try {
+            more = source(batch);
+        } catch (...) {
+            lock_guard<std::mutex> lock(mutex);
+            error = current_exception();
+            drained = true;
+            readyCondition.notify_all();
+            return;
+        }
+
+        {
+            lock_guard<std::mutex> lock(mutex);
+
+            if (more)
+                ready.push_back(std::move(batch));
+            else
+                drained = true;
+        }
+
+        readyCondition.notify_all();
+
+        if (!more)
+            return;
+    }
+}
+
+bool PrefetchReader::Read(batch_t &outBatch) {
+    unique_lock<std::mutex> lock(mutex);
+    readyCondition.wait(lock, [this] { return !ready.empty() || drained; });
+
+    if (ready.empty()) {
+        if (error) {
+            exception_ptr e = error;
+            error = nullptr;
+            rethrow_exception(e);
+        }
+
+        return false;
+    }
+
+    outBatch.swap(ready.front());
+    recycled.push_back(std::move(ready.front()));
+    ready.pop_front();
+
+    lock.unlock();
+    freeCondition.notify_one();
+
+    return true;
+}
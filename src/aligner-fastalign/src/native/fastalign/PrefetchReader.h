@@ -0,0 +1,73 @@
+#ifndef MMT_FASTALIGN_PREFETCHREADER_H
+#define MMT_FASTALIGN_PREFETCHREADER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Reads batches from a source in a background thread, so that the next batches are read and parsed
+         * while the current one is being aligned.
+         *
+         * At most "depth" batches are kept ready: with the default depth of 2 the consumer works on a batch
+         * while up to two more are waiting (triple buffering). Batch buffers are recycled between consumer
+         * and producer, and exceptions thrown by the source are re-thrown by Read().
+         *
+         * The source can be any batch reader, for example:
+         *
+         *     CorpusReader reader(corpus, &vocabulary);
+         *     PrefetchReader prefetch([&reader](PrefetchReader::batch_t &batch) {
+         *         return reader.Read(batch, 10000);
+         *     });
+         */
+        class PrefetchReader {
+        public:
+            typedef std::vector<std::pair<wordvec_t, wordvec_t>> batch_t;
+            typedef std::function<bool(batch_t &)> source_t;
+
+            static const size_t kDefaultDepth = 2;
+
+            explicit PrefetchReader(source_t source, size_t depth = kDefaultDepth);
+
+            PrefetchReader(const PrefetchReader &) = delete;
+
+            PrefetchReader &operator=(const PrefetchReader &) = delete;
+
+            ~PrefetchReader();
+
+            /**
+             * Replaces the content of "outBatch" with the next batch; returns false when the source is drained.
+             */
+            bool Read(batch_t &outBatch);
+
+        private:
+            source_t source;
+            const size_t depth;
+
+            std::mutex mutex;
+            std::condition_variable readyCondition;
+            std::condition_variable freeCondition;
+
+            std::deque<batch_t> ready;
+            std::vector<batch_t> recycled;
+            bool drained;
+            bool stopped;
+            std::exception_ptr error;
+
+            std::thread worker;
+
+            void Run();
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_PREFETCHREADER_H
@@ -0,0 +1,147 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+static thread_local size_t current_worker = 0;
+
+static inline double Now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ThreadPool::Utilization::Add(double busy, double capacity) {
+    lock_guard<std::mutex> lock(mutex);
+    this->busy += busy;
+    this->capacity += capacity;
+}
+
+double ThreadPool::Utilization::GetBusyFraction() const {
+    lock_guard<std::mutex> lock(mutex);
+    return capacity > 0 ? busy / capacity : 0.;
+}
+
+ThreadPool &ThreadPool::Shared() {
+    static ThreadPool pool(std::max(thread::hardware_concurrency(), 1u) - 1);
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t size) : stopped(false) {
+    threads.reserve(size);
+    for (size_t i = 0; i < size; ++i)
+        threads.emplace_back(&ThreadPool::Run, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+
+    jobCondition.notify_all();
+    for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+        thread->join();
+}
+
+size_t ThreadPool::GetWorker() {
+    return current_worker;
+}
+
+void ThreadPool::ParallelFor(size_t size, size_t concurrency, const task_t &task, Utilization *utilization) {
+    if (size == 0)
+        return;
+
+    if (concurrency == 0 || concurrency > GetMaxConcurrency())
+        concurrency = GetMaxConcurrency();
+    concurrency = std::min(concurrency, size);
+
+    Job job(&task, size, concurrency, utilization != nullptr);
+    double begin = utilization ? Now() : 0.;
+
+    if (concurrency > 1) {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(&job);
+        }
+
+        for (size_t i = 1; i < concurrency; ++i)
+            jobCondition.notify_one();
+    }
+
+    Execute(job, 0);
+
+    size_t workers = 1;
+    if (concurrency > 1) {
+        unique_lock<std::mutex> lock(mutex);
+
+        // no other thread can join the job once all the indices have been claimed
+        auto entry = std::find(jobs.begin(), jobs.end(), &job);
+        if (entry != jobs.end())
+            jobs.erase(entry);
+
+        doneCondition.wait(lock, [&job] { return job.running == 0; });
+        workers = job.workers;
+    }
+
+    if (utilization)
+        utilization->Add(job.busy, workers * (Now() - begin));
+
+    if (job.error)
+        rethrow_exception(job.error);
+}
+
+void ThreadPool::Run() {
+    unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        jobCondition.wait(lock, [this] { return stopped || !jobs.empty(); });
+
+        if (stopped)
+            return;
+
+        Job *job = jobs.front();
+        jobs.pop_front();
+
+        size_t worker = job->workers++;
+        if (job->workers < job->concurrency)
+            jobs.push_back(job);
+
+        ++job->running;
+
+        lock.unlock();
+        Execute(*job, worker);
+        lock.lock();
+
+        if (--job->running == 0)
+            doneCondition.notify_all();
+    }
+}
+
+void ThreadPool::Execute(Job &job, size_t worker) {
+    size_t previous = current_worker;
+    current_worker = worker;
+
+    double begin = job.measured ? Now() : 0.;
+
+    try {
+        for (size_t index = job.next++; index < job.size; index = job.next++)
+            (*job.task)(index, worker);
+    } catch (...) {
+        job.next = job.size;
+
+        lock_guard<std::mutex> lock(mutex);
+        if (!job.error)
+            job.error = current_exception();
+    }
+
+    if (job.measured) {
+        double busy = Now() - begin;
+
+        lock_guard<std::mutex> lock(mutex);
+        job.busy += busy;
+    }
+
+    current_worker = previous;
+}
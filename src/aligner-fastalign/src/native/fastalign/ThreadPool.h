@@ -0,0 +1,122 @@
+#ifndef MMT_FASTALIGN_THREADPOOL_H
+#define MMT_FASTALIGN_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Pool of threads shared by all the jobs of the process, replacing an OpenMP team per call: aligners
+         * and readers submit jobs with their own concurrency limit instead of setting the process-global number
+         * of OpenMP threads, so that many jobs submitted concurrently (for example by the request threads of
+         * the Java aligner) share the same threads rather than oversubscribing the CPUs.
+         *
+         * A job runs a task for every index in [0, size): the calling thread always takes part in its own job,
+         * and idle pool threads join the pending jobs in turn, up to the concurrency of every job. Indices are
+         * claimed one at a time from a shared counter, so the threads that finish first take the remaining work
+         * of the slower ones. Since the caller never waits for a pool thread to start, jobs can be nested.
+         */
+        class ThreadPool {
+        public:
+            typedef std::function<void(size_t index, size_t worker)> task_t;
+
+            /**
+             * Fraction of time the workers of a set of jobs were busy running tasks: the capacity of every job
+             * is the number of workers that took part in it (at most its concurrency, fewer if the pool threads
+             * were busy with other jobs) times its duration, so idle workers waiting for the longest task of a
+             * job lower the fraction. Thread-safe.
+             */
+            class Utilization {
+            public:
+                void Add(double busy, double capacity);
+
+                /**
+                 * Returns busy time over capacity of all the jobs measured so far (0 if none).
+                 */
+                double GetBusyFraction() const;
+
+            private:
+                mutable std::mutex mutex;
+                double busy = 0;
+                double capacity = 0;
+            };
+
+            /**
+             * Process-wide pool: the calling thread of every job is one of its workers, so the pool has
+             * one thread less than the number of CPUs.
+             */
+            static ThreadPool &Shared();
+
+            explicit ThreadPool(size_t threads);
+
+            ThreadPool(const ThreadPool &) = delete;
+
+            ThreadPool &operator=(const ThreadPool &) = delete;
+
+            ~ThreadPool();
+
+            /**
+             * Maximum number of workers of a job, including the calling thread.
+             */
+            inline size_t GetMaxConcurrency() const {
+                return threads.size() + 1;
+            }
+
+            /**
+             * Runs task(index, worker) for every index in [0, size) on at most "concurrency" workers (0 is
+             * GetMaxConcurrency()) and returns when all the tasks are done; "worker" is in [0, concurrency)
+             * and no two tasks with the same worker run at the same time. If a task throws, the remaining
+             * indices are skipped and the first exception is rethrown.
+             *
+             * If "utilization" is not null, the busy time and the capacity of the job are added to it.
+             */
+            void ParallelFor(size_t size, size_t concurrency, const task_t &task,
+                             Utilization *utilization = nullptr);
+
+            /**
+             * Returns the worker running the current task (0 outside of a job).
+             */
+            static size_t GetWorker();
+
+        private:
+            struct Job {
+                const task_t *task;
+                size_t size;
+                size_t concurrency;
+                bool measured;
+
+                std::atomic<size_t> next;
+                size_t workers = 1; // the caller is worker 0
+                size_t running = 0; // pool threads working on the job
+                std::exception_ptr error;
+                double busy = 0; // seconds, only if measured
+
+                Job(const task_t *task, size_t size, size_t concurrency, bool measured)
+                        : task(task), size(size), concurrency(concurrency), measured(measured), next(0) {}
+            };
+
+            std::vector<std::thread> threads;
+
+            std::mutex mutex;
+            std::condition_variable jobCondition;
+            std::condition_variable doneCondition;
+            std::deque<Job *> jobs; // jobs with free workers, in turn
+            bool stopped;
+
+            void Run();
+
+            void Execute(Job &job, size_t worker);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_THREADPOOL_H
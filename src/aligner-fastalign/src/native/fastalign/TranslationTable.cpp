@@ -0,0 +1,519 @@
+#include "TranslationTable.h"
+#include "ioutils.h"
+#include <cmath>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+static const size_t kSectionAlignment = 64;
+
+static inline size_t AlignOffset(size_t offset) {
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+static inline void WritePadding(ostream &out, size_t offset) {
+    static const char zeros[kSectionAlignment] = {0};
+
+    auto position = (size_t) out.tellp();
+    if (offset > position)
+        out.write(zeros, offset - position);
+}
+
+// Columns and scores are buffered and written in blocks of at least this size
+static const size_t kWriteBlockSize = 1 << 20;
+
+static inline void WriteBlock(ostream &out, vector<char> &block, bool last) {
+    if (last || block.size() >= kWriteBlockSize) {
+        out.write(block.data(), block.size());
+        block.clear();
+    }
+}
+
+// Quantization codebooks are trained on a sample of the table scores
+static const size_t kCodebookSampleSize = 1 << 22;
+static const int kCodebookIterations = 20;
+static const double kMinLogProbability = -100.;
+
+static inline double LogProbability(float p) {
+    return p > 0 ? std::max(kMinLogProbability, log((double) p)) : kMinLogProbability;
+}
+
+static inline size_t GetCodebookSize(ScoreEncoding encoding) {
+    switch (encoding) {
+        case kScoreEncodingQuantized8:
+            return 1 << 8;
+        case kScoreEncodingQuantized16:
+            return 1 << 16;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Builds a codebook with 1D Lloyd's algorithm (k-means) in log space: centroids are initialized
+ * on the quantiles of the scores distribution, and every iteration moves them to the mean
+ * of the scores they encode. Returns the sorted log-probability of each code.
+ */
+static void BuildCodebook(TranslationTable::RowReader &rows, size_t nnz, size_t size, vector<double> &outCentroids) {
+    size_t total = 2 * nnz;
+    size_t stride = std::max((size_t) 1, total / kCodebookSampleSize);
+
+    vector<double> sample;
+    sample.reserve(total / stride + 1);
+
+    TranslationTable::row_t row;
+    size_t counter = 0;
+
+    rows.Rewind();
+    for (size_t s = 0; s < rows.Rows(); ++s) {
+        rows.Read(row);
+
+        for (auto cell = row.begin(); cell != row.end(); ++cell) {
+            if (counter++ % stride == 0)
+                sample.push_back(LogProbability(cell->second.first));
+            if (counter++ % stride == 0)
+                sample.push_back(LogProbability(cell->second.second));
+        }
+    }
+
+    if (sample.empty())
+        sample.push_back(kMinLogProbability);
+
+    std::sort(sample.begin(), sample.end());
+
+    outCentroids.clear();
+
+    vector<double> unique(sample);
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+    if (unique.size() <= size) {
+        // lossless codebook
+        outCentroids.swap(unique);
+        return;
+    }
+
+    vector<double> prefix(sample.size() + 1, 0.);
+    for (size_t i = 0; i < sample.size(); ++i)
+        prefix[i + 1] = prefix[i] + sample[i];
+
+    vector<double> centroids(size);
+    for (size_t k = 0; k < size; ++k)
+        centroids[k] = sample[(size_t) ((k + .5) * sample.size() / size)];
+
+    for (int iteration = 0; iteration < kCodebookIterations; ++iteration) {
+        centroids.erase(std::unique(centroids.begin(), centroids.end()), centroids.end());
+
+        size_t lo = 0;
+        for (size_t k = 0; k < centroids.size(); ++k) {
+            size_t hi = sample.size();
+            if (k + 1 < centroids.size()) {
+                double boundary = (centroids[k] + centroids[k + 1]) / 2.;
+                hi = (size_t) (std::lower_bound(sample.begin() + lo, sample.end(), boundary) - sample.begin());
+            }
+
+            if (hi > lo)
+                centroids[k] = (prefix[hi] - prefix[lo]) / (hi - lo);
+
+            lo = hi;
+        }
+
+        std::sort(centroids.begin(), centroids.end());
+    }
+
+    centroids.erase(std::unique(centroids.begin(), centroids.end()), centroids.end());
+    outCentroids.swap(centroids);
+}
+
+static inline size_t Encode(const vector<double> &boundaries, float score) {
+    return (size_t) (std::lower_bound(boundaries.begin(), boundaries.end(), LogProbability(score)) -
+                     boundaries.begin());
+}
+
+/*
+ * Returns true if the offsets of a CSR table start at 0, never decrease and end at nnz, so that every row is a
+ * valid range of the columns and scores arrays.
+ */
+template<class T>
+static bool IsValidOffsets(const T *offsets, size_t rows, size_t nnz) {
+    if (offsets[0] != 0 || offsets[rows] != nnz)
+        return false;
+
+    for (size_t s = 0; s < rows; ++s) {
+        if (offsets[s] > offsets[s + 1])
+            return false;
+    }
+
+    return true;
+}
+
+size_t TranslationTable::GetScoreSize(ScoreEncoding encoding) {
+    switch (encoding) {
+        case kScoreEncodingQuantized8:
+            return sizeof(uint8_t);
+        case kScoreEncodingQuantized16:
+            return sizeof(uint16_t);
+        default:
+            return sizeof(float);
+    }
+}
+
+void TranslationTable::GetLayout(size_t data_offset, size_t rows, size_t nnz, ScoreEncoding encoding,
+                                 size_t codebook_size, size_t offset_size, size_t column_size,
+                                 size_t *outOffsetsOffset, size_t *outColumnsOffset, size_t *outScoresOffset,
+                                 size_t *outEnd) {
+    *outOffsetsOffset = AlignOffset(data_offset + codebook_size * sizeof(float));
+    *outColumnsOffset = AlignOffset(*outOffsetsOffset + (rows + 1) * offset_size);
+    *outScoresOffset = AlignOffset(*outColumnsOffset + nnz * column_size);
+    *outEnd = *outScoresOffset + 2 * nnz * GetScoreSize(encoding);
+}
+
+TranslationTable::TranslationTable(shared_ptr<MappedFile> file, size_t data_offset, size_t rows, size_t nnz,
+                                   ScoreEncoding encoding, size_t codebook_size, size_t offset_size,
+                                   size_t column_size)
+        : file(file), rows(rows), nnz(nnz), encoding(encoding), offset_size(offset_size), column_size(column_size) {
+    if (codebook_size != GetCodebookSize(encoding))
+        throw runtime_error("corrupted model file: invalid codebook size " + to_string(codebook_size));
+    if (offset_size != sizeof(uint32_t) && offset_size != sizeof(uint64_t))
+        throw runtime_error("corrupted model file: invalid offset size " + to_string(offset_size));
+    if (column_size != sizeof(uint16_t) && column_size != sizeof(uint32_t))
+        throw runtime_error("corrupted model file: invalid column size " + to_string(column_size));
+
+    // bound the header values before computing the layout, so that it cannot overflow
+    if (data_offset > file->GetSize() || rows > file->GetSize() || nnz > file->GetSize())
+        throw runtime_error("corrupted model file: invalid translation table size");
+
+    size_t offsets_offset, columns_offset, scores_offset, end;
+    GetLayout(data_offset, rows, nnz, encoding, codebook_size, offset_size, column_size,
+              &offsets_offset, &columns_offset, &scores_offset, &end);
+
+    if (file->GetSize() < end)
+        throw runtime_error("corrupted model file: translation table is truncated");
+
+    codebook = codebook_size > 0 ? (const float *) (file->GetData() + data_offset) : nullptr;
+    offsets = file->GetData() + offsets_offset;
+    columns = file->GetData() + columns_offset;
+    scores = file->GetData() + scores_offset;
+
+    bool valid = offset_size == sizeof(uint32_t) ? IsValidOffsets((const uint32_t *) offsets, rows, nnz)
+                                                 : IsValidOffsets((const uint64_t *) offsets, rows, nnz);
+    if (!valid)
+        throw runtime_error("corrupted model file: invalid translation table offsets");
+}
+
+TranslationTable::TranslationTable(vector<offset_t> &&_offsets, vector<word_t> &&_columns, vector<float> &&_scores)
+        : offsets_data(std::move(_offsets)), columns_data(std::move(_columns)), scores_data(std::move(_scores)) {
+    if (offsets_data.empty() || scores_data.size() != 2 * columns_data.size() ||
+        !IsValidOffsets(offsets_data.data(), offsets_data.size() - 1, columns_data.size()))
+        throw invalid_argument("inconsistent translation table arrays");
+
+    rows = offsets_data.size() - 1;
+    nnz = columns_data.size();
+
+    offsets = offsets_data.data();
+    columns = columns_data.data();
+    scores = scores_data.data();
+}
+
+void TranslationTable::BuildDenseBlock(size_t rank) {
+    rank = std::min(rank, rows);
+
+    // missing cells are marked with a negative score
+    vector<float> block(2 * rank * rank, -1.f);
+
+    for (size_t s = 0; s < rank; ++s) {
+        float *dense_row = block.data() + 2 * s * rank;
+
+        // rows are sorted, so the dense cells are a prefix of the row
+        for (size_t i = GetOffset(s); i < GetOffset(s + 1) && GetColumn(i) < rank; ++i) {
+            dense_row[2 * GetColumn(i)] = GetScore(2 * i);
+            dense_row[2 * GetColumn(i) + 1] = GetScore(2 * i + 1);
+        }
+    }
+
+    dense_data.swap(block);
+    dense_rank = rank;
+    dense = dense_rank > 0 ? dense_data.data() : nullptr;
+}
+
+ScoreEncoding TranslationTable::GetEncodingForBits(int bits) {
+    switch (bits) {
+        case 0:
+        case 32:
+            return kScoreEncodingFloat;
+        case 8:
+            return kScoreEncodingQuantized8;
+        case 16:
+            return kScoreEncodingQuantized16;
+        default:
+            throw invalid_argument("unsupported quantization bits: " + to_string(bits));
+    }
+}
+
+void TranslationTable::Export(bitable_t &outTable) const {
+    outTable.clear();
+    outTable.resize(rows);
+
+    for (size_t s = 0; s < rows; ++s) {
+        unordered_map<word_t, pair<float, float>> &row = outTable[s];
+        row.reserve(GetOffset(s + 1) - GetOffset(s));
+
+        for (size_t i = GetOffset(s); i < GetOffset(s + 1); ++i)
+            row[GetColumn(i)] = pair<float, float>(GetScore(2 * i), GetScore(2 * i + 1));
+    }
+}
+
+vector<TranslationTable::UpdatedCell> &TranslationTable::GetUpdatedRow(word_t source) {
+    if (source >= updated_rows.size())
+        updated_rows.resize((size_t) source + 1);
+
+    vector<UpdatedCell> &cells = updated_rows[source];
+
+    // the first update of a row copies its stored cells
+    if (cells.empty() && source < rows) {
+        cells.reserve(GetOffset(source + 1) - GetOffset(source) + 1);
+
+        for (size_t i = GetOffset(source); i < GetOffset(source + 1); ++i) {
+            UpdatedCell cell{};
+            cell.column = GetColumn(i);
+            cell.scores[0] = GetScore(2 * i);
+            cell.scores[1] = GetScore(2 * i + 1);
+            cells.push_back(cell);
+        }
+    }
+
+    return cells;
+}
+
+TranslationTable::UpdatedCell &TranslationTable::GetUpdatedCell(word_t source, word_t target) {
+    vector<UpdatedCell> &cells = GetUpdatedRow(source);
+
+    auto cell = std::lower_bound(cells.begin(), cells.end(), target,
+                                 [](const UpdatedCell &a, word_t b) { return a.column < b; });
+
+    if (cell == cells.end() || cell->column != target) {
+        UpdatedCell missing{};
+        missing.column = target;
+        missing.scores[0] = -1.;
+        missing.scores[1] = -1.;
+        cell = cells.insert(cell, missing);
+    }
+
+    return *cell;
+}
+
+// Scales of the updated rows are folded into their cells below this value
+static const double kMinRowScale = 1e-6;
+
+void TranslationTable::FoldScale(unsigned direction, word_t row) {
+    const double scale = scales[direction][row];
+
+    if (direction == 0) {
+        vector<UpdatedCell> &cells = GetUpdatedRow(row);
+        for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+            if (cell->scores[0] >= 0)
+                cell->scores[0] *= scale;
+        }
+    } else {
+        // the cells of a backward row are in every source row containing its column
+        const size_t sources = std::max(rows, updated_rows.size());
+
+        for (size_t s = 0; s < sources; ++s) {
+            bool found;
+            if (s < updated_rows.size() && !updated_rows[s].empty()) {
+                const vector<UpdatedCell> &cells = updated_rows[s];
+                auto cell = std::lower_bound(cells.begin(), cells.end(), row,
+                                             [](const UpdatedCell &a, word_t b) { return a.column < b; });
+                found = cell != cells.end() && cell->column == row;
+            } else {
+                found = s < rows && FindCell((word_t) s, row) != kMissingCell;
+            }
+
+            if (found) {
+                UpdatedCell &cell = GetUpdatedCell((word_t) s, row);
+                if (cell.scores[1] >= 0)
+                    cell.scores[1] *= scale;
+            }
+        }
+    }
+
+    scales[direction][row] = 1.;
+}
+
+void TranslationTable::Update(unsigned direction, word_t row, const vector<pair<word_t, double>> &expected,
+                              double step) {
+    if (step <= 0. || step >= 1.)
+        throw invalid_argument("invalid update step: " + to_string(step));
+
+    if (row >= scales[direction].size()) {
+        scales[direction].resize((size_t) row + 1, 1.);
+        update_counts[direction].resize((size_t) row + 1, 0);
+    }
+
+    // (1 - step) * p is applied to the scale of the row, so only the cells with expected counts are written
+    scales[direction][row] *= 1. - step;
+    update_counts[direction][row]++;
+
+    if (scales[direction][row] < kMinRowScale)
+        FoldScale(direction, row);
+
+    const double scale = scales[direction][row];
+
+    for (auto entry = expected.begin(); entry != expected.end(); ++entry) {
+        word_t source = direction == 0 ? row : entry->first;
+        word_t target = direction == 0 ? entry->first : row;
+
+        UpdatedCell &cell = GetUpdatedCell(source, target);
+        double value = cell.scores[direction] < 0 ? 0. : cell.scores[direction];
+        cell.scores[direction] = value + step * entry->second / scale;
+    }
+
+    updated = true;
+}
+
+void TranslationTable::BitableReader::Read(row_t &outRow) {
+    const unordered_map<word_t, pair<float, float>> &cells = table[row++];
+
+    outRow.assign(cells.begin(), cells.end());
+    std::sort(outRow.begin(), outRow.end(), [](const pair<word_t, pair<float, float>> &a,
+                                               const pair<word_t, pair<float, float>> &b) {
+        return a.first < b.first;
+    });
+}
+
+void TranslationTable::Store(ostream &out, RowReader &rows, ScoreEncoding encoding) {
+    const size_t size = rows.Rows();
+    row_t row;
+
+    vector<offset_t> offsets(size + 1);
+    offsets[0] = 0;
+
+    word_t max_column = 0;
+
+    rows.Rewind();
+    for (size_t s = 0; s < size; ++s) {
+        rows.Read(row);
+        offsets[s + 1] = offsets[s] + row.size();
+
+        // rows are sorted, the last cell has the largest column
+        if (!row.empty())
+            max_column = std::max(max_column, row.back().first);
+    }
+
+    size_t nnz = offsets[size];
+    size_t offset_size = nnz <= UINT32_MAX ? sizeof(uint32_t) : sizeof(uint64_t);
+    size_t column_size = max_column <= UINT16_MAX ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    vector<double> centroids;
+    vector<double> boundaries;
+
+    size_t codebook_size = GetCodebookSize(encoding);
+    if (codebook_size > 0) {
+        BuildCodebook(rows, nnz, codebook_size, centroids);
+
+        for (size_t k = 1; k < centroids.size(); ++k)
+            boundaries.push_back((centroids[k - 1] + centroids[k]) / 2.);
+    }
+
+    // header
+    io_write(out, (uint64_t) size);
+    io_write(out, (uint64_t) nnz);
+    io_write(out, encoding);
+    io_write(out, (uint32_t) codebook_size);
+    io_write(out, (uint32_t) offset_size);
+    io_write(out, (uint32_t) column_size);
+
+    size_t data_offset = AlignOffset((size_t) out.tellp() + sizeof(uint64_t));
+    io_write(out, (uint64_t) data_offset);
+
+    size_t offsets_offset, columns_offset, scores_offset, end;
+    GetLayout(data_offset, size, nnz, encoding, codebook_size, offset_size, column_size,
+              &offsets_offset, &columns_offset, &scores_offset, &end);
+
+    // codebook, unused codes (if any) are mapped to the last centroid
+    WritePadding(out, data_offset);
+
+    vector<float> codebook(codebook_size);
+    for (size_t k = 0; k < codebook_size; ++k)
+        codebook[k] = (float) exp(centroids[std::min(k, centroids.size() - 1)]);
+    out.write((const char *) codebook.data(), codebook.size() * sizeof(float));
+
+    // offsets
+    WritePadding(out, offsets_offset);
+    if (offset_size == sizeof(uint32_t)) {
+        vector<uint32_t> narrow(offsets.begin(), offsets.end());
+        out.write((const char *) narrow.data(), narrow.size() * sizeof(uint32_t));
+    } else {
+        out.write((const char *) offsets.data(), offsets.size() * sizeof(offset_t));
+    }
+
+    // columns and scores are written in two sequential passes in order to avoid seeks
+    const size_t score_size = GetScoreSize(encoding);
+    vector<char> block;
+    block.reserve(kWriteBlockSize + kWriteBlockSize / 4);
+
+    WritePadding(out, columns_offset);
+    rows.Rewind();
+    for (size_t s = 0; s < size; ++s) {
+        rows.Read(row);
+
+        size_t position = block.size();
+        block.resize(position + row.size() * column_size);
+
+        char *columns = block.data() + position;
+        for (size_t i = 0; i < row.size(); ++i) {
+            if (column_size == sizeof(uint16_t))
+                ((uint16_t *) columns)[i] = (uint16_t) row[i].first;
+            else
+                ((uint32_t *) columns)[i] = row[i].first;
+        }
+
+        WriteBlock(out, block, s + 1 == size);
+    }
+
+    WritePadding(out, scores_offset);
+    rows.Rewind();
+    for (size_t s = 0; s < size; ++s) {
+        rows.Read(row);
+
+        size_t position = block.size();
+        block.resize(position + 2 * row.size() * score_size);
+
+        char *scores = block.data() + position;
+        for (size_t i = 0; i < row.size(); ++i) {
+            float values[2] = {row[i].second.first, row[i].second.second};
+
+            for (size_t d = 0; d < 2; ++d) {
+                switch (encoding) {
+                    case kScoreEncodingQuantized8:
+                        ((uint8_t *) scores)[2 * i + d] = (uint8_t) Encode(boundaries, values[d]);
+                        break;
+                    case kScoreEncodingQuantized16:
+                        ((uint16_t *) scores)[2 * i + d] = (uint16_t) Encode(boundaries, values[d]);
+                        break;
+                    default:
+                        ((float *) scores)[2 * i + d] = values[d];
+                        break;
+                }
+            }
+        }
+
+        WriteBlock(out, block, s + 1 == size);
+    }
+}
+
+TranslationTable *TranslationTable::Open(istream &in, const string &path) {
+    auto rows = (size_t) io_read<uint64_t>(in);
+    auto nnz = (size_t) io_read<uint64_t>(in);
+    auto encoding = io_read<ScoreEncoding>(in);
+    auto codebook_size = (size_t) io_read<uint32_t>(in);
+    auto offset_size = (size_t) io_read<uint32_t>(in);
+    auto column_size = (size_t) io_read<uint32_t>(in);
+    auto data_offset = (size_t) io_read<uint64_t>(in);
+
+    if (!in)
+        throw runtime_error("corrupted model file: invalid translation table header");
+
+    shared_ptr<MappedFile> file(new MappedFile(path));
+    return new TranslationTable(file, data_offset, rows, nnz, encoding, codebook_size, offset_size, column_size);
+}
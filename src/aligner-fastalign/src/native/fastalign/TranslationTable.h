@@ -0,0 +1,375 @@
+#ifndef MMT_FASTALIGN_TRANSLATIONTABLE_H
+#define MMT_FASTALIGN_TRANSLATIONTABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include "alignment.h"
+#include "MappedFile.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mmt {
+    namespace fastalign {
+
+        typedef std::vector<std::unordered_map<word_t, std::pair<float, float>>> bitable_t;
+
+        typedef uint32_t ScoreEncoding;
+
+        static const ScoreEncoding kScoreEncodingFloat = 0;
+        static const ScoreEncoding kScoreEncodingQuantized8 = 1;
+        static const ScoreEncoding kScoreEncodingQuantized16 = 2;
+
+        /**
+         * Read-only bidirectional translation table in CSR (compressed sparse row) layout:
+         *
+         *  - codebook[codebook_size]: probability of every code (quantized encodings only)
+         *  - offsets[rows + 1]: cells of row "s" are in range [offsets[s], offsets[s + 1])
+         *  - columns[nnz]: target word of every cell, sorted within each row
+         *  - scores[nnz * 2]: forward and backward probability of every cell, interleaved; depending on
+         *    the encoding, the scores are either floats or 8/16-bit codes of the codebook
+         *
+         * Offsets and columns are stored with the narrowest of two widths that fits the table: offsets are 32-bit
+         * if nnz fits in 32 bits (64-bit otherwise), columns are 16-bit if all the target words are lower than
+         * 2^16 (32-bit otherwise).
+         *
+         * The on-disk layout is identical to the in-memory one, so a table stored in a model file
+         * can be memory-mapped and queried without any deserialization.
+         *
+         * Quantized codebooks are built with Lloyd's algorithm on the log-probabilities of the whole table,
+         * so that codes are dense where the probability mass of the table is.
+         *
+         * Vocabulary ids are assigned by frequency, so the most frequent words have the lowest ids:
+         * an optional dense block indexed directly by (source, target) can be created with BuildDenseBlock()
+         * for all the cells with both ids lower than a given rank, leaving only the long tail to the sparse rows.
+         */
+        class TranslationTable {
+        public:
+            typedef uint64_t offset_t;
+
+            TranslationTable(std::vector<offset_t> &&offsets, std::vector<word_t> &&columns,
+                             std::vector<float> &&scores);
+
+            inline size_t Rows() const {
+                return rows;
+            }
+
+            inline size_t Size() const {
+                return nnz;
+            }
+
+            inline ScoreEncoding GetEncoding() const {
+                return encoding;
+            }
+
+            inline size_t GetDenseRank() const {
+                return dense_rank;
+            }
+
+            /**
+             * Copies all the cells with source and target words lower than "rank" in a dense
+             * (rank x rank) matrix. This method is not thread-safe and it must be called before
+             * sharing the table.
+             */
+            void BuildDenseBlock(size_t rank);
+
+            /**
+             * Returns the score of the given cell in the given direction (0 is forward, 1 is backward)
+             * or "missing" if the cell does not exist.
+             */
+            inline double Get(word_t source, word_t target, unsigned direction, double missing) const {
+                return updated ? GetUpdated(source, target, direction, missing)
+                               : GetStored(source, target, direction, missing);
+            }
+
+            /**
+             * Stepwise EM update of a row of the table: direction 0 updates the forward probabilities of
+             * source word "row", direction 1 the backward probabilities of target word "row" (a column of the
+             * table). The row becomes (1 - step) * p + step * expected, where "expected" is the normalized
+             * distribution of the expected counts of the row as (word, probability) pairs; cells missing from
+             * the table are added.
+             *
+             * Stored scores are never modified: the updated source rows are copied in memory, and every row of
+             * both directions has a scale factor, so that an update only writes the cells in "expected".
+             * A scale that falls below 1e-6 is folded back into the cells of its row, so that neither the scale
+             * nor the cells lose precision after many updates.
+             * This method is not thread-safe and no lookup can run concurrently (see FastAligner::Update()).
+             */
+            void Update(unsigned direction, word_t row, const std::vector<std::pair<word_t, double>> &expected,
+                        double step);
+
+            /**
+             * Returns the number of times Update() has been called for the given row.
+             */
+            inline size_t GetUpdates(unsigned direction, word_t row) const {
+                return row < update_counts[direction].size() ? update_counts[direction][row] : 0;
+            }
+
+            static const size_t kLinearSearchSize = 16;
+
+            /**
+             * Searches "target" in the sorted array "base" of size "n" and returns a pointer to it (or nullptr).
+             * Branch-free binary search that narrows the row down to kLinearSearchSize elements,
+             * followed by a (SIMD when available) linear scan of the remaining window.
+             */
+            static inline const uint32_t *Search(const uint32_t *base, size_t n, uint32_t target) {
+                Narrow(base, n, target);
+
+                size_t i = 0;
+#ifdef __SSE2__
+                const __m128i key = _mm_set1_epi32((int) target);
+                for (; i + 4 <= n; i += 4) {
+                    __m128i block = _mm_loadu_si128((const __m128i *) (base + i));
+                    int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(block, key));
+                    if (mask)
+                        return base + i + (__builtin_ctz((unsigned) mask) >> 2);
+                }
+#endif
+                for (; i < n; ++i) {
+                    if (base[i] == target)
+                        return base + i;
+                }
+
+                return nullptr;
+            }
+
+            /**
+             * Same as above, for 16-bit columns.
+             */
+            static inline const uint16_t *Search(const uint16_t *base, size_t n, uint16_t target) {
+                Narrow(base, n, target);
+
+                size_t i = 0;
+#ifdef __SSE2__
+                const __m128i key = _mm_set1_epi16((short) target);
+                for (; i + 8 <= n; i += 8) {
+                    __m128i block = _mm_loadu_si128((const __m128i *) (base + i));
+                    int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(block, key));
+                    if (mask)
+                        return base + i + (__builtin_ctz((unsigned) mask) >> 1);
+                }
+#endif
+                for (; i < n; ++i) {
+                    if (base[i] == target)
+                        return base + i;
+                }
+
+                return nullptr;
+            }
+
+            /**
+             * Returns the encoding that stores scores with the given number of bits: 32 (or 0) for floats,
+             * 8 or 16 for quantized scores.
+             */
+            static ScoreEncoding GetEncodingForBits(int bits);
+
+            /**
+             * Copies the whole table (decoding quantized scores) in a bitable; online updates are not included.
+             */
+            void Export(bitable_t &outTable) const;
+
+            typedef std::vector<std::pair<word_t, std::pair<float, float>>> row_t;
+
+            /**
+             * Sequential source of the rows of a table to store: Read() returns the rows in ascending order,
+             * each one with its cells sorted by column, and Rewind() restarts from the first row.
+             * The rows are read more than once, see Store().
+             */
+            class RowReader {
+            public:
+                virtual ~RowReader() = default;
+
+                virtual size_t Rows() const = 0;
+
+                virtual void Rewind() = 0;
+
+                virtual void Read(row_t &outRow) = 0;
+            };
+
+            /**
+             * Reads the rows of a bitable, sorting the cells of every row.
+             */
+            class BitableReader : public RowReader {
+            public:
+                explicit BitableReader(const bitable_t &table) : table(table) {}
+
+                size_t Rows() const override {
+                    return table.size();
+                }
+
+                void Rewind() override {
+                    row = 0;
+                }
+
+                void Read(row_t &outRow) override;
+
+            private:
+                const bitable_t &table;
+                size_t row = 0;
+            };
+
+            /**
+             * Writes the CSR section of a model file. The stream must be positioned at the point in which the
+             * section should start and its position must be relative to the beginning of the file.
+             *
+             * Only one row at a time is held in memory: the rows are read once to compute the offsets, once more
+             * to sample the scores for the codebook (quantized encodings only), and then once for the columns and
+             * once for the scores, written in large blocks in order to avoid seeks.
+             */
+            static void Store(std::ostream &out, RowReader &rows, ScoreEncoding encoding = kScoreEncodingFloat);
+
+            /**
+             * Reads the CSR section header from "in" and maps the table arrays from the model file at "path".
+             */
+            static TranslationTable *Open(std::istream &in, const std::string &path);
+
+        private:
+            static const size_t kMissingCell = SIZE_MAX;
+
+            std::shared_ptr<MappedFile> file;
+            std::vector<offset_t> offsets_data;
+            std::vector<word_t> columns_data;
+            std::vector<float> scores_data;
+
+            size_t rows;
+            size_t nnz;
+            ScoreEncoding encoding = kScoreEncodingFloat;
+
+            const float *codebook = nullptr;
+            size_t offset_size = sizeof(offset_t);
+            size_t column_size = sizeof(word_t);
+            const void *offsets;
+            const void *columns;
+            const void *scores;
+
+            std::vector<float> dense_data;
+            size_t dense_rank = 0;
+            const float *dense = nullptr;
+
+            // Online updates: copies of the updated source rows (a negative score marks a missing direction),
+            // scale factor and number of updates of every row of both directions
+            struct UpdatedCell {
+                word_t column;
+                double scores[2];
+            };
+
+            bool updated = false;
+            std::vector<std::vector<UpdatedCell>> updated_rows;
+            std::vector<double> scales[2];
+            std::vector<uint32_t> update_counts[2];
+
+            TranslationTable(std::shared_ptr<MappedFile> file, size_t data_offset, size_t rows, size_t nnz,
+                             ScoreEncoding encoding, size_t codebook_size, size_t offset_size, size_t column_size);
+
+            template<class T>
+            static inline void Narrow(const T *&base, size_t &n, T target) {
+                while (n > kLinearSearchSize) {
+                    size_t half = n / 2;
+                    __builtin_prefetch(base + half / 2);
+                    __builtin_prefetch(base + half + half / 2);
+                    base = (base[half] <= target) ? base + half : base;
+                    n -= half;
+                }
+            }
+
+            inline size_t GetOffset(size_t s) const {
+                return offset_size == sizeof(uint32_t) ? ((const uint32_t *) offsets)[s]
+                                                       : (size_t) ((const offset_t *) offsets)[s];
+            }
+
+            inline word_t GetColumn(size_t i) const {
+                return column_size == sizeof(uint16_t) ? ((const uint16_t *) columns)[i]
+                                                       : ((const word_t *) columns)[i];
+            }
+
+            /**
+             * Returns the index of the cell (source, target) in the stored arrays, or kMissingCell.
+             */
+            inline size_t FindCell(word_t source, word_t target) const {
+                const size_t begin = GetOffset(source);
+                const size_t end = GetOffset(source + 1);
+                if (begin == end)
+                    return kMissingCell;
+
+                if (column_size == sizeof(uint16_t)) {
+                    if (target > UINT16_MAX)
+                        return kMissingCell;
+
+                    const auto *base = (const uint16_t *) columns;
+                    const uint16_t *ptr = Search(base + begin, end - begin, (uint16_t) target);
+                    return ptr == nullptr ? kMissingCell : (size_t) (ptr - base);
+                } else {
+                    const auto *base = (const uint32_t *) columns;
+                    const uint32_t *ptr = Search(base + begin, end - begin, (uint32_t) target);
+                    return ptr == nullptr ? kMissingCell : (size_t) (ptr - base);
+                }
+            }
+
+            inline float GetScore(size_t i) const {
+                switch (encoding) {
+                    case kScoreEncodingQuantized8:
+                        return codebook[((const uint8_t *) scores)[i]];
+                    case kScoreEncodingQuantized16:
+                        return codebook[((const uint16_t *) scores)[i]];
+                    default:
+                        return ((const float *) scores)[i];
+                }
+            }
+
+            inline double GetStored(word_t source, word_t target, unsigned direction, double missing) const {
+                if (source < dense_rank && target < dense_rank) {
+                    const float *cell = dense + 2 * (source * dense_rank + target);
+                    return *cell < 0 ? missing : cell[direction];
+                }
+
+                if (source >= rows)
+                    return missing;
+
+                const size_t cell = FindCell(source, target);
+                return cell == kMissingCell ? missing : GetScore(2 * cell + direction);
+            }
+
+            inline double GetUpdated(word_t source, word_t target, unsigned direction, double missing) const {
+                double score;
+
+                if (source < updated_rows.size() && !updated_rows[source].empty()) {
+                    const std::vector<UpdatedCell> &cells = updated_rows[source];
+                    auto cell = std::lower_bound(cells.begin(), cells.end(), target,
+                                                 [](const UpdatedCell &a, word_t b) { return a.column < b; });
+                    if (cell == cells.end() || cell->column != target || cell->scores[direction] < 0)
+                        return missing;
+
+                    score = cell->scores[direction];
+                } else {
+                    score = GetStored(source, target, direction, -1.);
+                    if (score < 0)
+                        return missing;
+                }
+
+                const word_t row = direction == 0 ? source : target;
+                return row < scales[direction].size() ? score * scales[direction][row] : score;
+            }
+
+            std::vector<UpdatedCell> &GetUpdatedRow(word_t source);
+
+            UpdatedCell &GetUpdatedCell(word_t source, word_t target);
+
+            void FoldScale(unsigned direction, word_t row);
+
+            static size_t GetScoreSize(ScoreEncoding encoding);
+
+            static void GetLayout(size_t data_offset, size_t rows, size_t nnz, ScoreEncoding encoding,
+                                  size_t codebook_size, size_t offset_size, size_t column_size,
+                                  size_t *outOffsetsOffset, size_t *outColumnsOffset, size_t *outScoresOffset,
+                                  size_t *outEnd);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_TRANSLATIONTABLE_H
@@ -6,9 +6,15 @@
 #include <iostream>
 #include <unordered_map>
 #include <algorithm>
+#include <cstring>
+#include <future>
 #include <math.h>
 #include "ioutils.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
@@ -83,6 +89,184 @@ inline score_t SmoothInverseDocumentFrequency(size_t n_docs, size_t doc_freq) {
     return static_cast<score_t>(log(((double) n_docs) / (1. + doc_freq)));
 }
 
+static inline uint64_t HashString(const char *value, size_t length) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (uint8_t) value[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t HashString(const string &value) {
+    return HashString(value.data(), value.size());
+}
+
+static inline uint64_t Mix(uint64_t value) {
+    // splitmix64 finalizer
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+static const uint64_t kNoRank = UINT64_MAX;
+
+// Terms are counted in shards selected by the highest bits of their hash, merged in parallel
+static const size_t kTermShardBits = 6;
+static const size_t kTermShards = (size_t) 1 << kTermShardBits;
+
+static const size_t kLinesPerBlock = 10000;
+
+// Ranks are (line << kRankWordBits | word): words past 2^24 in a line share the same rank
+static const size_t kRankWordBits = 24;
+
+/*
+ * Statistics of a term collected by BuildFromCorpora(). Ranks are the positions of the first occurrence of the
+ * term as a source and as a target word: terms sorted by rank are in the order they are first found reading
+ * the corpora line by line.
+ */
+struct TermStats {
+    size_t src_count = 0;
+    size_t tgt_count = 0;
+    size_t src_doc_freq = 0;
+    size_t tgt_doc_freq = 0;
+    uint64_t src_rank = kNoRank;
+    uint64_t tgt_rank = kNoRank;
+
+    // last line counted in the document frequencies
+    uint64_t src_line = kNoRank;
+    uint64_t tgt_line = kNoRank;
+
+    void Add(const TermStats &other) {
+        src_count += other.src_count;
+        tgt_count += other.tgt_count;
+        src_doc_freq += other.src_doc_freq;
+        tgt_doc_freq += other.tgt_doc_freq;
+        src_rank = std::min(src_rank, other.src_rank);
+        tgt_rank = std::min(tgt_rank, other.tgt_rank);
+    }
+};
+
+/*
+ * Open addressing hash table of terms: terms are looked up by pointer and length, so that counting the words
+ * of a line needs no temporary strings.
+ */
+class TermTable {
+public:
+    struct Entry {
+        string term;
+        uint64_t hash;
+        TermStats stats;
+    };
+
+    vector<Entry> entries;
+
+    TermStats &Get(const char *term, size_t length, uint64_t hash) {
+        if ((entries.size() + 1) * 2 > slots.size())
+            Grow();
+
+        const size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            if (slots[slot] == 0) {
+                slots[slot] = (uint32_t) entries.size() + 1;
+                entries.push_back(Entry{string(term, length), hash, TermStats()});
+                return entries.back().stats;
+            }
+
+            Entry &entry = entries[slots[slot] - 1];
+            if (entry.hash == hash && entry.term.size() == length && memcmp(entry.term.data(), term, length) == 0)
+                return entry.stats;
+        }
+    }
+
+    const TermStats *Find(const string &term, uint64_t hash) const {
+        if (slots.empty())
+            return nullptr;
+
+        const size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+            const Entry &entry = entries[slots[slot] - 1];
+            if (entry.hash == hash && entry.term == term)
+                return &entry.stats;
+        }
+
+        return nullptr;
+    }
+
+private:
+    vector<uint32_t> slots;
+
+    void Grow() {
+        slots.assign(std::max((size_t) 16, slots.size() * 2), 0);
+
+        const size_t mask = slots.size() - 1;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            size_t slot = entries[i].hash & mask;
+            while (slots[slot] != 0)
+                slot = (slot + 1) & mask;
+            slots[slot] = (uint32_t) i + 1;
+        }
+    }
+};
+
+static inline uint64_t HashTerm(const char *term, size_t length) {
+    return Mix(HashString(term, length));
+}
+
+static inline const TermStats &FindTerm(const vector<TermTable> &terms, const string &term) {
+    uint64_t hash = HashTerm(term.data(), term.size());
+    return *terms[hash >> (64 - kTermShardBits)].Find(term, hash);
+}
+
+/*
+ * Splits a line in words as ParseLine() in Corpus.cpp does: consecutive spaces give empty words, a final space
+ * does not.
+ */
+static void SplitLine(const string &line, vector<pair<const char *, size_t>> &outWords) {
+    outWords.clear();
+
+    size_t begin = 0;
+    while (begin < line.size()) {
+        size_t end = line.find(' ', begin);
+        if (end == string::npos)
+            end = line.size();
+
+        outWords.emplace_back(line.data() + begin, end - begin);
+        begin = end + 1;
+    }
+}
+
+/*
+ * Source of the blocks of lines of all the corpora
+ */
+class CorporaLines {
+public:
+    explicit CorporaLines(const vector<Corpus> &corpora) : corpora(corpora), corpus(0) {
+    }
+
+    bool operator()(vector<pair<string, string>> &outBlock) {
+        while (corpus < corpora.size()) {
+            if (!reader)
+                reader.reset(new CorpusReader(corpora[corpus]));
+
+            if (reader->ReadLines(outBlock, kLinesPerBlock))
+                return true;
+
+            reader.reset();
+            ++corpus;
+        }
+
+        outBlock.clear();
+        return false;
+    }
+
+private:
+    const vector<Corpus> &corpora;
+    size_t corpus;
+    unique_ptr<CorpusReader> reader;
+};
+
 Vocabulary::Vocabulary(bool case_sensitive) : case_sensitive(case_sensitive) {
     boost::locale::generator gen;
     locale = gen("C.UTF-8");
@@ -111,44 +295,132 @@ Vocabulary::Vocabulary(std::istream &in) {
     }
 }
 
+/*
+ * Counts the words of one side of a line in the shards of a thread
+ */
+static void CountWords(const vector<pair<const char *, size_t>> &words, bool is_source, uint64_t line,
+                       bool case_sensitive, const std::locale &locale, vector<TermTable> &shards) {
+    string lower;
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        const char *term = words[i].first;
+        size_t length = words[i].second;
+
+        if (!case_sensitive) {
+            lower = boost::locale::to_lower(string(term, length), locale);
+            term = lower.data();
+            length = lower.size();
+        }
+
+        uint64_t hash = HashTerm(term, length);
+        TermStats &stats = shards[hash >> (64 - kTermShardBits)].Get(term, length, hash);
+        uint64_t rank = (line << kRankWordBits) | std::min(i, ((size_t) 1 << kRankWordBits) - 1);
+
+        if (is_source) {
+            stats.src_count += 1;
+            stats.src_rank = std::min(stats.src_rank, rank);
+            if (stats.src_line != line) {
+                stats.src_doc_freq += 1;
+                stats.src_line = line;
+            }
+        } else {
+            stats.tgt_count += 1;
+            stats.tgt_rank = std::min(stats.tgt_rank, rank);
+            if (stats.tgt_line != line) {
+                stats.tgt_doc_freq += 1;
+                stats.tgt_line = line;
+            }
+        }
+    }
+}
+
 void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineLength, double threshold) {
-    // For model efficiency all source words must have the lowest id possible
-    unordered_map<string, size_t> src_terms;
-    unordered_map<string, size_t> tgt_terms;
-    unordered_map<string, size_t> src_doc_term_freq;
-    unordered_map<string, size_t> tgt_doc_term_freq;
+    size_t threads = 1;
+#ifdef _OPENMP
+    threads = (size_t) omp_get_max_threads();
+#endif
 
-    vector<string> src, trg;
-    unordered_set<string> src_doc_terms, tgt_doc_terms;
+    // Every thread counts the words of its lines in its own shards; the next block of lines is read in background
+    vector<vector<TermTable>> counters(threads, vector<TermTable>(kTermShards));
     size_t n_docs = 0;
 
-    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
-        CorpusReader reader(*corpus, nullptr, maxLineLength, true);
+    CorporaLines lines(corpora);
+    vector<pair<string, string>> block, next_block;
+    bool has_block = lines(block);
+    uint64_t first_line = 0;
+
+    while (has_block) {
+        future<bool> next = async(launch::async, [&lines, &next_block] { return lines(next_block); });
+
+#pragma omp parallel reduction(+:n_docs)
+        {
+            size_t thread_id = 0;
+#ifdef _OPENMP
+            thread_id = (size_t) omp_get_thread_num();
+#endif
+            vector<TermTable> &shards = counters[thread_id];
+            vector<pair<const char *, size_t>> src, trg;
+
+#pragma omp for schedule(dynamic, 64)
+            for (size_t i = 0; i < block.size(); ++i) {
+                SplitLine(block[i].first, src);
+                SplitLine(block[i].second, trg);
+
+                // Same filter of CorpusReader, skipping empty lines
+                if (src.empty() || trg.empty())
+                    continue;
+                if (maxLineLength > 0 && (src.size() > maxLineLength || trg.size() > maxLineLength))
+                    continue;
+
+                CountWords(src, true, first_line + i, case_sensitive, locale, shards);
+                CountWords(trg, false, first_line + i, case_sensitive, locale, shards);
+                n_docs += 1;
+            }
+        }
 
-        while (reader.Read(src, trg)) {
-            src_doc_terms.clear();
-            tgt_doc_terms.clear();
+        first_line += block.size();
+        has_block = next.get();
+        block.swap(next_block);
+    }
 
-            for (auto w = src.begin(); w != src.end(); ++w) {
-                string src_term = case_sensitive ? *w : boost::locale::to_lower(*w, locale);
-                src_terms[src_term] += 1;
-                src_doc_terms.insert(src_term);
-            }
+    vector<TermTable> terms(kTermShards);
 
-            for (auto w = trg.begin(); w != trg.end(); ++w) {
-                string tgt_term = case_sensitive ? *w : boost::locale::to_lower(*w, locale);
-                tgt_terms[tgt_term] += 1;
-                tgt_doc_terms.insert(tgt_term);
-            }
+#pragma omp parallel for schedule(dynamic)
+    for (size_t shard = 0; shard < kTermShards; ++shard) {
+        for (size_t thread = 0; thread < threads; ++thread) {
+            TermTable &counter = counters[thread][shard];
+
+            for (auto entry = counter.entries.begin(); entry != counter.entries.end(); ++entry)
+                terms[shard].Get(entry->term.data(), entry->term.size(), entry->hash).Add(entry->stats);
+
+            counter = TermTable();
+        }
+    }
 
-            n_docs += 1;
-            for (auto w = src_doc_terms.begin(); w != src_doc_terms.end(); ++w)
-                src_doc_term_freq[*w] += 1;
-            for (auto w = tgt_doc_terms.begin(); w != tgt_doc_terms.end(); ++w)
-                tgt_doc_term_freq[*w] += 1;
+    // For model efficiency all source words must have the lowest id possible.
+    // Terms are added to the maps in the order they are first found in the corpora: the order of the maps, and so
+    // the order of the terms with the same count, does not depend on the number of threads
+    vector<pair<uint64_t, const TermTable::Entry *>> src_order, tgt_order;
+    for (auto shard = terms.begin(); shard != terms.end(); ++shard) {
+        for (auto entry = shard->entries.begin(); entry != shard->entries.end(); ++entry) {
+            if (entry->stats.src_rank != kNoRank)
+                src_order.emplace_back(entry->stats.src_rank, &*entry);
+            if (entry->stats.tgt_rank != kNoRank)
+                tgt_order.emplace_back(entry->stats.tgt_rank, &*entry);
         }
     }
 
+    std::sort(src_order.begin(), src_order.end());
+    std::sort(tgt_order.begin(), tgt_order.end());
+
+    unordered_map<string, size_t> src_terms;
+    unordered_map<string, size_t> tgt_terms;
+
+    for (auto entry = src_order.begin(); entry != src_order.end(); ++entry)
+        src_terms.emplace(entry->second->term, entry->second->stats.src_count);
+    for (auto entry = tgt_order.begin(); entry != tgt_order.end(); ++entry)
+        tgt_terms.emplace(entry->second->term, entry->second->stats.tgt_count);
+
     if (threshold > 0) {
         PruneTerms(src_terms, threshold);
         PruneTerms(tgt_terms, threshold);
@@ -183,12 +455,9 @@ void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineL
     vocab.reserve(size + 2);
 
     for (auto src_term = src_terms_array.begin(); src_term != src_terms_array.end(); ++src_term) {
-        size_t src_doc_freq = src_doc_term_freq[src_term->first];
-        size_t tgt_doc_freq = 0;
-
-        auto tgt_term = tgt_doc_term_freq.find(src_term->first);
-        if (tgt_term != tgt_doc_term_freq.end())
-            tgt_doc_freq = tgt_term->second;
+        const TermStats &stats = FindTerm(terms, src_term->first);
+        size_t src_doc_freq = stats.src_doc_freq;
+        size_t tgt_doc_freq = stats.tgt_doc_freq;
 
         probs[id].first = SmoothInverseDocumentFrequency(n_docs, src_doc_freq);
         probs[id].second = SmoothInverseDocumentFrequency(n_docs, tgt_doc_freq);
@@ -199,7 +468,7 @@ void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineL
 
     for (auto tgt_term = tgt_terms_array.begin(); tgt_term != tgt_terms_array.end(); ++tgt_term) {
         size_t src_doc_freq = 0;
-        size_t tgt_doc_freq = tgt_doc_term_freq[tgt_term->first];
+        size_t tgt_doc_freq = FindTerm(terms, tgt_term->first).tgt_doc_freq;
 
         probs[id].first = SmoothInverseDocumentFrequency(n_docs, src_doc_freq);
         probs[id].second = SmoothInverseDocumentFrequency(n_docs, tgt_doc_freq);
@@ -209,7 +478,37 @@ void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineL
     }
 }
 
-void Vocabulary::Store(ostream &out) {
+word_t Vocabulary::Add(const string &term) {
+    if (!has_new_term_probs) {
+        new_term_probs = pair<score_t, score_t>(0, 0);
+        for (auto p = probs.begin(); p != probs.end(); ++p) {
+            new_term_probs.first = std::max(new_term_probs.first, p->first);
+            new_term_probs.second = std::max(new_term_probs.second, p->second);
+        }
+
+        has_new_term_probs = true;
+    }
+
+    auto entry = vocab.emplace(case_sensitive ? term : boost::locale::to_lower(term, locale), (word_t) Size());
+    if (entry.second) {
+        probs.resize(entry.first->second);  // an empty vocabulary has no probabilities for the reserved ids
+        probs.push_back(new_term_probs);
+    }
+
+    return entry.first->second;
+}
+
+vector<word_t> Vocabulary::GetMapping(const Vocabulary &other) const {
+    vector<word_t> mapping(Size(), kUnknownWord);
+    mapping[kNullWord] = kNullWord;
+
+    for (auto entry = vocab.begin(); entry != vocab.end(); ++entry)
+        mapping[entry->second] = other.Get(entry->first);
+
+    return mapping;
+}
+
+void Vocabulary::Store(ostream &out) const {
     // Sorting entries by id
     vector<pair<string, size_t>> entries;
     entries.reserve(vocab.size());
@@ -235,3 +534,12 @@ void Vocabulary::Store(ostream &out) {
         io_write(out, entry->first);
     }
 }
+
+uint64_t Vocabulary::GetFingerprint() const {
+    // order-independent combination of (word, id) pairs
+    uint64_t fingerprint = Mix(Size() * 2 + (case_sensitive ? 1 : 0));
+    for (auto entry = vocab.begin(); entry != vocab.end(); ++entry)
+        fingerprint += Mix(HashString(entry->first) ^ Mix(entry->second));
+
+    return fingerprint;
+}
@@ -24,6 +24,10 @@ namespace mmt {
 
             explicit Vocabulary(std::istream &in);
 
+            /**
+             * Builds the vocabulary from the given corpora, skipping empty lines and lines longer than
+             * "maxLineLength" words. Words are counted in parallel; ids do not depend on the number of threads.
+             */
             void BuildFromCorpora(const std::vector<Corpus> &corpora, size_t maxLineLength = 0, double threshold = 0.);
 
             inline const size_t Size() const {
@@ -54,13 +58,35 @@ namespace mmt {
                 }
             }
 
-            void Store(std::ostream &out);
+            /**
+             * Returns the id of the given term, adding it with the next free id if it is missing. New terms
+             * are scored as the rarest terms of the vocabulary. This method is not thread-safe.
+             */
+            word_t Add(const std::string &term);
+
+            /**
+             * Returns the id in "other" of every id of this vocabulary, kUnknownWord for the terms missing from
+             * "other"; the reserved ids are mapped to themselves.
+             */
+            std::vector<word_t> GetMapping(const Vocabulary &other) const;
+
+            void Store(std::ostream &out) const;
+
+            /**
+             * Returns a hash of the words and ids of the vocabulary (probabilities excluded): two vocabularies
+             * with the same fingerprint encode text in the same way.
+             */
+            uint64_t GetFingerprint() const;
 
         private:
             std::locale locale;
             bool case_sensitive;
             std::vector<std::pair<score_t, score_t>> probs;
             std::unordered_map<std::string, word_t> vocab;
+
+            // score of the terms added with Add(), computed on the first call
+            bool has_new_term_probs = false;
+            std::pair<score_t, score_t> new_term_probs;
         };
 
     }
@@ -6,11 +6,6 @@
 #include "fastalign/FastAligner.h"
 #include "jniutil.h"
 
-#ifdef _OPENMP
-#include <omp.h>
-#endif
-
-
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
@@ -123,6 +118,34 @@ Java_eu_modernmt_aligner_fastalign_FastAlign_align__JZ_3_3Ljava_lang_String_2_3_
     return jarray;
 }
 
+/*
+ * Class:     eu_modernmt_aligner_fastalign_FastAlign
+ * Method:    update
+ * Signature: (JZ[[Ljava/lang/String;[[Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL
+Java_eu_modernmt_aligner_fastalign_FastAlign_update(JNIEnv *jvm, jobject jself, jlong jhandle, jboolean reversed,
+                                                    jobjectArray jsources, jobjectArray jtargets) {
+    FastAligner *aligner = reinterpret_cast<FastAligner *>(jhandle);
+    jsize length = jvm->GetArrayLength(jsources);
+
+    vector<pair<vector<string>, vector<string>>> batch;
+    batch.reserve((size_t) length);
+
+    for (jsize i = 0; i < length; i++) {
+        jobjectArray jsource = (jobjectArray) jvm->GetObjectArrayElement(jsources, i);
+        jobjectArray jtarget = (jobjectArray) jvm->GetObjectArrayElement(jtargets, i);
+
+        vector<string> source, target;
+        ParseSentence(jvm, reversed ? jtarget : jsource, source);
+        ParseSentence(jvm, reversed ? jsource : jtarget, target);
+
+        batch.push_back(pair<vector<string>, vector<string>>(source, target));
+    }
+
+    aligner->Update(batch);
+}
+
 /*
  * Class:     eu_modernmt_aligner_fastalign_FastAlign
  * Method:    dispose
@@ -5,6 +5,8 @@
 #include "SymAlignment.h"
 #include <stdlib.h>
 #include <cstring>
+#include <algorithm>
+#include <functional>
 
 using namespace std;
 using namespace mmt;
@@ -39,6 +41,11 @@ void SymAlignment::Reset(size_t _source_length, size_t _target_length) {
     if (m_size_ > m_size) {
         m_size = m_size_;
         m = (uint8_t *) realloc(m, m_size);
+        memset(m, 0, m_size);
+    } else {
+        // only the cells of the previous alignments have been set
+        for (auto point = union_points.begin(); point != union_points.end(); ++point)
+            m[*point] = 0;
     }
 
     if (source_length > src_coverage_size) {
@@ -51,72 +58,101 @@ void SymAlignment::Reset(size_t _source_length, size_t _target_length) {
         trg_coverage = (uint8_t *) realloc(trg_coverage, trg_coverage_size);
     }
 
-    memset(m, 0, m_size);
-    memset(src_coverage, 0, src_coverage_size);
-    memset(trg_coverage, 0, trg_coverage_size);
+    memset(src_coverage, 0, source_length);
+    memset(trg_coverage, 0, target_length);
+
+    union_points.clear();
+    points.clear();
 }
 
 void SymAlignment::Union(const alignment_t &forward, const alignment_t &backward) {
     Merge(forward, backward);
+
+    points = union_points;
 }
 
 void SymAlignment::Intersection(const alignment_t &forward, const alignment_t &backward) {
     Merge(forward, backward);
 
-    for (size_t i = 0; i < (source_length * target_length); ++i) {
-        m[i] = (uint8_t) (IsInIntersection(m[i]) ? 1 : 0);
+    for (auto point = union_points.begin(); point != union_points.end(); ++point) {
+        if (IsInIntersection(m[*point]))
+            points.push_back(*point);
     }
 }
 
+/*
+ * The points of the intersection, and the ones added, are expanded as in a scan of the whole matrix by target and
+ * then by source word, repeated until no point is added: a point added after the one being expanded (in scan
+ * order) is expanded later in the same scan, any other one in the next scan. Coverage only grows, so a neighbor
+ * that cannot be added now can never be added later: expanding every point once, in the same order of the scans,
+ * adds exactly the same points. The worklists of the current and of the next scan are min-heaps of the positions
+ * in scan order, and the final steps visit the union points in scan order too.
+ */
 void SymAlignment::Grow(const alignment_t &forward, const alignment_t &backward, bool diagonal, bool final) {
     Merge(forward, backward);
 
     size_t neighbors_size = diagonal ? 8 : 4;
 
-    bool added = true;
-    while (added) {
-        added = false;
+    worklist.clear();
+    next_worklist.clear();
 
-        for (size_t t = 0; t < target_length; ++t) {
-            for (size_t s = 0; s < source_length; ++s) {
-                uint8_t point = m[idx(s, t)];
+    for (auto point = union_points.begin(); point != union_points.end(); ++point) {
+        if (IsInIntersection(m[*point])) {
+            size_t s = *point / target_length;
+            size_t t = *point % target_length;
+            worklist.push_back(t * source_length + s);
+        }
+    }
 
-                if (IsInIntersection(point) || HasBeenAdded(point)) {
-                    for (size_t ni = 0; ni < neighbors_size; ++ni) {
-                        size_t ns = s + kGrowDiagonalNeighbors[ni][0];
-                        size_t nt = t + kGrowDiagonalNeighbors[ni][1];
-
-                        if (ns >= source_length || nt >= target_length)
-                            continue; // point is outside matrix
-
-                        if (!(src_coverage[ns] && trg_coverage[nt]) && IsInUnion(m[idx(ns, nt)])) {
-                            m[idx(ns, nt)] |= 0x04;
-                            src_coverage[ns] = 1;
-                            trg_coverage[nt] = 1;
-                            added = true;
-                        }
-                    }
-                }
+    std::make_heap(worklist.begin(), worklist.end(), greater<size_t>());
+
+    while (!worklist.empty()) {
+        std::pop_heap(worklist.begin(), worklist.end(), greater<size_t>());
+        size_t position = worklist.back();
+        worklist.pop_back();
+
+        size_t s = position % source_length;
+        size_t t = position / source_length;
+
+        for (size_t ni = 0; ni < neighbors_size; ++ni) {
+            size_t ns = s + kGrowDiagonalNeighbors[ni][0];
+            size_t nt = t + kGrowDiagonalNeighbors[ni][1];
+
+            if (ns >= source_length || nt >= target_length)
+                continue; // point is outside matrix
+
+            if (!(src_coverage[ns] && trg_coverage[nt]) && IsInUnion(m[idx(ns, nt)])) {
+                m[idx(ns, nt)] |= 0x04;
+                src_coverage[ns] = 1;
+                trg_coverage[nt] = 1;
+
+                size_t neighbor = nt * source_length + ns;
+                vector<size_t> &heap = neighbor > position ? worklist : next_worklist;
+                heap.push_back(neighbor);
+                std::push_heap(heap.begin(), heap.end(), greater<size_t>());
             }
         }
+
+        if (worklist.empty())
+            worklist.swap(next_worklist);
     }
 
     if (final) {
-        // Forward Final-And
-        for (size_t t = 0; t < target_length; ++t) {
-            for (size_t s = 0; s < source_length; ++s) {
-                if (IsInForward(m[idx(s, t)]) && !(src_coverage[s] || trg_coverage[t])) {
-                    m[idx(s, t)] |= 0x04;
-                    src_coverage[s] = 1;
-                    trg_coverage[t] = 1;
-                }
-            }
-        }
+        vector<size_t> &scan = worklist;
+        for (auto point = union_points.begin(); point != union_points.end(); ++point)
+            scan.push_back((*point % target_length) * source_length + *point / target_length);
+        std::sort(scan.begin(), scan.end());
+
+        // Forward Final-And, then Backward Final-And
+        for (size_t pass = 0; pass < 2; ++pass) {
+            for (auto position = scan.begin(); position != scan.end(); ++position) {
+                size_t s = *position % source_length;
+                size_t t = *position / source_length;
 
-        // Forward Final-And
-        for (size_t t = 0; t < target_length; ++t) {
-            for (size_t s = 0; s < source_length; ++s) {
-                if (IsInBackward(m[idx(s, t)]) && !(src_coverage[s] || trg_coverage[t])) {
+                uint8_t point = m[idx(s, t)];
+                bool aligned = pass == 0 ? IsInForward(point) : IsInBackward(point);
+
+                if (aligned && !(src_coverage[s] || trg_coverage[t])) {
                     m[idx(s, t)] |= 0x04;
                     src_coverage[s] = 1;
                     trg_coverage[t] = 1;
@@ -125,20 +161,22 @@ void SymAlignment::Grow(const alignment_t &forward, const alignment_t &backward,
         }
     }
 
-    for (size_t i = 0; i < (source_length * target_length); ++i)
-        m[i] = (uint8_t) (IsInIntersection(m[i]) || HasBeenAdded(m[i]) ? 1 : 0);
+    for (auto point = union_points.begin(); point != union_points.end(); ++point) {
+        if (IsInIntersection(m[*point]) || HasBeenAdded(m[*point]))
+            points.push_back(*point);
+    }
 }
 
 alignment_t SymAlignment::ToAlignment() {
     alignment_t alignment;
     alignment.score = score;
 
-    for (size_t s = 0; s < source_length; ++s) {
-        for (size_t t = 0; t < target_length; ++t) {
-            if (m[idx(s, t)] > 0)
-                alignment.points.emplace_back(s, t);
-        }
-    }
+    // cells are sorted by source and then by target word
+    std::sort(points.begin(), points.end());
+
+    alignment.points.reserve(points.size());
+    for (auto point = points.begin(); point != points.end(); ++point)
+        alignment.points.emplace_back(*point / target_length, *point % target_length);
 
     return alignment;
 }
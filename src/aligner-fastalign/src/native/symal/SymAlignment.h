@@ -6,11 +6,19 @@
 #define FASTALIGN_SYMMETRIZER_H
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <vector>
 #include <fastalign/alignment.h>
 
 namespace mmt {
     namespace fastalign {
 
+        /**
+         * Symmetrizes a forward and a backward alignment of the same sentence pair. The cells of the matrix are
+         * only visited through the points of the two alignments: Grow() expands a worklist of the points added,
+         * visiting the neighbors of every point once, and ToAlignment() emits the resulting points directly.
+         * Scratch buffers are reused by Reset(), so an instance should be reused for many sentence pairs.
+         */
         class SymAlignment {
         public:
 
@@ -20,10 +28,14 @@ namespace mmt {
                 Reset(source_length, target_length);
             }
 
+            SymAlignment(const SymAlignment &) = delete;
+
+            SymAlignment &operator=(const SymAlignment &) = delete;
+
             ~SymAlignment() {
-                delete[] m;
-                delete[] src_coverage;
-                delete[] trg_coverage;
+                free(m);
+                free(src_coverage);
+                free(trg_coverage);
             }
 
             void Reset(size_t source_length, size_t target_length);
@@ -50,6 +62,14 @@ namespace mmt {
             size_t src_coverage_size = 0;
             size_t trg_coverage_size = 0;
 
+            // Cells (see idx()) of the union of the alignments, and of the symmetrized alignment
+            std::vector<size_t> union_points;
+            std::vector<size_t> points;
+
+            // Grow() worklists, as min-heaps of scan positions (see Grow())
+            std::vector<size_t> worklist;
+            std::vector<size_t> next_worklist;
+
             inline size_t idx(size_t s, size_t t) {
                 return s * target_length + t;
             }
@@ -57,12 +77,19 @@ namespace mmt {
             inline void Merge(const alignment_t &forward, const alignment_t &backward) {
                 score = (forward.score + backward.score) / 2;
 
-                for (auto it = forward.points.begin(); it != forward.points.end(); ++it)
-                    m[idx(it->first, it->second)] |= 0x01;
+                for (auto it = forward.points.begin(); it != forward.points.end(); ++it) {
+                    size_t i = idx(it->first, it->second);
+
+                    if (m[i] == 0)
+                        union_points.push_back(i);
+                    m[i] |= 0x01;
+                }
 
                 for (auto it = backward.points.begin(); it != backward.points.end(); ++it) {
                     size_t i = idx(it->first, it->second);
 
+                    if (m[i] == 0)
+                        union_points.push_back(i);
                     m[i] |= 0x02;
 
                     if ((m[i] & 0x03) == 0x03) {
@@ -33,4 +33,12 @@ public interface Aligner extends Closeable {
 
     boolean isSupported(LanguageDirection direction);
 
+    /**
+     * Updates the model of the given direction with new sentence pairs, so that the next alignments take them into
+     * account. The default implementation does nothing.
+     */
+    default void update(LanguageDirection direction, List<? extends Sentence> sources, List<? extends Sentence> targets) throws AlignerException {
+        // Nothing to do
+    }
+
 }
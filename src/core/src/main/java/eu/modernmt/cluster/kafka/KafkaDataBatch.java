@@ -159,8 +159,10 @@ class KafkaDataBatch implements DataBatch {
                 List<Sentence> targetSentences = preprocessor.process(direction.reversed(), targets);
                 Alignment[] alignments = null;
 
-                if (align)
+                if (align) {
+                    aligner.update(direction, sourceSentences, targetSentences);
                     alignments = aligner.getAlignments(direction, sourceSentences, targetSentences);
+                }
 
                 for (int i = 0; i < packets.size(); i++) {
                     Sentence sentence = sourceSentences.get(i);